@@ -0,0 +1,250 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Adaptive slots.
+ * With TS_ADAPTIVE_SLOTS="min-max" when starting the server, the number of
+ * slots follows the load of the machine. Every TS_ADAPTIVE_INTERVAL seconds
+ * the server reads the "some avg10" of /proc/pressure/{cpu,memory,io} and
+ * the load average. Over any high mark, it takes one slot away; under all
+ * the low marks, and with jobs waiting, it gives one more. The running jobs
+ * are never stopped: with fewer slots, they just aren't replaced. */
+
+enum
+{
+    ADAPT_DEFAULT_INTERVAL = 5, /* seconds */
+    ADAPT_HISTORY = 5, /* changes shown in ts -S */
+    ADAPT_CPU_HIGH = 40, /* percent of time stalled, for "some avg10" */
+    ADAPT_CPU_LOW = 10,
+    ADAPT_MEMORY_HIGH = 10,
+    ADAPT_MEMORY_LOW = 1,
+    ADAPT_IO_HIGH = 30,
+    ADAPT_IO_LOW = 5,
+    ADAPT_LOAD_LOW = 75 /* percent of the cpus */
+};
+
+struct Change
+{
+    time_t when;
+    int from;
+    int to;
+    char reason[100];
+};
+
+/* in jobs.c */
+extern int max_slots;
+
+/* Globals */
+static int enabled = 0;
+static int min_slots;
+static int max_bound;
+static int interval;
+static time_t last_check = 0;
+static struct Change history[ADAPT_HISTORY];
+static int changes = 0;
+
+/* Last readings; -1 if the file is missing, as without PSI */
+static float cpu_pressure = -1;
+static float memory_pressure = -1;
+static float io_pressure = -1;
+static float loadavg = -1;
+
+static float read_pressure(const char *resource)
+{
+    char path[40];
+    char line[200];
+    float value = -1;
+    FILE *f;
+
+    sprintf(path, "/proc/pressure/%s", resource);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "some avg10=%f", &value) == 1)
+            break;
+    fclose(f);
+    return value;
+}
+
+static float read_loadavg()
+{
+    float value = -1;
+    FILE *f;
+
+    f = fopen("/proc/loadavg", "r");
+    if (f == NULL)
+        return -1;
+    if (fscanf(f, "%f", &value) != 1)
+        value = -1;
+    fclose(f);
+    return value;
+}
+
+static int clamp(int slots)
+{
+    if (slots < min_slots)
+        return min_slots;
+    if (slots > max_bound)
+        return max_bound;
+    return slots;
+}
+
+static void change_slots(int to, const char *reason)
+{
+    struct Change *c;
+
+    c = &history[changes % ADAPT_HISTORY];
+    c->when = time(NULL);
+    c->from = max_slots;
+    c->to = to;
+    strncpy(c->reason, reason, sizeof(c->reason) - 1);
+    c->reason[sizeof(c->reason) - 1] = '\0';
+    ++changes;
+
+    max_slots = to;
+}
+
+/* Server side, on start, once TS_SLOTS is applied */
+void adapt_init()
+{
+    char *str;
+    int from, to;
+
+    str = getenv("TS_ADAPTIVE_SLOTS");
+    if (str == NULL)
+        return;
+    if (sscanf(str, "%i-%i", &from, &to) != 2 || from < 1 || to < from)
+    {
+        warning("Wrong TS_ADAPTIVE_SLOTS \"%s\". Use min-max.", str);
+        return;
+    }
+    min_slots = from;
+    max_bound = to;
+
+    interval = ADAPT_DEFAULT_INTERVAL;
+    str = getenv("TS_ADAPTIVE_INTERVAL");
+    if (str != NULL && atoi(str) > 0)
+        interval = atoi(str);
+
+    enabled = 1;
+    /* The first check goes right away */
+    last_check = 0;
+    if (clamp(max_slots) != max_slots)
+        change_slots(clamp(max_slots), "out of the TS_ADAPTIVE_SLOTS bounds");
+}
+
+/* Seconds until the next check, -1 if there is none */
+int adapt_timeout()
+{
+    long left;
+
+    if (!enabled)
+        return -1;
+    left = last_check + interval - time(NULL);
+    return left > 0 ? left : 0;
+}
+
+/* Server side, on each loop. Does nothing until it is time. */
+void adapt_check()
+{
+    char reason[100];
+    long ncpus;
+
+    if (!enabled || adapt_timeout() > 0)
+        return;
+    last_check = time(NULL);
+
+    cpu_pressure = read_pressure("cpu");
+    memory_pressure = read_pressure("memory");
+    io_pressure = read_pressure("io");
+    loadavg = read_loadavg();
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        ncpus = 1;
+
+    reason[0] = '\0';
+    if (memory_pressure >= ADAPT_MEMORY_HIGH)
+        sprintf(reason, "memory pressure %.2f%%", memory_pressure);
+    else if (io_pressure >= ADAPT_IO_HIGH)
+        sprintf(reason, "io pressure %.2f%%", io_pressure);
+    else if (cpu_pressure >= ADAPT_CPU_HIGH)
+        sprintf(reason, "cpu pressure %.2f%%", cpu_pressure);
+    else if (loadavg > ncpus)
+        sprintf(reason, "load average %.2f over %li cpus", loadavg, ncpus);
+
+    if (reason[0] != '\0')
+    {
+        if (max_slots > min_slots)
+            change_slots(clamp(max_slots - 1), reason);
+        return;
+    }
+
+    /* Missing files don't hold the growth back */
+    if (cpu_pressure < ADAPT_CPU_LOW && memory_pressure < ADAPT_MEMORY_LOW
+            && io_pressure < ADAPT_IO_LOW
+            && loadavg * 100 < ncpus * ADAPT_LOAD_LOW
+            && max_slots < max_bound && s_jobs_waiting())
+    {
+        sprintf(reason, "low pressure, load average %.2f, jobs waiting",
+                loadavg);
+        change_slots(clamp(max_slots + 1), reason);
+    }
+}
+
+/* The slots for "ts -S <num>", within the bounds */
+int adapt_manual_slots(int slots)
+{
+    if (!enabled)
+        return slots;
+    change_slots(clamp(slots), "set with ts -S");
+    return max_slots;
+}
+
+/* For ts -S, after the number of slots */
+void adapt_report(int s)
+{
+    char line[200];
+    int i;
+
+    if (!enabled)
+        return;
+
+    snprintf(line, sizeof(line), "Adaptive slots: %i to %i, checked every "
+            "%is\n", min_slots, max_bound, interval);
+    send_list_line(s, line);
+    if (last_check != 0)
+    {
+        snprintf(line, sizeof(line), "Pressure (some avg10): cpu %.2f%%, "
+                "memory %.2f%%, io %.2f%%; load average %.2f\n",
+                cpu_pressure, memory_pressure, io_pressure, loadavg);
+        send_list_line(s, line);
+    }
+
+    i = changes - ADAPT_HISTORY;
+    if (i < 0)
+        i = 0;
+    for (; i < changes; ++i)
+    {
+        const struct Change *c = &history[i % ADAPT_HISTORY];
+        char date[30];
+
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+                localtime(&c->when));
+        snprintf(line, sizeof(line), "%s: %i -> %i, %s\n", date, c->from,
+                c->to, c->reason);
+        send_list_line(s, line);
+    }
+}
@@ -0,0 +1,289 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+/* sched_setaffinity() and the cpu_set_t macros are linux extensions */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include "main.h"
+
+/* Affinity.
+ * With TS_AFFINITY set when starting the server, each slot is a cpu. A job
+ * of N slots gets N free cpus of the server cpu set, all of them in one NUMA
+ * node if some node has enough free (the one with the fewest, not to split
+ * the big holes), and its memory is bound to that node. The client pins
+ * the job before the exec. The cpus go back in job_finished(). */
+
+enum
+{
+    MPOL_BIND_POLICY = 2 /* MPOL_BIND of <numaif.h>, not always installed */
+};
+
+#ifdef __linux__
+
+struct Cpu
+{
+    int id;
+    int node;
+    int jobid; /* -1 if free */
+};
+
+/* Globals, server side */
+static struct Cpu *cpus = 0;
+static int ncpus = 0;
+static int nnodes = 0;
+
+/* "0-3,8,10-11" into set. Returns 0 if wrong. */
+static int parse_cpulist(const char *str, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    while (*str != '\0' && *str != '\n')
+    {
+        char *end;
+        long first, last;
+
+        first = strtol(str, &end, 10);
+        if (end == str)
+            return 0;
+        last = first;
+        if (*end == '-')
+        {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str)
+                return 0;
+        }
+        for (; first <= last && first < CPU_SETSIZE; ++first)
+            CPU_SET(first, set);
+        str = end;
+        if (*str == ',')
+            ++str;
+    }
+    return 1;
+}
+
+static int node_of_cpu(int cpu)
+{
+    char path[60];
+    char line[1000];
+    cpu_set_t set;
+    FILE *f;
+    int node;
+
+    for (node = 0; node < CPU_SETSIZE; ++node)
+    {
+        sprintf(path, "/sys/devices/system/node/node%i/cpulist", node);
+        f = fopen(path, "r");
+        /* Without NUMA, there is no node directory at all */
+        if (f == NULL)
+            return 0;
+        if (fgets(line, sizeof(line), f) == NULL)
+            line[0] = '\0';
+        fclose(f);
+        if (parse_cpulist(line, &set) && CPU_ISSET(cpu, &set))
+            return node;
+    }
+    return 0;
+}
+
+/* Server side, on start */
+void affinity_init()
+{
+    cpu_set_t allowed;
+    int cpu;
+
+    if (getenv("TS_AFFINITY") == NULL)
+        return;
+
+    /* "taskset -c 0-31 ts ..." leaves the other cpus out */
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        warning("Cannot get the cpus of the server, for TS_AFFINITY");
+        return;
+    }
+
+    cpus = (struct Cpu *) malloc(CPU_COUNT(&allowed) * sizeof(*cpus));
+    if (cpus == 0)
+        error("Cannot allocate memory for the cpu list");
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &allowed))
+        {
+            cpus[ncpus].id = cpu;
+            cpus[ncpus].node = node_of_cpu(cpu);
+            cpus[ncpus].jobid = -1;
+            if (cpus[ncpus].node >= nnodes)
+                nnodes = cpus[ncpus].node + 1;
+            ++ncpus;
+        }
+}
+
+static int free_in_node(int node)
+{
+    int i;
+    int n = 0;
+
+    for (i = 0; i < ncpus; ++i)
+        if (cpus[i].node == node && cpus[i].jobid == -1)
+            ++n;
+    return n;
+}
+
+/* Takes up to n free cpus of the node */
+static int take_cpus(int jobid, int node, int n)
+{
+    int i;
+    int taken = 0;
+
+    for (i = 0; i < ncpus && taken < n; ++i)
+        if (cpus[i].node == node && cpus[i].jobid == -1)
+        {
+            cpus[i].jobid = jobid;
+            ++taken;
+        }
+    return taken;
+}
+
+/* The cpus of the job, as "0-3,8" (malloc'ed) */
+static char * job_cpulist(int jobid)
+{
+    char *str;
+    int used = 0;
+    int i;
+
+    /* Up to 11 chars per cpu and the final \0 */
+    str = (char *) malloc(ncpus * 12 + 1);
+    if (str == 0)
+        error("Cannot allocate memory for the cpu list");
+    str[0] = '\0';
+    for (i = 0; i < ncpus; ++i)
+    {
+        int last = i;
+
+        if (cpus[i].jobid != jobid)
+            continue;
+        /* Group the consecutive ones */
+        while (last + 1 < ncpus && cpus[last + 1].jobid == jobid
+                && cpus[last + 1].id == cpus[last].id + 1)
+            ++last;
+        if (last == i)
+            used += sprintf(str + used, "%s%i", used ? "," : "", cpus[i].id);
+        else
+            used += sprintf(str + used, "%s%i-%i", used ? "," : "",
+                    cpus[i].id, cpus[last].id);
+        i = last;
+    }
+    return str;
+}
+
+/* Server side. Returns the cpus for the job (malloc'ed), or 0 if it is not
+ * to be pinned. *node is the NUMA node to bind its memory to, or -1. */
+char * affinity_assign(int jobid, int nslots, int *node)
+{
+    int best = -1;
+    int total = 0;
+    int i;
+
+    *node = -1;
+    if (ncpus == 0 || nslots <= 0)
+        return 0;
+
+    for (i = 0; i < nnodes; ++i)
+    {
+        int n = free_in_node(i);
+        total += n;
+        if (n >= nslots && (best == -1 || n < free_in_node(best)))
+            best = i;
+    }
+
+    /* More slots than cpus: better not pinned than all on the same cpus */
+    if (total < nslots)
+        return 0;
+
+    if (best != -1)
+    {
+        take_cpus(jobid, best, nslots);
+        /* With one node, there is nothing to bind */
+        if (nnodes > 1)
+            *node = best;
+    }
+    else
+    {
+        /* Spread over the nodes, the freest first */
+        while (nslots > 0)
+        {
+            best = 0;
+            for (i = 1; i < nnodes; ++i)
+                if (free_in_node(i) > free_in_node(best))
+                    best = i;
+            nslots -= take_cpus(jobid, best, nslots);
+        }
+    }
+    return job_cpulist(jobid);
+}
+
+/* Server side */
+void affinity_release(int jobid)
+{
+    int i;
+
+    for (i = 0; i < ncpus; ++i)
+        if (cpus[i].jobid == jobid)
+            cpus[i].jobid = -1;
+}
+
+/* Job side, before the exec */
+void affinity_apply(const char *cpulist, int node)
+{
+    cpu_set_t set;
+
+    if (!parse_cpulist(cpulist, &set)
+            || sched_setaffinity(0, sizeof(set), &set) == -1)
+        warning("Cannot set the affinity of the job to the cpus %s", cpulist);
+
+#ifdef SYS_set_mempolicy
+    if (node >= 0)
+    {
+        unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))];
+        memset(mask, 0, sizeof(mask));
+        mask[node / (8 * sizeof(unsigned long))] |=
+            1UL << (node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_set_mempolicy, MPOL_BIND_POLICY, mask,
+                    sizeof(mask) * 8) == -1)
+            warning("Cannot bind the memory of the job to the node %i", node);
+    }
+#endif
+}
+
+#else /* __linux__ */
+
+void affinity_init()
+{
+}
+
+char * affinity_assign(int jobid, int nslots, int *node)
+{
+    *node = -1;
+    return 0;
+}
+
+void affinity_release(int jobid)
+{
+}
+
+void affinity_apply(const char *cpulist, int node)
+{
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,194 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* AIMD concurrency.
+ * With TS_AIMD="label=max[:target],..." when starting the server, the jobs
+ * of each label run at most limit at once, as TCP does with its window: the
+ * limit starts at 1, grows by 1/limit on each job ending well within target
+ * seconds (one more job per round), and halves on a failure or on a job
+ * slower than the target. Only a job started after the last halving can
+ * halve it again, so a burst of failures of the same round counts once. */
+
+struct Window
+{
+    char *label;
+    int max;
+    float target; /* seconds, 0 means no latency target */
+    double limit;
+    struct timeval last_decrease;
+    long ok;
+    long failed;
+    long slow;
+    struct Window *next;
+};
+
+/* Globals */
+static struct Window *first_window = 0;
+
+/* "label=max[:target]" into a new window. Returns 0 if wrong. */
+static struct Window * new_window(const char *str, int label_len)
+{
+    struct Window *w;
+    char *end;
+    long max;
+    double target = 0;
+
+    max = strtol(str + label_len + 1, &end, 10);
+    if (end == str + label_len + 1 || max < 1)
+        return 0;
+    if (*end == ':')
+    {
+        const char *start = end + 1;
+        target = strtod(start, &end);
+        if (end == start || target <= 0)
+            return 0;
+    }
+    if (*end != '\0' && *end != ',')
+        return 0;
+
+    w = (struct Window *) malloc(sizeof(*w));
+    if (w == 0)
+        error("Cannot allocate memory for the AIMD windows");
+    w->label = (char *) malloc(label_len + 1);
+    if (w->label == 0)
+        error("Cannot allocate memory for the AIMD windows");
+    strncpy(w->label, str, label_len);
+    w->label[label_len] = '\0';
+    w->max = max;
+    w->target = target;
+    w->limit = 1;
+    w->last_decrease.tv_sec = 0;
+    w->last_decrease.tv_usec = 0;
+    w->ok = 0;
+    w->failed = 0;
+    w->slow = 0;
+    w->next = 0;
+    return w;
+}
+
+/* Server side, on start */
+void aimd_init()
+{
+    struct Window **last = &first_window;
+    char *str;
+
+    str = getenv("TS_AIMD");
+    while (str != NULL && *str != '\0')
+    {
+        struct Window *w = 0;
+        int len;
+
+        len = strcspn(str, "=,");
+        if (str[len] == '=' && len > 0)
+            w = new_window(str, len);
+        if (w == 0)
+        {
+            warning("Wrong TS_AIMD at \"%s\". Use label=max[:target],...",
+                    str);
+            return;
+        }
+        *last = w;
+        last = &w->next;
+        str = strchr(str + len + 1, ',');
+        if (str != NULL)
+            ++str;
+    }
+}
+
+static struct Window * find_window(const char *label)
+{
+    struct Window *w;
+
+    if (label == 0)
+        return 0;
+    for (w = first_window; w != 0; w = w->next)
+        if (strcmp(w->label, label) == 0)
+            return w;
+    return 0;
+}
+
+/* Server side. Whether the job can start, with the jobs of its label
+ * already running. */
+int aimd_admits(const struct Job *p)
+{
+    struct Window *w;
+
+    w = find_window(p->label);
+    if (w == 0)
+        return 1;
+    return s_running_with_label(w->label) < (int) w->limit;
+}
+
+static int started_before(const struct timeval *a, const struct timeval *b)
+{
+    return a->tv_sec < b->tv_sec
+        || (a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+/* Server side, when a job that ran ends, for good or to be retried */
+void aimd_learn(const struct Job *p, const struct Result *result)
+{
+    struct Window *w;
+    int failed, slow;
+
+    w = find_window(p->label);
+    if (w == 0 || result->skipped)
+        return;
+
+    failed = result->died_by_signal || result->errorlevel != 0;
+    slow = !failed && w->target > 0 && result->real_ms > w->target;
+    if (failed)
+        ++w->failed;
+    else if (slow)
+        ++w->slow;
+    else
+        ++w->ok;
+
+    if (!failed && !slow)
+    {
+        w->limit += 1 / w->limit;
+        if (w->limit > w->max)
+            w->limit = w->max;
+        return;
+    }
+
+    /* Once per round */
+    if (started_before(&p->info.start_time, &w->last_decrease))
+        return;
+    w->limit /= 2;
+    if (w->limit < 1)
+        w->limit = 1;
+    gettimeofday(&w->last_decrease, NULL);
+}
+
+/* For --stats */
+void aimd_stats(int s)
+{
+    struct Window *w;
+    char line[300];
+
+    for (w = first_window; w != 0; w = w->next)
+    {
+        char target[30] = "";
+
+        if (w->target > 0)
+            sprintf(target, ", target %gs", w->target);
+        snprintf(line, sizeof(line), "AIMD %.100s: %i running, limit %.2f "
+                "of %i%s; %ld ok, %ld slow, %ld failed\n", w->label,
+                s_running_with_label(w->label), w->limit, w->max, target,
+                w->ok, w->slow, w->failed);
+        send_list_line(s, line);
+    }
+}
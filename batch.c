@@ -0,0 +1,261 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+#include "main.h"
+
+/* Batches.
+ * ts --batch FILE queues the commands in FILE, one per line, as a single
+ * job, so they pay for one NEWJOB, RUNJOB and output file in all. On
+ * RUNJOB, a runner takes the place of the command: it runs them one after
+ * the other in one slot, all writing to the output of the job, and tells
+ * the client how each one ended. The client sends the counts to the server
+ * at most every BATCH_REPORT_MS, for the list. Lines without any shell
+ * character run without a shell. All the commands run, and the batch ends
+ * with the exit code of the first failure. */
+
+enum
+{
+    BATCH_REPORT_MS = 200,
+    BATCH_NOT_RUN = 127 /* As sh, for a command not found */
+};
+
+/* Runner to client */
+struct Batch_record
+{
+    int index;
+    int errorlevel; /* 128 + the signal, if killed by one */
+    float time; /* seconds */
+};
+
+/* Globals of the runner */
+static int batch_child = 0;
+static int batch_stop = 0;
+
+/* Client side, before NEWJOB: the commands, skipping the empty lines and
+ * the comments */
+void batch_read()
+{
+    char *buffer = 0;
+    long size = 0;
+    long alloc = 0;
+    FILE *f;
+    char *line;
+    int res;
+    int n = 0;
+
+    if (strcmp(command_line.batch.file, "-") == 0)
+        f = stdin;
+    else
+        f = fopen(command_line.batch.file, "r");
+    if (f == NULL)
+        error("Cannot open the batch %s", command_line.batch.file);
+
+    do
+    {
+        if (alloc - size < 4096)
+        {
+            alloc = alloc * 2 + 4096;
+            buffer = (char *) realloc(buffer, alloc + 1);
+            if (buffer == 0)
+                error("Cannot allocate memory for the batch");
+        }
+        res = fread(buffer + size, 1, alloc - size, f);
+        size += res;
+    } while (res > 0);
+    buffer[size] = '\0';
+    if (f != stdin)
+        fclose(f);
+
+    for (line = buffer; line < buffer + size; ++line)
+        if (*line == '\n')
+            ++n;
+    command_line.batch.lines = (char **) malloc((n + 1) * sizeof(char *));
+    if (command_line.batch.lines == 0)
+        error("Cannot allocate memory for the batch");
+
+    n = 0;
+    for (line = strtok(buffer, "\n"); line != 0; line = strtok(0, "\n"))
+    {
+        line += strspn(line, " \t");
+        if (*line == '\0' || *line == '#')
+            continue;
+        command_line.batch.lines[n++] = line;
+    }
+    command_line.batch.lines[n] = 0;
+    command_line.batch.num = n;
+    if (n == 0)
+        error("No commands in the batch %s", command_line.batch.file);
+}
+
+/* In the child of the runner. Doesn't return. */
+static void exec_line(char *line)
+{
+    char **argv;
+    char *word;
+    int n = 0;
+
+    if (strpbrk(line, "\"'\\$`*?[]{}()<>|&;~#=") != 0)
+    {
+        execl("/bin/sh", "sh", "-c", line, (char *) 0);
+    }
+    else
+    {
+        argv = (char **) malloc((strlen(line) / 2 + 2) * sizeof(char *));
+        if (argv == 0)
+            _exit(BATCH_NOT_RUN);
+        for (word = strtok(line, " \t"); word != 0; word = strtok(0, " \t"))
+            argv[n++] = word;
+        argv[n] = 0;
+        execvp(argv[0], argv);
+    }
+    fprintf(stderr, "ts could not run the command %s\n", line);
+    _exit(BATCH_NOT_RUN);
+}
+
+/* ^C stops the command running, and the batch after it */
+static void batch_sigint(int s)
+{
+    batch_stop = 1;
+    if (batch_child != 0)
+        kill(batch_child, s);
+}
+
+/* The job process of a batch. Doesn't return. */
+void run_batch(int fd_progress)
+{
+    struct Batch_record record;
+    struct timeval starttv, endtv;
+    struct sigaction act;
+    int first_errorlevel = 0;
+    int status;
+    int i;
+
+    act.sa_handler = batch_sigint;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    sigaction(SIGINT, &act, 0);
+
+    for (i = 0; i < command_line.batch.num && !batch_stop; ++i)
+    {
+        gettimeofday(&starttv, NULL);
+        batch_child = fork();
+        if (batch_child == 0)
+        {
+            signal(SIGINT, SIG_DFL);
+            exec_line(command_line.batch.lines[i]);
+        }
+        if (batch_child == -1)
+            error("forking");
+        while (waitpid(batch_child, &status, 0) == -1 && errno == EINTR)
+            ;
+        batch_child = 0;
+        gettimeofday(&endtv, NULL);
+
+        record.index = i;
+        if (WIFSIGNALED(status))
+            record.errorlevel = 128 + WTERMSIG(status);
+        else
+            record.errorlevel = WEXITSTATUS(status);
+        record.time = endtv.tv_sec - starttv.tv_sec
+            + (endtv.tv_usec - starttv.tv_usec) / 1000000.;
+        if (record.errorlevel != 0 && first_errorlevel == 0)
+            first_errorlevel = record.errorlevel;
+        write(fd_progress, &record, sizeof(record));
+    }
+    exit(first_errorlevel);
+}
+
+static long ms_since(const struct timeval *tv)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - tv->tv_sec) * 1000
+        + (now.tv_usec - tv->tv_usec) / 1000;
+}
+
+/* Client side, while the runner goes. Returns on its end. */
+void batch_follow(int fd_progress)
+{
+    struct Batch_progress progress;
+    struct Batch_record records[64];
+    struct timeval last;
+    int changed = 0;
+    int res;
+    int i;
+
+    progress.done = 0;
+    progress.failed = 0;
+    progress.first_failed = -1;
+    progress.first_errorlevel = 0;
+    progress.slowest = -1;
+    progress.slowest_time = 0;
+    gettimeofday(&last, NULL);
+
+    while (1)
+    {
+        fd_set readset;
+        struct timeval tv;
+        long wait = 0;
+
+        /* Whatever came, on time */
+        if (changed)
+        {
+            wait = BATCH_REPORT_MS - ms_since(&last);
+            if (wait <= 0)
+            {
+                c_send_batch_progress(&progress);
+                gettimeofday(&last, NULL);
+                changed = 0;
+            }
+        }
+        FD_ZERO(&readset);
+        FD_SET(fd_progress, &readset);
+        tv.tv_sec = 0;
+        tv.tv_usec = wait * 1000;
+        res = select(fd_progress + 1, &readset, NULL, NULL,
+                changed ? &tv : NULL);
+        if (res <= 0)
+            continue;
+
+        res = read(fd_progress, records, sizeof(records));
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        /* The records are written at once, and the buffer holds whole ones */
+        for (i = 0; i < res / (int) sizeof(records[0]); ++i)
+        {
+            const struct Batch_record *r = &records[i];
+
+            ++progress.done;
+            if (r->errorlevel != 0 && ++progress.failed == 1)
+            {
+                progress.first_failed = r->index;
+                progress.first_errorlevel = r->errorlevel;
+            }
+            if (progress.slowest == -1 || r->time > progress.slowest_time)
+            {
+                progress.slowest = r->index;
+                progress.slowest_time = r->time;
+            }
+        }
+        changed = 1;
+    }
+    if (changed)
+        c_send_batch_progress(&progress);
+}
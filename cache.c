@@ -0,0 +1,389 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Result cache.
+ * A job queued with --cache (or --input) carries a key: a hash of its
+ * command, its directory, the variables named in TS_CACHE_ENV and the size
+ * and mtime of each --input file. With TS_CACHE naming a file when
+ * starting the server, the jobs that end well store their result and output
+ * file there under their key. A job with a known key does not run: it ends
+ * at once, without a slot, with the stored result and output. The cache
+ * keeps the TS_CACHE_SIZE entries used last (1000 by default); an entry
+ * whose output is reclaimed goes with it, and one whose output went away
+ * otherwise is dropped when found. The file is written again on each
+ * change. */
+
+enum
+{
+    CACHE_DEFAULT_SIZE = 1000,
+    CACHE_PATH_SIZE = 4096
+};
+
+struct Cache_entry
+{
+    char key[CACHE_KEY_SIZE];
+    time_t created;
+    struct Result result;
+    char *output; /* 0 if the job didn't store it */
+    struct Cache_entry *next;
+};
+
+/* Globals */
+static struct Cache_entry *first_entry = 0; /* The last used first */
+static const char *cache_file = 0;
+static int cache_size = CACHE_DEFAULT_SIZE;
+static int entries = 0;
+static long hits = 0;
+static long misses = 0;
+
+/* Client side */
+
+/* Two 32 bit hashes, FNV-1a and djb2, for a 64 bit key */
+static void hash_bytes(unsigned long h[2], const char *data, int len)
+{
+    int i;
+
+    for (i = 0; i < len; ++i)
+    {
+        unsigned char c = data[i];
+        h[0] = ((h[0] ^ c) * 16777619UL) & 0xffffffffUL;
+        h[1] = ((h[1] * 33) ^ c) & 0xffffffffUL;
+    }
+}
+
+static void hash_string(unsigned long h[2], const char *str)
+{
+    /* With the \0, so "ab","c" is not "a","bc" */
+    hash_bytes(h, str, strlen(str) + 1);
+}
+
+/* key gets CACHE_KEY_SIZE chars, or "" if the job doesn't use the cache */
+void cache_key(char *key)
+{
+    unsigned long h[2];
+    char buf[CACHE_PATH_SIZE];
+    char *command;
+    const char *vars;
+    struct stat st;
+    int i;
+
+    key[0] = '\0';
+    if (!command_line.cache.use)
+        return;
+
+    h[0] = 2166136261UL;
+    h[1] = 5381;
+
+    command = build_command_string();
+    hash_string(h, command);
+    free(command);
+
+    if (getcwd(buf, sizeof(buf)) == NULL)
+        error("Cannot get the directory for the cache key");
+    hash_string(h, buf);
+
+    vars = getenv("TS_CACHE_ENV");
+    while (vars != NULL && *vars != '\0')
+    {
+        const char *value;
+        int len;
+
+        len = strcspn(vars, ",");
+        if (len > 0 && len < sizeof(buf))
+        {
+            strncpy(buf, vars, len);
+            buf[len] = '\0';
+            hash_string(h, buf);
+            value = getenv(buf);
+            hash_string(h, value != NULL ? value : "");
+        }
+        vars += len;
+        if (*vars == ',')
+            ++vars;
+    }
+
+    for (i = 0; i < command_line.cache.num_inputs; ++i)
+    {
+        const char *name = command_line.cache.inputs[i];
+
+        if (stat(name, &st) == -1)
+            error("Cannot stat the input %s", name);
+        hash_string(h, name);
+        sprintf(buf, "%ld %ld", (long) st.st_size, (long) st.st_mtime);
+        hash_string(h, buf);
+    }
+
+    sprintf(key, "%08lx%08lx", h[0], h[1]);
+}
+
+/* Server side */
+
+static void save_cache()
+{
+    struct Cache_entry *e;
+    char *tmpname;
+    FILE *f;
+
+    tmpname = (char *) malloc(strlen(cache_file) + 5);
+    if (tmpname == 0)
+        error("Cannot allocate memory for the cache file name");
+    sprintf(tmpname, "%s.tmp", cache_file);
+    f = fopen(tmpname, "w");
+    if (f == NULL)
+    {
+        warning("Cannot write the cache %s", tmpname);
+        free(tmpname);
+        return;
+    }
+    for (e = first_entry; e != 0; e = e->next)
+        fprintf(f, "%s %ld %i %f %f %f %ld %ld %s\n", e->key,
+                (long) e->created, e->result.errorlevel, e->result.real_ms,
+                e->result.user_ms, e->result.system_ms, e->result.maxrss,
+                e->result.output_bytes, e->output != 0 ? e->output : "-");
+    fclose(f);
+    if (rename(tmpname, cache_file) == -1)
+        warning("Cannot rename the cache %s", tmpname);
+    free(tmpname);
+}
+
+/* The entries after the limit go away */
+static void trim_cache()
+{
+    struct Cache_entry **last = &first_entry;
+    struct Cache_entry *e;
+    int n = 0;
+
+    while (*last != 0 && n < cache_size)
+    {
+        last = &(*last)->next;
+        ++n;
+    }
+    while (*last != 0)
+    {
+        e = *last;
+        *last = e->next;
+        free(e->output);
+        free(e);
+        --entries;
+    }
+}
+
+static struct Cache_entry * new_entry(const char *key, const char *output)
+{
+    struct Cache_entry *e;
+
+    e = (struct Cache_entry *) malloc(sizeof(*e));
+    if (e == 0)
+        error("Cannot allocate memory for the cache");
+    strncpy(e->key, key, CACHE_KEY_SIZE - 1);
+    e->key[CACHE_KEY_SIZE - 1] = '\0';
+    clear_result(&e->result);
+    e->output = 0;
+    if (output != 0)
+    {
+        e->output = (char *) malloc(strlen(output) + 1);
+        if (e->output == 0)
+            error("Cannot allocate memory for the cache");
+        strcpy(e->output, output);
+    }
+    e->created = time(NULL);
+    e->next = 0;
+    return e;
+}
+
+/* On start */
+void cache_init()
+{
+    struct Cache_entry **last = &first_entry;
+    char line[CACHE_KEY_SIZE + CACHE_PATH_SIZE + 200];
+    char key[CACHE_KEY_SIZE];
+    char *output;
+    int pos;
+    struct Result r;
+    long created;
+    char *str;
+    FILE *f;
+
+    cache_file = getenv("TS_CACHE");
+    if (cache_file == 0)
+        return;
+    str = getenv("TS_CACHE_SIZE");
+    if (str != NULL)
+        cache_size = abs(atoi(str));
+
+    f = fopen(cache_file, "r");
+    if (f == NULL)
+        return;
+    clear_result(&r);
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        struct Cache_entry *e;
+
+        /* The output name is the rest of the line */
+        if (sscanf(line, "%16s %ld %i %f %f %f %ld %ld %n", key, &created,
+                    &r.errorlevel, &r.real_ms, &r.user_ms, &r.system_ms,
+                    &r.maxrss, &r.output_bytes, &pos) != 8)
+            continue;
+        output = line + pos;
+        output[strcspn(output, "\n")] = '\0';
+        e = new_entry(key, strcmp(output, "-") != 0 ? output : 0);
+        e->created = created;
+        e->result.errorlevel = r.errorlevel;
+        e->result.real_ms = r.real_ms;
+        e->result.user_ms = r.user_ms;
+        e->result.system_ms = r.system_ms;
+        e->result.maxrss = r.maxrss;
+        e->result.output_bytes = r.output_bytes;
+        *last = e;
+        last = &e->next;
+        ++entries;
+    }
+    fclose(f);
+    trim_cache();
+}
+
+static int output_exists(const char *output)
+{
+    struct stat st;
+
+    return output == 0 || store_is_virtual(output) || stat(output, &st) == 0;
+}
+
+/* Whether there is a result for the key. If so, it fills the result, the
+ * output (malloc'ed, or 0) and when it ran. */
+int cache_lookup(const char *key, struct Result *result, char **output,
+        time_t *created)
+{
+    struct Cache_entry **last;
+    struct Cache_entry *e;
+
+    if (cache_file == 0 || key[0] == '\0')
+        return 0;
+
+    for (last = &first_entry; *last != 0; last = &(*last)->next)
+        if (strcmp((*last)->key, key) == 0)
+            break;
+    e = *last;
+    if (e == 0 || !output_exists(e->output))
+    {
+        if (e != 0)
+        {
+            *last = e->next;
+            free(e->output);
+            free(e);
+            --entries;
+            save_cache();
+        }
+        ++misses;
+        return 0;
+    }
+
+    /* The last used goes first */
+    *last = e->next;
+    e->next = first_entry;
+    first_entry = e;
+    ++hits;
+
+    *result = e->result;
+    *output = 0;
+    if (e->output != 0)
+    {
+        *output = (char *) malloc(strlen(e->output) + 1);
+        if (*output == 0)
+            error("Cannot allocate memory for the cached output name");
+        strcpy(*output, e->output);
+    }
+    *created = e->created;
+    return 1;
+}
+
+/* When a job with a key ends well */
+void cache_store(const char *key, const struct Result *result,
+        const char *output)
+{
+    struct Cache_entry **last;
+    struct Cache_entry *e;
+
+    if (cache_file == 0 || key[0] == '\0' || cache_size == 0)
+        return;
+
+    /* Another job with the same key may have ended meanwhile */
+    for (last = &first_entry; *last != 0; last = &(*last)->next)
+        if (strcmp((*last)->key, key) == 0)
+        {
+            e = *last;
+            *last = e->next;
+            free(e->output);
+            free(e);
+            --entries;
+            break;
+        }
+
+    e = new_entry(key, output);
+    e->result.errorlevel = result->errorlevel;
+    e->result.real_ms = result->real_ms;
+    e->result.user_ms = result->user_ms;
+    e->result.system_ms = result->system_ms;
+    e->result.maxrss = result->maxrss;
+    e->result.output_bytes = result->output_bytes;
+    e->next = first_entry;
+    first_entry = e;
+    ++entries;
+    trim_cache();
+    save_cache();
+}
+
+/* The output of a job is given back: the entries showing it go away */
+void cache_forget(const char *output)
+{
+    struct Cache_entry **last;
+    struct Cache_entry *e;
+    int forgot = 0;
+
+    if (cache_file == 0 || output == 0)
+        return;
+
+    last = &first_entry;
+    while (*last != 0)
+    {
+        e = *last;
+        if (e->output != 0 && strcmp(e->output, output) == 0)
+        {
+            *last = e->next;
+            free(e->output);
+            free(e);
+            --entries;
+            forgot = 1;
+        }
+        else
+            last = &e->next;
+    }
+    if (forgot)
+        save_cache();
+}
+
+/* For --stats */
+void cache_stats(int s)
+{
+    char line[200];
+
+    if (cache_file == 0)
+        return;
+    snprintf(line, sizeof(line), "Result cache: %i of %i entries, %ld hits, "
+            "%ld misses\n", entries, cache_size, hits, misses);
+    send_list_line(s, line);
+}
@@ -0,0 +1,289 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Cgroups.
+ * With TS_CGROUP naming a cgroup v2 directory delegated to the user, each
+ * job runs in a cgroup of its own, "<TS_CGROUP>/ts-job.<jobid>.<pid>",
+ * where the limits of --memory-max, --cpu-max and --io-weight apply.
+ * When the job ends, the client reads what the cgroup used, kills what
+ * the job left running in it, and removes it. TS_CGROUP itself must not
+ * have processes, or the kernel will not enable the controllers. */
+
+static const char job_prefix[] = "ts-job.";
+
+enum
+{
+    CGROUP_CPU_PERIOD = 100000, /* usec, for cpu.max */
+    CGROUP_REMOVE_TRIES = 50 /* of 20ms, waiting for the killed processes */
+};
+
+/* Returns 0 if the jobs don't go in cgroups */
+const char * cgroup_directory()
+{
+    const char *dir;
+
+    dir = getenv("TS_CGROUP");
+    if (dir == NULL || dir[0] == '\0')
+        return 0;
+    return dir;
+}
+
+static char * cgroup_file(const char *cgroup, const char *file)
+{
+    char *path;
+
+    path = (char *) malloc(strlen(cgroup) + strlen(file) + 2);
+    if (path == 0)
+        error("Cannot allocate memory for the cgroup path");
+    sprintf(path, "%s/%s", cgroup, file);
+    return path;
+}
+
+/* Returns -1 on error */
+static int write_file(const char *cgroup, const char *file, const char *value)
+{
+    char *path;
+    int fd;
+    int res;
+
+    path = cgroup_file(cgroup, file);
+    fd = open(path, O_WRONLY);
+    free(path);
+    if (fd == -1)
+        return -1;
+    res = write(fd, value, strlen(value));
+    close(fd);
+    return (res == strlen(value)) ? 0 : -1;
+}
+
+/* Returns 0 if the file cannot be read */
+static FILE * open_file(const char *cgroup, const char *file)
+{
+    char *path;
+    FILE *f;
+
+    path = cgroup_file(cgroup, file);
+    f = fopen(path, "r");
+    free(path);
+    return f;
+}
+
+static void set_limit(const char *cgroup, const char *file, const char *value)
+{
+    if (write_file(cgroup, file, value) == -1)
+        warning("Cannot set %s to %s in the cgroup %s", file, value, cgroup);
+}
+
+/* Client side. Returns the path of the job cgroup (malloc'ed),
+ * or 0 if the job has to run without it. */
+char * cgroup_create(int jobid)
+{
+    const char *dir;
+    char *path;
+    char value[60];
+
+    dir = cgroup_directory();
+    if (dir == 0)
+        return 0;
+
+    /* Each controller apart: one missing must not disable the others */
+    write_file(dir, "cgroup.subtree_control", "+memory");
+    write_file(dir, "cgroup.subtree_control", "+cpu");
+    write_file(dir, "cgroup.subtree_control", "+io");
+
+    path = (char *) malloc(strlen(dir) + sizeof(job_prefix) + 30);
+    if (path == 0)
+        error("Cannot allocate memory for the cgroup path");
+    sprintf(path, "%s/%s%i.%i", dir, job_prefix, jobid, (int) getpid());
+    if (mkdir(path, 0755) == -1)
+    {
+        warning("Cannot create the cgroup %s", path);
+        free(path);
+        return 0;
+    }
+
+    if (command_line.memory_max > 0)
+    {
+        sprintf(value, "%ld", command_line.memory_max);
+        set_limit(path, "memory.max", value);
+    }
+    if (command_line.cpu_max > 0)
+    {
+        sprintf(value, "%ld %i",
+                (long) command_line.cpu_max * CGROUP_CPU_PERIOD / 100,
+                CGROUP_CPU_PERIOD);
+        set_limit(path, "cpu.max", value);
+    }
+    if (command_line.io_weight > 0)
+    {
+        sprintf(value, "default %i", command_line.io_weight);
+        set_limit(path, "io.weight", value);
+    }
+    return path;
+}
+
+/* Job side, before the exec. Moves the calling process into the cgroup. */
+void cgroup_enter(const char *cgroup)
+{
+    if (write_file(cgroup, "cgroup.procs", "0") == -1)
+        warning("Cannot move the job into the cgroup %s", cgroup);
+}
+
+/* Client side, once the job ended */
+void cgroup_collect(const char *cgroup, struct Result *result)
+{
+    char line[200];
+    FILE *f;
+
+    f = open_file(cgroup, "cpu.stat");
+    if (f != 0)
+    {
+        while (fgets(line, sizeof(line), f) != NULL)
+        {
+            sscanf(line, "user_usec %ld", &result->cgroup.user_usec);
+            sscanf(line, "system_usec %ld", &result->cgroup.system_usec);
+        }
+        fclose(f);
+    }
+
+    f = open_file(cgroup, "memory.peak");
+    if (f != 0)
+    {
+        if (fscanf(f, "%ld", &result->cgroup.memory_peak) != 1)
+            result->cgroup.memory_peak = -1;
+        fclose(f);
+    }
+
+    /* One line per device: "8:0 rbytes=N wbytes=N rios=N ..." */
+    f = open_file(cgroup, "io.stat");
+    if (f != 0)
+    {
+        result->cgroup.read_bytes = 0;
+        result->cgroup.write_bytes = 0;
+        while (fgets(line, sizeof(line), f) != NULL)
+        {
+            long rbytes, wbytes;
+            if (sscanf(line, "%*s rbytes=%ld wbytes=%ld", &rbytes, &wbytes)
+                    == 2)
+            {
+                result->cgroup.read_bytes += rbytes;
+                result->cgroup.write_bytes += wbytes;
+            }
+        }
+        fclose(f);
+    }
+}
+
+static int cgroup_populated(const char *cgroup)
+{
+    char line[100];
+    FILE *f;
+    int populated = 0;
+
+    f = open_file(cgroup, "cgroup.events");
+    if (f == 0)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+        sscanf(line, "populated %i", &populated);
+    fclose(f);
+    return populated;
+}
+
+/* Client side. Kills what the job left behind, and removes the cgroup. */
+void cgroup_remove(const char *cgroup)
+{
+    int tries;
+
+    if (cgroup_populated(cgroup))
+        write_file(cgroup, "cgroup.kill", "1");
+
+    /* The killed processes leave the cgroup asynchronously */
+    for (tries = 0; tries < CGROUP_REMOVE_TRIES; ++tries)
+    {
+        struct timeval tv;
+
+        if (rmdir(cgroup) == 0 || errno != EBUSY)
+            return;
+        tv.tv_sec = 0;
+        tv.tv_usec = 20000;
+        select(0, NULL, NULL, NULL, &tv);
+    }
+    warning("Cannot remove the cgroup %s", cgroup);
+}
+
+/* The mount point of the cgroup v2 hierarchy, from
+ * "36 25 0:30 / /sys/fs/cgroup rw,nosuid - cgroup2 cgroup2 rw" */
+static int cgroup_mount(char *mount, int size)
+{
+    char line[1000];
+    char format[30];
+    FILE *f;
+    int found = 0;
+
+    f = fopen("/proc/self/mountinfo", "r");
+    if (f == NULL)
+        return 0;
+    sprintf(format, "%%*s %%*s %%*s %%*s %%%is", size - 1);
+    while (!found && fgets(line, sizeof(line), f) != NULL)
+        if (strstr(line, " - cgroup2 ") != 0
+                && sscanf(line, format, mount) == 1)
+            found = 1;
+    fclose(f);
+    return found;
+}
+
+/* Killer side (ts -k). If the process is in a job cgroup, kills all
+ * the cgroup. Returns -1 if it is not in one. */
+int cgroup_kill(int pid)
+{
+    char path[40];
+    char line[1000];
+    char mount[500];
+    char *cgroup = 0;
+    const char *base;
+    FILE *f;
+    int res;
+
+    sprintf(path, "/proc/%i/cgroup", pid);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    /* In v2, the only line is "0::/path" */
+    while (cgroup == 0 && fgets(line, sizeof(line), f) != NULL)
+        if (strncmp(line, "0::", 3) == 0)
+        {
+            cgroup = line + 3;
+            cgroup[strcspn(cgroup, "\n")] = '\0';
+        }
+    fclose(f);
+
+    if (cgroup == 0)
+        return -1;
+    base = strrchr(cgroup, '/');
+    base = (base == 0) ? cgroup : base + 1;
+    if (strncmp(base, job_prefix, sizeof(job_prefix) - 1) != 0)
+        return -1;
+
+    if (!cgroup_mount(mount, sizeof(mount))
+            || strlen(mount) + strlen(cgroup) >= sizeof(mount))
+        return -1;
+    strcat(mount, cgroup);
+    res = write_file(mount, "cgroup.kill", "1");
+    return res;
+}
@@ -11,10 +11,13 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <signal.h>
+#include <limits.h>
 #include "main.h"
 
 static void c_end_of_job(const struct Result *res);
+static int c_wait_endjob_ok();
 static void c_wait_job_send();
 static void c_wait_running_job_send();
 
@@ -76,17 +79,52 @@ void c_new_job()
         m.u.newjob.label_size = strlen(command_line.label) + 1; /* add null */
     else
         m.u.newjob.label_size = 0;
+    if (command_line.key)
+        m.u.newjob.key_size = strlen(command_line.key) + 1; /* add null */
+    else
+        m.u.newjob.key_size = 0;
     m.u.newjob.store_output = command_line.store_output;
     m.u.newjob.do_depend = command_line.do_depend;
-    m.u.newjob.depend_on = command_line.depend_on;
+    m.u.newjob.depend_previous = command_line.depend.previous;
+    m.u.newjob.depend_mode = command_line.depend.mode;
+    m.u.newjob.depend_jobids_size = command_line.depend.num_jobids
+        * sizeof(int);
+    if (command_line.depend.labels)
+        m.u.newjob.depend_labels_size = strlen(command_line.depend.labels)
+            + 1; /* add null */
+    else
+        m.u.newjob.depend_labels_size = 0;
+    m.u.newjob.pipe_from = command_line.pipe.from;
+    m.u.newjob.pipe_tee = command_line.pipe.tee;
+    m.u.newjob.pipe_out = command_line.pipe.wait_consumer;
     m.u.newjob.should_keep_finished = command_line.should_keep_finished;
     m.u.newjob.command_size = strlen(new_command) + 1; /* add null */
     m.u.newjob.wait_enqueuing = command_line.wait_enqueuing;
     m.u.newjob.num_slots = command_line.num_slots;
+    m.u.newjob.output_limit = command_line.output_limit;
+    m.u.newjob.output_rate = command_line.output_rate;
+    m.u.newjob.output_policy = command_line.output_policy;
+    m.u.newjob.memory_max = command_line.memory_max;
+    m.u.newjob.cpu_max = command_line.cpu_max;
+    m.u.newjob.io_weight = command_line.io_weight;
+    m.u.newjob.timeout = command_line.timeout;
+    m.u.newjob.deadline = command_line.deadline;
+    m.u.newjob.not_before = command_line.not_before;
+    m.u.newjob.every = command_line.every;
+    m.u.newjob.retries = command_line.retries;
+    m.u.newjob.retry_delay = command_line.retry_delay;
+    m.u.newjob.priority = command_line.priority;
+    m.u.newjob.batch_size = command_line.batch.num;
+    cache_key(m.u.newjob.cache_key);
+    memcpy(m.u.newjob.retry_on, command_line.retry_on,
+            sizeof(m.u.newjob.retry_on));
 
     /* Send the message */
     send_msg(server_socket, &m);
 
+    /* Send the key, first for the server to find the job */
+    send_bytes(server_socket, command_line.key, m.u.newjob.key_size);
+
     /* Send the command */
     send_bytes(server_socket, new_command, m.u.newjob.command_size);
 
@@ -96,6 +134,12 @@ void c_new_job()
     /* Send the environment */
     send_bytes(server_socket, myenv, m.u.newjob.env_size);
 
+    /* Send the dependencies */
+    send_bytes(server_socket, (char *) command_line.depend.jobids,
+            m.u.newjob.depend_jobids_size);
+    send_bytes(server_socket, command_line.depend.labels,
+            m.u.newjob.depend_labels_size);
+
     free(new_command);
     free(myenv);
 }
@@ -113,12 +157,28 @@ int c_wait_newjob_ok()
         fprintf(stderr, "Error, queue full\n");
         exit(EXITCODE_QUEUE_FULL);
     }
-    if(m.type != NEWJOB_OK)
+    if (m.type == NEWJOB_ATTACHED)
+        command_line.attached = 1;
+    else if(m.type != NEWJOB_OK)
         error("Error getting the newjob_ok");
 
     return m.u.jobid;
 }
 
+/* A fifo name of RUNJOB, malloc'ed */
+static char * recv_string(int size)
+{
+    char *str;
+
+    str = (char *) malloc(size);
+    if (str == 0)
+        error("Cannot allocate memory for the fifo name");
+    if (recv_bytes(server_socket, str, size) == -1)
+        error("Reading the fifo name of the job");
+    str[size - 1] = '\0';
+    return str;
+}
+
 int c_wait_server_commands()
 {
     struct msg m;
@@ -126,6 +186,7 @@ int c_wait_server_commands()
 
     while (1)
     {
+        prefork_job();
         res = recv_msg(server_socket, &m);
         if(res == -1)
             error("Error in wait_server_commands");
@@ -137,26 +198,94 @@ int c_wait_server_commands()
         if (m.type == RUNJOB)
         {
             struct Result res;
-            res.skipped = 0;
+            clear_result(&res);
+            /* The server has the last word on the output limits */
+            command_line.output_limit = m.u.runjob.output_limit;
+            command_line.output_rate = m.u.runjob.output_rate;
+            command_line.output_policy = m.u.runjob.output_policy;
+            command_line.index_lines = m.u.runjob.index_lines;
+            command_line.numa_node = m.u.runjob.numa_node;
+            /* From the attempt before */
+            free(command_line.cpus);
+            command_line.cpus = 0;
+            if (m.u.runjob.cpus_size > 0)
+            {
+                command_line.cpus = (char *) malloc(m.u.runjob.cpus_size);
+                if (command_line.cpus == 0)
+                    error("Cannot allocate memory for the cpu list");
+                if (recv_bytes(server_socket, command_line.cpus,
+                            m.u.runjob.cpus_size) == -1)
+                    error("Reading the cpu list of the job");
+            }
+            free(command_line.pipe.in);
+            command_line.pipe.in = 0;
+            free(command_line.pipe.out);
+            command_line.pipe.out = 0;
+            command_line.pipe.out_tee = m.u.runjob.pipe_tee;
+            if (m.u.runjob.pipe_in_size > 0)
+                command_line.pipe.in = recv_string(m.u.runjob.pipe_in_size);
+            if (m.u.runjob.pipe_out_size > 0)
+                command_line.pipe.out = recv_string(m.u.runjob.pipe_out_size);
             /* These will send RUNJOB_OK */
-            if (command_line.do_depend && m.u.last_errorlevel != 0)
+            if (m.u.runjob.skip
+                    || (command_line.do_depend
+                        && m.u.runjob.last_errorlevel != 0))
             {
+                cancel_prefork();
                 res.errorlevel = -1;
-                res.user_ms = 0.;
-                res.system_ms = 0.;
-                res.real_ms = 0.;
                 res.skipped = 1;
-                c_send_runjob_ok(0, -1);
+                c_send_runjob_ok(0, -1, 0);
+            }
+            else if (m.u.runjob.cached)
+            {
+                /* The server has the result. Only good ones are kept. */
+                cancel_prefork();
+                c_send_runjob_ok(0, -1, 0);
             }
             else
+            {
+                /* The pre-forked job knows nothing of the fifos */
+                if (command_line.pipe.in != 0 || command_line.pipe.out != 0)
+                    cancel_prefork();
                 run_job(&res);
+            }
             c_end_of_job(&res);
-            return res.errorlevel;
+            if ((command_line.retries == 0 && command_line.every == 0)
+                    || c_wait_endjob_ok() == 0)
+                return res.errorlevel;
+            /* The same job runs again, on another RUNJOB */
         }
     }
+    cancel_prefork();
     return -1;
 }
 
+/* For jobs that didn't run */
+void clear_result(struct Result *r)
+{
+    r->errorlevel = 0;
+    r->died_by_signal = 0;
+    r->signal = 0;
+    r->user_ms = 0.;
+    r->system_ms = 0.;
+    r->real_ms = 0.;
+    r->skipped = 0;
+    r->output_bytes = 0;
+    r->output_exceeded = 0;
+    r->timed_out = NOT_TIMED_OUT;
+    r->maxrss = 0;
+    r->majflt = 0;
+    r->nvcsw = 0;
+    r->nivcsw = 0;
+    r->read_bytes = -1;
+    r->write_bytes = -1;
+    r->cgroup.user_usec = -1;
+    r->cgroup.system_usec = -1;
+    r->cgroup.memory_peak = -1;
+    r->cgroup.read_bytes = -1;
+    r->cgroup.write_bytes = -1;
+}
+
 void c_wait_server_lines()
 {
     struct msg m;
@@ -188,8 +317,129 @@ void c_list_jobs()
     struct msg m;
 
     m.type = LIST;
+    m.u.list_format = command_line.list_format;
+
+    send_msg(server_socket, &m);
+}
+
+void c_show_stats()
+{
+    struct msg m;
+
+    m.type = GET_STATS;
+
+    send_msg(server_socket, &m);
+}
+
+void c_grep()
+{
+    struct msg m;
+
+    m.type = GREP;
+    m.u.grep.pattern_size = strlen(command_line.grep.pattern) + 1;
+    if (command_line.label)
+        m.u.grep.label_size = strlen(command_line.label) + 1;
+    else
+        m.u.grep.label_size = 0;
+    m.u.grep.state = command_line.grep.state;
+    m.u.grep.jobid_from = command_line.grep.jobid_from;
+    m.u.grep.jobid_to = command_line.grep.jobid_to;
+
+    send_msg(server_socket, &m);
+    send_bytes(server_socket, command_line.grep.pattern,
+            m.u.grep.pattern_size);
+    send_bytes(server_socket, command_line.label, m.u.grep.label_size);
+}
+
+/* The answer to WATCH or UNWATCH */
+static int c_wait_watch_ok()
+{
+    struct msg m;
+    char *string;
+    int res;
+
+    res = recv_msg(server_socket, &m);
+    if(res != sizeof(m))
+        error("Error in wait_watch_ok");
+    switch(m.type)
+    {
+    case WATCH_OK:
+        return m.u.jobid;
+    case LIST_LINE: /* Only ONE line accepted */
+        string = (char *) malloc(m.u.size);
+        res = recv_bytes(server_socket, string, m.u.size);
+        fprintf(stderr, "Error in the request: %s",
+                string);
+        exit(-1);
+    default:
+        error("Wrong internal message in wait_watch_ok");
+    }
+    return -1;
+}
+
+/* The directory goes absolute to the server, which runs elsewhere */
+void c_watch()
+{
+    struct msg m;
+    char dir[PATH_MAX];
+    struct stat st;
+    char *args;
+    int size;
+    int i;
+
+    if (realpath(command_line.watch.dir, dir) == NULL
+            || stat(dir, &st) == -1 || !S_ISDIR(st.st_mode))
+    {
+        fprintf(stderr, "Cannot watch %s: not a directory.\n",
+                command_line.watch.dir);
+        exit(-1);
+    }
+
+    size = 0;
+    for (i = 0; i < command_line.command.num; ++i)
+        size += strlen(command_line.command.array[i]) + 1;
+    args = (char *) malloc(size);
+    if (args == 0)
+        error("Cannot allocate memory for the watch command");
+    size = 0;
+    for (i = 0; i < command_line.command.num; ++i)
+    {
+        strcpy(args + size, command_line.command.array[i]);
+        size += strlen(command_line.command.array[i]) + 1;
+    }
+
+    m.type = WATCH;
+    m.u.watch.dir_size = strlen(dir) + 1;
+    if (command_line.watch.glob)
+        m.u.watch.glob_size = strlen(command_line.watch.glob) + 1;
+    else
+        m.u.watch.glob_size = 0;
+    if (command_line.label)
+        m.u.watch.label_size = strlen(command_line.label) + 1;
+    else
+        m.u.watch.label_size = 0;
+    m.u.watch.args_size = size;
+    m.u.watch.num_slots = command_line.num_slots;
+
+    send_msg(server_socket, &m);
+    send_bytes(server_socket, dir, m.u.watch.dir_size);
+    send_bytes(server_socket, command_line.watch.glob, m.u.watch.glob_size);
+    send_bytes(server_socket, command_line.label, m.u.watch.label_size);
+    send_bytes(server_socket, args, m.u.watch.args_size);
+    free(args);
+
+    printf("%i\n", c_wait_watch_ok());
+}
+
+void c_unwatch()
+{
+    struct msg m;
 
+    m.type = UNWATCH;
+    m.u.jobid = command_line.jobid;
     send_msg(server_socket, &m);
+
+    c_wait_watch_ok();
 }
 
 /* Exits if wrong */
@@ -263,7 +513,9 @@ void c_show_info()
     }
 }
 
-void c_send_runjob_ok(const char *ofname, int pid)
+/* exec_time is 0 for jobs that didn't run */
+void c_send_runjob_ok(const char *ofname, int pid,
+        const struct timeval *exec_time)
 {
     struct msg m;
 
@@ -274,6 +526,10 @@ void c_send_runjob_ok(const char *ofname, int pid)
     else
 	m.u.output.store_output = 0;
     m.u.output.pid = pid;
+    m.u.output.exec_time.tv_sec = 0;
+    m.u.output.exec_time.tv_usec = 0;
+    if (exec_time != 0)
+        m.u.output.exec_time = *exec_time;
     if (m.u.output.store_output)
         m.u.output.ofilename_size = strlen(ofname) + 1;
     else
@@ -286,6 +542,29 @@ void c_send_runjob_ok(const char *ofname, int pid)
         send_bytes(server_socket, ofname, m.u.output.ofilename_size);
 }
 
+void c_send_batch_progress(const struct Batch_progress *progress)
+{
+    struct msg m;
+
+    m.type = BATCH_PROGRESS;
+    m.u.batch = *progress;
+    send_msg(server_socket, &m);
+}
+
+/* The output moved into the output store. Sent before ENDJOB. */
+void c_send_stored_output(const char *vname)
+{
+    struct msg m;
+
+    m.type = STORED_OUTPUT;
+    m.u.output.store_output = 1;
+    m.u.output.pid = 0;
+    m.u.output.ofilename_size = strlen(vname) + 1;
+
+    send_msg(server_socket, &m);
+    send_bytes(server_socket, vname, m.u.output.ofilename_size);
+}
+
 static void c_end_of_job(const struct Result *res)
 {
     struct msg m;
@@ -296,6 +575,26 @@ static void c_end_of_job(const struct Result *res)
     send_msg(server_socket, &m);
 }
 
+/* Only for jobs with retries or recurring. Returns 1 if the server will run
+ * it again. */
+static int c_wait_endjob_ok()
+{
+    struct msg m;
+    int res;
+
+    res = recv_msg(server_socket, &m);
+    if (res == -1)
+        error("Error in wait_endjob_ok");
+    /* Removed from the queue */
+    if (res == 0)
+        return 0;
+    if (m.type == RETRYJOB)
+        return 1;
+    if (m.type != ENDJOB_OK)
+        error("Error getting the endjob_ok");
+    return 0;
+}
+
 void c_shutdown_server()
 {
     struct msg m;
@@ -387,6 +686,11 @@ int c_cat()
         fprintf(stderr, "The output is not stored. Cannot cat.\n");
         exit(-1);
     }
+    /* A part of the output, as it is now */
+    if (command_line.range.set)
+        return cat_range(str, command_line.range.first,
+                command_line.range.last, command_line.range.by_lines);
+
     c_wait_running_job_send();
 
     return tail_file(str, -1 /* All the lines */);
@@ -427,8 +731,15 @@ void c_kill_job()
         exit(-1);
     }
 
+    /* A job in a cgroup dies with all it started, even out of its
+     * process group */
+    if (cgroup_kill(pid) == 0)
+        return;
+
     /* Send SIGTERM to the process group, as pid is for process group */
     kill(-pid, SIGTERM);
+    /* Suspended for a job of higher priority, it would not get it */
+    kill(-pid, SIGCONT);
 }
 
 void c_remove_job()
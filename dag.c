@@ -0,0 +1,154 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Dependency graphs.
+ * A job may wait for any number of jobs: the one before it (-d), the jobids
+ * given to -D and the jobs of the labels given to --depend-label. It runs
+ * once all of them ended well (all-ok, the default), once any of them did
+ * (any-ok), or once all of them ended, anyhow (always). The waiting job
+ * keeps the result of each as it comes.
+ * Among the jobs ready to run, the ones others wait for go first, the one
+ * heading the longest chain of estimated run times first: that chain, the
+ * critical path, bounds when the whole graph can end. The run times are
+ * those expected by predict.c, or a second before any job ran. */
+
+/* Seconds, never 0, so a job always adds to the path */
+static double runtime_estimate(const struct Job *p)
+{
+    if (p->estimate < 0)
+        return 1;
+    return p->estimate > 0.001 ? p->estimate : 0.001;
+}
+
+static int newer_first(const void *a, const void *b)
+{
+    const struct Job *ja = *(const struct Job * const *) a;
+    const struct Job *jb = *(const struct Job * const *) b;
+
+    return jb->jobid - ja->jobid;
+}
+
+/* For bsearch, with the jobid as the key */
+static int jobid_newer_first(const void *key, const void *b)
+{
+    const struct Job *jb = *(const struct Job * const *) b;
+
+    return jb->jobid - *(const int *) key;
+}
+
+static int not_started(const struct Job *p)
+{
+    return p->state == QUEUED || p->state == HOLDING_CLIENT;
+}
+
+/* Server side, before choosing the job to run. A job only waits for older
+ * ones, so from the newest on, each job has the paths of those waiting for
+ * it when its turn comes. */
+void dag_update_paths(struct Job *first)
+{
+    struct Job **jobs;
+    struct Job *p;
+    int graph = 0;
+    int n = 0;
+    int i, j;
+
+    for (p = first; p != 0; p = p->next)
+    {
+        p->path = 0;
+        if (not_started(p))
+        {
+            ++n;
+            if (p->depends_size > 0)
+                graph = 1;
+        }
+    }
+    if (!graph)
+        return;
+
+    jobs = (struct Job **) malloc(n * sizeof(*jobs));
+    if (jobs == 0)
+        error("Cannot allocate memory for the dependency graph");
+    n = 0;
+    for (p = first; p != 0; p = p->next)
+        if (not_started(p))
+            jobs[n++] = p;
+    qsort(jobs, n, sizeof(*jobs), newer_first);
+
+    for (i = 0; i < n; ++i)
+    {
+        double path;
+
+        /* Till now, the longest path of those waiting for it */
+        p = jobs[i];
+        path = p->path + runtime_estimate(p);
+        if (p->path > 0)
+            p->path = path;
+
+        for (j = 0; j < p->depends_size; ++j)
+        {
+            struct Job **parent;
+
+            if (p->depends[j].finished)
+                continue;
+            parent = (struct Job **) bsearch(&p->depends[j].jobid,
+                    jobs + i + 1, n - i - 1, sizeof(*jobs), jobid_newer_first);
+            if (parent != 0 && (*parent)->path < path)
+                (*parent)->path = path;
+        }
+    }
+    free(jobs);
+}
+
+/* "[3,5]&& " in the list and the info, with "|| " for any-ok and "; " for
+ * always. Only the operator for -d with no job before. "[2]| " before, for
+ * the job giving the input. */
+void depend_string(char *buf, int size, const struct Job *p)
+{
+    static const char *operators[] = { "&& ", "|| ", "; " };
+    char id[30];
+    int start = 0;
+    int len;
+    int i;
+
+    buf[0] = '\0';
+    if (p->pipe_from >= 0 && size > 30)
+    {
+        sprintf(buf, "[%i]| ", p->pipe_from);
+        start = strlen(buf);
+    }
+    if (!p->do_depend)
+        return;
+
+    len = start;
+    for (i = 0; i < p->depends_size; ++i)
+    {
+        if (p->depends[i].jobid < 0)
+            continue;
+        sprintf(id, "%c%i", len == start ? '[' : ',', p->depends[i].jobid);
+        /* Room for ",...]" and the operator */
+        if (len + (int) strlen(id) + 9 > size)
+        {
+            strcpy(buf + len, len == start ? "[..." : ",...");
+            len += 4;
+            break;
+        }
+        strcpy(buf + len, id);
+        len += strlen(id);
+    }
+    if (len > start)
+        buf[len++] = ']';
+    buf[len] = '\0';
+    strcat(buf, operators[p->depend_mode]);
+}
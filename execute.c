@@ -4,6 +4,8 @@
 
     Please find the license in the provided COPYING file.
 */
+/* wait4() is not in the standards */
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <signal.h>
@@ -13,19 +15,161 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/times.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <assert.h>
+#include <errno.h>
 
 #include "main.h"
 
 /* from signals.c */
 extern int signals_child_pid; /* 0, not set. otherwise, set. */
 
+/* The output store keeps only plain outputs. gzip and the .e file of -E
+ * still go to their own files. */
+static int use_output_store()
+{
+    return command_line.store_output && store_directory() != 0
+        && !command_line.gzip && !command_line.stderr_apart;
+}
+
+/* gzip outputs cannot be seeked by line */
+static int use_line_index()
+{
+    return command_line.store_output && command_line.index_lines > 0
+        && !command_line.gzip;
+}
+
+/* Storage bytes of the job and the children it waited for. Only linux
+ * has them, in /proc, and only until the job is reaped. */
+static void read_job_io(int pid, struct Result *result)
+{
+    char path[40];
+    char line[100];
+    FILE *f;
+
+    result->read_bytes = -1;
+    result->write_bytes = -1;
+
+    sprintf(path, "/proc/%i/io", pid);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        sscanf(line, "read_bytes: %ld", &result->read_bytes);
+        sscanf(line, "write_bytes: %ld", &result->write_bytes);
+    }
+    fclose(f);
+}
+
+/* Reaps the job and gets what it used. The times() of the client would
+ * add up all the children it ever had, so we take the rusage of wait4. */
+static void wait_job(int pid, int *status, struct rusage *usage,
+        struct Result *result)
+{
+    siginfo_t info;
+
+    /* SIGINT, forwarded to the job, interrupts the waits */
+    while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1
+            && errno == EINTR)
+        ;
+    read_job_io(pid, result);
+    while (wait4(pid, status, 0, usage) == -1 && errno == EINTR)
+        ;
+}
+
+enum
+{
+    RELAY_THROTTLE_RATE = 1024, /* bytes/s once over the limit */
+    RELAY_KILL_GRACE = 5, /* seconds from SIGTERM to SIGKILL */
+    RELAY_EXIT_GRACE = 5, /* seconds for the relay after the job ends */
+    RELAY_PIPE_SIZE = 65536 /* bytes the relay may have to flush then */
+};
+
+/* What the relay tells the client when the job output ends. Before, it
+ * sends its pid. */
+struct Relay_report
+{
+    int exceeded;
+    long bytes;
+};
+
+/* Set by SIGTERM in the relay */
+static volatile int relay_stop = 0;
+
+static void relay_sigterm(int sig)
+{
+    relay_stop = 1;
+}
+
+/* Seconds to wait for the relay after the job, time to flush a pipe full
+ * at the rate of the job */
+static int relay_grace()
+{
+    long rate = command_line.output_rate;
+
+    if (command_line.output_policy == OUTPUT_THROTTLE
+            && command_line.output_limit > 0
+            && (rate <= 0 || rate > RELAY_THROTTLE_RATE))
+        rate = RELAY_THROTTLE_RATE;
+    return RELAY_EXIT_GRACE + (rate > 0 ? RELAY_PIPE_SIZE / rate : 0);
+}
+
+/* Whether fd is readable within the seconds */
+static int wait_readable(int fd, int seconds)
+{
+    fd_set readset;
+    struct timeval tv;
+    int res;
+
+    do
+    {
+        FD_ZERO(&readset);
+        FD_SET(fd, &readset);
+        tv.tv_sec = seconds;
+        tv.tv_usec = 0;
+        res = select(fd + 1, &readset, NULL, NULL, &tv);
+    } while (res == -1 && errno == EINTR);
+    return res > 0;
+}
+
+/* The report of the relay, once the job ended. A process the job left
+ * behind may hold its output open: then, after the grace, the relay is
+ * told to stop, and killed if it doesn't. Returns 0 without a report. */
+static int read_relay_report(int fd_report, struct Relay_report *report)
+{
+    int relaypid;
+    int res;
+
+    /* Without relay, the pipe is already closed */
+    while ((res = read(fd_report, &relaypid, sizeof(relaypid))) == -1
+            && errno == EINTR)
+        ;
+    if (res != sizeof(relaypid))
+        return 0;
+
+    if (!wait_readable(fd_report, relay_grace()))
+    {
+        kill(relaypid, SIGTERM);
+        if (!wait_readable(fd_report, RELAY_KILL_GRACE))
+        {
+            kill(relaypid, SIGKILL);
+            return 0;
+        }
+    }
+    while ((res = read(fd_report, report, sizeof(*report))) == -1
+            && errno == EINTR)
+        ;
+    return res == sizeof(*report);
+}
+
 /* Returns errorlevel */
-static void run_parent(int fd_read_filename, int pid, struct Result *result)
+static void run_parent(int fd_read_filename, int fd_report, int pid,
+        const char *cgroup, struct Result *result)
 {
     int status;
     char *ofname = 0;
@@ -34,7 +178,8 @@ static void run_parent(int fd_read_filename, int pid, struct Result *result)
     char *command;
     struct timeval starttv;
     struct timeval endtv;
-    struct tms cpu_times;
+    struct rusage usage;
+    struct Relay_report report;
 
     /* Read the filename */
     /* This is linked with the write() in this same file, in run_child() */
@@ -52,15 +197,43 @@ static void run_parent(int fd_read_filename, int pid, struct Result *result)
     res = read(fd_read_filename, &starttv, sizeof(starttv));
     if (res != sizeof(starttv))
         error("Reading the the struct timeval");
-    close(fd_read_filename);
 
     /* All went fine - prepare the SIGINT and send runjob_ok */
     signals_child_pid = pid;
     unblock_sigint_and_install_handler();
 
-    c_send_runjob_ok(ofname, pid);
+    c_send_runjob_ok(ofname, pid, &starttv);
 
-    wait(&status);
+    if (command_line.batch.num > 0)
+        batch_follow(fd_read_filename);
+    close(fd_read_filename);
+
+    wait_job(pid, &status, &usage, result);
+
+    /* Before the mail and the hook, which are not the job */
+    gettimeofday(&endtv, NULL);
+    result->real_ms = endtv.tv_sec - starttv.tv_sec +
+        ((float) (endtv.tv_usec - starttv.tv_usec) / 1000000.);
+    result->user_ms = usage.ru_utime.tv_sec +
+        (float) usage.ru_utime.tv_usec / 1000000.;
+    result->system_ms = usage.ru_stime.tv_sec +
+        (float) usage.ru_stime.tv_usec / 1000000.;
+    result->maxrss = usage.ru_maxrss;
+    result->majflt = usage.ru_majflt;
+    result->nvcsw = usage.ru_nvcsw;
+    result->nivcsw = usage.ru_nivcsw;
+
+    /* What the job left running goes with the cgroup */
+    if (cgroup != 0)
+    {
+        cgroup_collect(cgroup, result);
+        cgroup_remove(cgroup);
+    }
+
+    /* Wait for the relay to flush the output */
+    result->output_exceeded = read_relay_report(fd_report, &report)
+        ? report.exceeded : 0;
+    close(fd_report);
 
     /* Set the errorlevel */
     if (WIFEXITED(status))
@@ -93,19 +266,36 @@ static void run_parent(int fd_read_filename, int pid, struct Result *result)
     hook_on_finish(command_line.jobid, result->errorlevel, ofname, command);
     free(command);
 
-    free(ofname);
+    /* For the retention policy of the server */
+    result->output_bytes = 0;
+    if (ofname != 0)
+    {
+        struct stat st;
+        if (stat(ofname, &st) == 0)
+            result->output_bytes = st.st_size;
+    }
 
-    /* Calculate times */
-    gettimeofday(&endtv, NULL);
-    result->real_ms = endtv.tv_sec - starttv.tv_sec +
-        ((float) (endtv.tv_usec - starttv.tv_usec) / 1000000.);
-    times(&cpu_times);
-    /* The times are given in clock ticks. The number of clock ticks per second
-     * is obtained in POSIX using sysconf(). */
-    result->user_ms = (float) cpu_times.tms_cutime /
-        (float) sysconf(_SC_CLK_TCK);
-    result->system_ms = (float) cpu_times.tms_cstime /
-        (float) sysconf(_SC_CLK_TCK);
+    /* Move the spool into the output store, once nobody else needs it */
+    if (use_output_store())
+    {
+        char *vname;
+        vname = store_commit(ofname, command_line.jobid);
+        if (vname != 0)
+        {
+            if (use_line_index())
+            {
+                char *from = index_path(ofname);
+                char *to = index_path(vname);
+                rename(from, to);
+                free(from);
+                free(to);
+            }
+            c_send_stored_output(vname);
+            free(vname);
+        }
+    }
+
+    free(ofname);
 }
 
 void create_closed_read_on(int dest)
@@ -146,116 +336,632 @@ static void run_gzip(int fd_out, int fd_in)
     }
 }
 
-static void run_child(int fd_send_filename)
+static const char *policy_names[] = { "truncate", "throttle", "kill" };
+
+int output_policy_from_string(const char *str)
 {
-    char outfname[] = "/ts-out.XXXXXX";
-    char errfname[sizeof outfname + 2]; /* .e */
-    int namesize;
-    int outfd;
-    int err;
-    struct timeval starttv;
+    int i;
 
-    if (command_line.store_output)
+    for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); ++i)
+        if (strcmp(str, policy_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+const char * output_policy_to_string(int policy)
+{
+    if (policy < 0 || policy >= sizeof(policy_names) / sizeof(policy_names[0]))
+        return "unknown";
+    return policy_names[policy];
+}
+
+/* Only jobs with limits, index or a copy to a fifo pay for the extra copy */
+static int use_output_relay()
+{
+    return (command_line.store_output
+        && (command_line.output_limit > 0 || command_line.output_rate > 0
+            || (command_line.pipe.out != 0 && command_line.pipe.out_tee)))
+        || use_line_index();
+}
+
+/* -1 if it had to drop the bytes */
+static int write_all(int fd, const char *buf, int len)
+{
+    while (len > 0)
     {
-        /* Prepare path */
-        const char *tmpdir = getenv("TMPDIR");
-        int lname;
-        char *outfname_full;
+        int res;
+        res = write(fd, buf, len);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            /* Nowhere to write (gzip died, disk full): drop it */
+            return -1;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/* Sleep until the bytes sent since 'since' fit in 'rate' */
+static void rate_wait(const struct timeval *since, long sent, long rate)
+{
+    struct timeval now;
+    struct timeval tv;
+    double ahead;
+
+    gettimeofday(&now, NULL);
+    ahead = (double) sent / rate - (now.tv_sec - since->tv_sec)
+        - (now.tv_usec - since->tv_usec) / 1000000.;
+    if (ahead <= 0)
+        return;
+    tv.tv_sec = (long) ahead;
+    tv.tv_usec = (long) ((ahead - tv.tv_sec) * 1000000.);
+    select(0, NULL, NULL, NULL, &tv);
+}
 
-        if (tmpdir == NULL)
-            tmpdir = "/tmp";
-        lname = strlen(tmpdir) + strlen(outfname) + 1 /* \0 */;
+static void kill_job(int jobpid, int sig)
+{
+    /* The job may not have called setsid() yet */
+    if (kill(-jobpid, sig) == -1)
+        kill(jobpid, sig);
+}
 
-        outfname_full = (char *)malloc(lname);
-        strcpy(outfname_full, tmpdir);
-        strcat(outfname_full, outfname);
+/* Copies the job output from the pipes to the real outputs, keeping the
+ * limits the server sent. A slow reader blocks the job in its write(),
+ * which is how the rate limit works. The whole output also goes to fd_tee,
+ * if not -1, out of the limits. */
+static void run_relay(int in_out, int fd_out, int in_err, int fd_err,
+        int fd_report, int fd_index, int fd_tee, int jobpid)
+{
+    char buf[4096];
+    long limit = command_line.output_limit;
+    long rate = command_line.output_rate;
+    int policy = command_line.output_policy;
+    struct Relay_report report;
+    struct Line_index index;
+    struct timeval since;
+    struct sigaction act;
+    long sent = 0;
+    time_t killtime = 0;
+    int chunk;
+    int pid;
 
-        if (command_line.gzip)
+    /* The client forwards ^C to the job; we only follow its output */
+    signal(SIGINT, SIG_IGN);
+    /* The job reading the copy may end first */
+    signal(SIGPIPE, SIG_IGN);
+    /* The client stops us if the output outlives the job */
+    act.sa_handler = relay_sigterm;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    sigaction(SIGTERM, &act, 0);
+    pid = getpid();
+    write(fd_report, &pid, sizeof(pid));
+
+    report.exceeded = 0;
+    report.bytes = 0;
+    gettimeofday(&since, NULL);
+
+    index.fd = fd_index;
+    index.interval = command_line.index_lines;
+    index.lines = 0;
+    index.offset = 0;
+
+    while ((in_out != -1 || in_err != -1) && !relay_stop)
+    {
+        fd_set readset;
+        struct timeval tv;
+        int maxfd = -1;
+        int i;
+
+        FD_ZERO(&readset);
+        if (in_out != -1)
         {
-            int p[2];
-            /* We assume that all handles are closed*/
-            err = pipe(p);
-            assert(err == 0);
+            FD_SET(in_out, &readset);
+            maxfd = in_out;
+        }
+        if (in_err != -1)
+        {
+            FD_SET(in_err, &readset);
+            if (in_err > maxfd)
+                maxfd = in_err;
+        }
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (select(maxfd + 1, &readset, NULL, NULL,
+                    killtime != 0 ? &tv : NULL) == -1)
+            continue;
+
+        /* The job didn't take SIGTERM */
+        if (killtime != 0 && time(NULL) - killtime >= RELAY_KILL_GRACE)
+        {
+            kill_job(jobpid, SIGKILL);
+            killtime = 0;
+        }
+
+        for (i = 0; i < 2; ++i)
+        {
+            int *in = (i == 0) ? &in_out : &in_err;
+            int out = (i == 0) ? fd_out : fd_err;
+            int res;
+            int keep;
+            int over;
+
+            if (*in == -1 || !FD_ISSET(*in, &readset))
+                continue;
+
+            chunk = sizeof(buf);
+            if (rate > 0 && rate < chunk)
+                chunk = rate;
+            res = read(*in, buf, chunk);
+            if (res == -1 && errno == EINTR)
+                continue;
+            if (res <= 0)
+            {
+                close(*in);
+                *in = -1;
+                continue;
+            }
+
+            if (i == 0 && fd_tee != -1 && write_all(fd_tee, buf, res) == -1)
+            {
+                close(fd_tee);
+                fd_tee = -1;
+            }
 
-            /* gzip output goes to the filename */
-            /* This will be the handle other than 0,1,2 */
-            /* mkstemp doesn't admit adding ".gz" to the pattern */
-            outfd = mkstemp(outfname_full); /* stdout */
-            assert(outfd != -1);
-
-            /* Program stdout and stderr */
-            /* which go to pipe write handle */
-            err = dup2(p[1], 1);
-            assert(err != -1);
-            if (command_line.stderr_apart)
+            over = 0;
+            if (report.exceeded)
+                keep = (policy == OUTPUT_THROTTLE) ? res : 0;
+            else if (limit > 0 && report.bytes + res > limit)
             {
-                int errfd;
-                strncpy(errfname, outfname_full, sizeof errfname);
-                strncat(errfname, ".e", 2);
-                errfd = open(errfname, O_CREAT | O_WRONLY | O_TRUNC, 0600);
-                assert(err == 0);
-                err = dup2(errfd, 2);
-                assert(err == 0);
-                err = close(errfd);
-                assert(err == 0);
+                keep = limit - report.bytes;
+                over = 1;
             }
             else
+                keep = res;
+            report.bytes += res;
+
+            if (keep > 0)
+            {
+                if (rate > 0)
+                    rate_wait(&since, sent + keep, rate);
+                write_all(out, buf, keep);
+                sent += keep;
+                if (i == 0 && fd_index != -1)
+                    index_feed(&index, buf, keep);
+            }
+            if (!over)
+                continue;
+
+            /* Just went over the limit */
+            report.exceeded = 1;
+            if (policy == OUTPUT_THROTTLE)
+            {
+                if (rate <= 0 || rate > RELAY_THROTTLE_RATE)
+                    rate = RELAY_THROTTLE_RATE;
+                gettimeofday(&since, NULL);
+                sent = res - keep;
+                rate_wait(&since, sent, rate);
+                write_all(out, buf + keep, res - keep);
+                if (i == 0 && fd_index != -1)
+                    index_feed(&index, buf + keep, res - keep);
+            }
+            else if (policy == OUTPUT_KILL)
+            {
+                kill_job(jobpid, SIGTERM);
+                killtime = time(NULL);
+            }
+        }
+    }
+
+    write(fd_report, &report, sizeof(report));
+    exit(0);
+}
+
+/* Puts the relay between the job and its outputs. The relay is a grandchild,
+ * so the job will not find it among its children. */
+static void start_relay(int *outfd, int *errfd, int fd_report, int fd_index,
+        int fd_tee)
+{
+    int p_out[2];
+    int p_err[2];
+    int jobpid;
+    int pid;
+    int err;
+
+    err = pipe(p_out);
+    assert(err == 0);
+    p_err[0] = p_err[1] = -1;
+    if (*errfd != -1)
+    {
+        err = pipe(p_err);
+        assert(err == 0);
+    }
+
+    jobpid = getpid();
+    pid = fork();
+    switch(pid)
+    {
+        case 0:
+            if (fork() != 0)
+                exit(0);
+            close(p_out[1]);
+            if (p_err[1] != -1)
+                close(p_err[1]);
+            run_relay(p_out[0], *outfd, p_err[0], *errfd, fd_report,
+                    fd_index, fd_tee, jobpid);
+            /* Won't return */
+        case -1:
+            exit(-1); /* Fork error */
+        default:
+            waitpid(pid, NULL, 0);
+            close(p_out[0]);
+            close(*outfd);
+            *outfd = p_out[1];
+            if (*errfd != -1)
             {
-                err = dup2(p[1], 2);
-                assert(err != -1);
+                close(p_err[0]);
+                close(*errfd);
+                *errfd = p_err[1];
             }
-            err = close(p[1]);
+    }
+}
+
+/* Creates the output file (and the .e one) of the job. Returns its name,
+ * malloc'ed. */
+static char * open_output(int *outfd, int *errfd)
+{
+    char outfname[] = "/ts-out.XXXXXX";
+    char spoolfname[] = "/ts-spool.XXXXXX";
+    const char *tmpdir = getenv("TMPDIR");
+    int lname;
+    char *outfname_full;
+
+    /* Prepare path */
+    if (tmpdir == NULL)
+        tmpdir = "/tmp";
+    lname = strlen(tmpdir) + strlen(outfname) + 1 /* \0 */;
+
+    if (use_output_store())
+    {
+        /* The spool will be moved into a segment on job end */
+        tmpdir = store_directory();
+        mkdir(tmpdir, 0700);
+        lname = strlen(tmpdir) + strlen(spoolfname) + 1 /* \0 */;
+    }
+
+    outfname_full = (char *)malloc(lname);
+    strcpy(outfname_full, tmpdir);
+    strcat(outfname_full, use_output_store() ? spoolfname : outfname);
+
+    /* Prepare the filename */
+    /* mkstemp doesn't admit adding ".gz" to the pattern */
+    *outfd = mkstemp(outfname_full); /* stdout */
+    assert(*outfd != -1);
+
+    *errfd = -1;
+    if (command_line.stderr_apart)
+    {
+        char *errfname;
+        errfname = (char *) malloc(lname + 2); /* .e */
+        sprintf(errfname, "%s.e", outfname_full);
+        *errfd = open(errfname, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+        free(errfname);
+    }
+    return outfname_full;
+}
+
+/* From the output file already open, if the job stores it */
+static void start_command(int fd_send_filename, int fd_report,
+        const char *cgroup, char *outfname_full, int outfd, int errfd)
+{
+    int namesize;
+    int err;
+    int pipefd = -1;
+    struct timeval starttv;
+
+    /* Only the runner of a batch keeps it */
+    fcntl(fd_send_filename, F_SETFD, FD_CLOEXEC);
+
+    /* The job taking the output. This waits for it to open its end. */
+    if (command_line.pipe.out != 0)
+    {
+        pipefd = open(command_line.pipe.out, O_WRONLY);
+        /* Not for gzip */
+        if (pipefd != -1)
+            fcntl(pipefd, F_SETFD, FD_CLOEXEC);
+    }
+
+    if (command_line.store_output)
+    {
+        if (command_line.gzip)
+        {
+            int p[2];
+            /* We assume that all handles are closed*/
+            err = pipe(p);
             assert(err == 0);
+            /* gzip must not keep its own input open */
+            fcntl(p[1], F_SETFD, FD_CLOEXEC);
 
             /* run gzip.
              * This wants p[0] in 0, so gzip will read
-             * from it */
+             * from it, and write the file */
             run_gzip(outfd, p[0]);
+            outfd = p[1];
         }
-        else
+
+        /* The limits are counted before compression */
+        if (use_output_relay())
         {
-            /* Prepare the filename */
-            outfd = mkstemp(outfname_full); /* stdout */
-            dup2(outfd, 1); /* stdout */
-            if (command_line.stderr_apart)
+            int idxfd = -1;
+            int teefd = -1;
+            if (use_line_index())
+                idxfd = index_create(outfname_full, command_line.index_lines);
+            if (pipefd != -1 && command_line.pipe.out_tee)
             {
-                int errfd;
-                strncpy(errfname, outfname_full, sizeof errfname);
-                strncat(errfname, ".e", 2);
-                errfd = open(errfname, O_CREAT | O_WRONLY | O_TRUNC, 0600);
-                dup2(errfd, 2);
-                close(errfd);
+                /* stderr goes to the file, but not to the fifo */
+                teefd = pipefd;
+                pipefd = -1;
+                if (errfd == -1)
+                    errfd = dup(outfd);
             }
-            else
-                dup2(outfd, 2);
-            close(outfd);
+            start_relay(&outfd, &errfd, fd_report, idxfd, teefd);
+            if (idxfd != -1)
+                close(idxfd);
+            if (teefd != -1)
+                close(teefd);
         }
 
+        /* Program stdout and stderr */
+        err = dup2(outfd, 1);
+        assert(err != -1);
+        err = dup2(errfd != -1 ? errfd : outfd, 2);
+        assert(err != -1);
+        close(outfd);
+        if (errfd != -1)
+            close(errfd);
+
         /* Send the filename */
         namesize = strlen(outfname_full)+1;
         write(fd_send_filename, (char *)&namesize, sizeof(namesize));
         write(fd_send_filename, outfname_full, namesize);
     }
+    /* Without a copy, the output only goes to the fifo */
+    if (pipefd != -1)
+    {
+        dup2(pipefd, 1);
+        close(pipefd);
+    }
     /* Times */
     gettimeofday(&starttv, NULL);
     write(fd_send_filename, &starttv, sizeof(starttv));
-    close(fd_send_filename);
+    /* A batch goes on telling how its commands end */
+    if (command_line.batch.num == 0)
+        close(fd_send_filename);
 
     /* Closing input */
     if (command_line.should_go_background)
         create_closed_read_on(0);
 
+    /* The output of the job before. If it went away, the input stays closed. */
+    if (command_line.pipe.in != 0)
+    {
+        int fd = open(command_line.pipe.in, O_RDONLY);
+        if (fd != -1)
+        {
+            dup2(fd, 0);
+            close(fd);
+        }
+    }
+
+    if (command_line.cpus != 0)
+        affinity_apply(command_line.cpus, command_line.numa_node);
+
+    /* Not before, so the relay and gzip stay out of the limits */
+    if (cgroup != 0)
+        cgroup_enter(cgroup);
+
     /* We create a new session, so we can kill process groups as:
          kill -- -`ts -p` */
     setsid();
+    if (command_line.batch.num > 0)
+        run_batch(fd_send_filename);
     execvp(command_line.command.array[0], command_line.command.array);
 }
 
+static void run_child(int fd_send_filename, int fd_report, const char *cgroup)
+{
+    char *outfname_full = 0;
+    int outfd = -1;
+    int errfd = -1;
+
+    if (command_line.store_output)
+        outfname_full = open_output(&outfd, &errfd);
+    start_command(fd_send_filename, fd_report, cgroup, outfname_full, outfd,
+            errfd);
+}
+
+/* The pre-forked job.
+ * With TS_PREFORK in the environment of the client, the client forks the
+ * job process while the job is still queued, and that process creates the
+ * output file and waits on a pipe. On RUNJOB, the client only writes there
+ * what the server decided; the fork and the mkstemp are already done. Each
+ * queued job keeps an idle process for it. */
+
+/* What the pre-forked job gets on RUNJOB, followed by the cpus and the
+ * cgroup strings */
+struct Launch
+{
+    long output_limit;
+    long output_rate;
+    int output_policy;
+    long index_lines;
+    int numa_node;
+    int cpus_size;
+    int cgroup_size;
+};
+
+static struct
+{
+    int pid; /* 0 if there is none */
+    int fd_launch;
+    int fd_read_filename;
+    int fd_report;
+} prefork;
+
+static int read_full(int fd, void *buf, int size)
+{
+    int done = 0;
+    int res;
+
+    while (done < size)
+    {
+        res = read(fd, (char *) buf + done, size - done);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return done;
+        done += res;
+    }
+    return done;
+}
+
+static char * read_string(int fd, int size)
+{
+    char *str;
+
+    if (size <= 0)
+        return 0;
+    str = (char *) malloc(size);
+    if (str == 0 || read_full(fd, str, size) != size)
+        exit(-1);
+    return str;
+}
+
+static void run_preforked(int fd_launch, int fd_send_filename, int fd_report)
+{
+    struct Launch l;
+    char *outfname_full = 0;
+    char *cgroup;
+    int outfd = -1;
+    int errfd = -1;
+
+    if (command_line.store_output)
+        outfname_full = open_output(&outfd, &errfd);
+
+    /* Until RUNJOB. Without it, the job will not run here. */
+    if (read_full(fd_launch, &l, sizeof(l)) != sizeof(l))
+    {
+        if (outfname_full != 0)
+            unlink(outfname_full);
+        if (errfd != -1)
+        {
+            char *errfname;
+            errfname = (char *) malloc(strlen(outfname_full) + 3);
+            sprintf(errfname, "%s.e", outfname_full);
+            unlink(errfname);
+        }
+        exit(0);
+    }
+    command_line.output_limit = l.output_limit;
+    command_line.output_rate = l.output_rate;
+    command_line.output_policy = l.output_policy;
+    command_line.index_lines = l.index_lines;
+    command_line.numa_node = l.numa_node;
+    free(command_line.cpus);
+    command_line.cpus = read_string(fd_launch, l.cpus_size);
+    cgroup = read_string(fd_launch, l.cgroup_size);
+    close(fd_launch);
+
+    start_command(fd_send_filename, fd_report, cgroup, outfname_full, outfd,
+            errfd);
+}
+
+/* Client side, while the job is queued */
+void prefork_job()
+{
+    int p[2];
+    int p_report[2];
+    int p_launch[2];
+    int pid;
+
+    if (getenv("TS_PREFORK") == NULL || prefork.pid != 0)
+        return;
+
+    pipe(p);
+    pipe(p_report);
+    fcntl(p_report[1], F_SETFD, FD_CLOEXEC);
+    pipe(p_launch);
+    /* Not for the gzip, the relay or the mail of the job */
+    fcntl(p_launch[1], F_SETFD, FD_CLOEXEC);
+
+    pid = fork();
+    switch(pid)
+    {
+        case 0:
+            /* ^C goes to the client until the job starts */
+            signal(SIGINT, SIG_DFL);
+            restore_sigmask();
+            close(server_socket);
+            close(p[0]);
+            close(p_report[0]);
+            close(p_launch[1]);
+            run_preforked(p_launch[0], p[1], p_report[1]);
+            fprintf(stderr, "ts could not run the command\n");
+            exit(-1);
+        case -1:
+            error("forking");
+        default:
+            close(p[1]);
+            close(p_report[1]);
+            close(p_launch[0]);
+            prefork.pid = pid;
+            prefork.fd_launch = p_launch[1];
+            prefork.fd_read_filename = p[0];
+            prefork.fd_report = p_report[0];
+    }
+}
+
+/* Client side, for a job that will not run. Its output file goes away. */
+void cancel_prefork()
+{
+    if (prefork.pid == 0)
+        return;
+    close(prefork.fd_launch);
+    close(prefork.fd_read_filename);
+    close(prefork.fd_report);
+    waitpid(prefork.pid, NULL, 0);
+    prefork.pid = 0;
+}
+
+static void launch_prefork(const char *cgroup)
+{
+    struct Launch l;
+
+    l.output_limit = command_line.output_limit;
+    l.output_rate = command_line.output_rate;
+    l.output_policy = command_line.output_policy;
+    l.index_lines = command_line.index_lines;
+    l.numa_node = command_line.numa_node;
+    l.cpus_size = command_line.cpus != 0 ? strlen(command_line.cpus) + 1 : 0;
+    l.cgroup_size = cgroup != 0 ? strlen(cgroup) + 1 : 0;
+    write_all(prefork.fd_launch, (const char *) &l, sizeof(l));
+    if (l.cpus_size > 0)
+        write_all(prefork.fd_launch, command_line.cpus, l.cpus_size);
+    if (l.cgroup_size > 0)
+        write_all(prefork.fd_launch, cgroup, l.cgroup_size);
+    close(prefork.fd_launch);
+}
+
 int run_job(struct Result *res)
 {
     int pid;
     int errorlevel;
     int p[2];
+    int p_report[2];
+    char *cgroup;
 
 
     /* For the parent */
@@ -263,9 +969,25 @@ int run_job(struct Result *res)
 
     block_sigint();
 
+    cgroup = cgroup_create(command_line.jobid);
+
+    if (prefork.pid != 0)
+    {
+        launch_prefork(cgroup);
+        run_parent(prefork.fd_read_filename, prefork.fd_report, prefork.pid,
+                cgroup, res);
+        prefork.pid = 0;
+        free(cgroup);
+        return 0;
+    }
+
     /* Prepare the output filename sending */
     pipe(p);
 
+    /* Only the relay keeps the report pipe, if there is one */
+    pipe(p_report);
+    fcntl(p_report[1], F_SETFD, FD_CLOEXEC);
+
     pid = fork();
 
     switch(pid)
@@ -274,7 +996,8 @@ int run_job(struct Result *res)
             restore_sigmask();
             close(server_socket);
             close(p[0]);
-            run_child(p[1]);
+            close(p_report[0]);
+            run_child(p[1], p_report[1], cgroup);
             /* Not reachable, if the 'exec' of the command
              * works. Thus, command exists, etc. */
             fprintf(stderr, "ts could not run the command\n");
@@ -288,10 +1011,12 @@ int run_job(struct Result *res)
             error("forking");
         default:
             close(p[1]);
-            run_parent(p[0], pid, res);
+            close(p_report[1]);
+            run_parent(p[0], p_report[0], pid, cgroup, res);
             break;
     }
 
+    free(cgroup);
     return errorlevel;
 }
 
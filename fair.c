@@ -0,0 +1,271 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Fair share.
+ * On a socket shared by many users, the server takes the user of each
+ * client from the socket (SO_PEERCRED), and each job keeps the user who
+ * queued it. With TS_FAIR_SHARE, the free slots go to the users by deficit
+ * round robin: in each round, a user with a job ready earns its share in
+ * credit, and a job costs its slots times its expected run time (as
+ * predict.c expects it, or a second). In turn, the first user with credit
+ * for its next job runs it; a user with nothing queued loses its credit.
+ * So the users get slot-seconds in proportion to their shares, however
+ * many jobs each one queues. TS_FAIR_SHARE is "user=share,..." by name or
+ * uid, with "*" for the rest, 1 by default. TS_USER_SLOTS, the same way,
+ * caps the slots each user has running. */
+
+struct User
+{
+    int uid;
+    char name[32];
+    int share;
+    int max_slots; /* 0 means no cap */
+    double deficit; /* Slot-seconds it may start */
+    double used; /* Slot-seconds run */
+    int running; /* Slots, in this pass */
+    int queued; /* Jobs, in this pass */
+    struct Job *head; /* The job it runs next, in this pass. 0 if none */
+    struct User *next;
+};
+
+/* Globals */
+static struct User *first_user = 0;
+static struct User *current = 0; /* Whose turn it is */
+static const char *shares = 0; /* TS_FAIR_SHARE. 0 without fair share */
+static const char *user_slots = 0; /* TS_USER_SLOTS */
+
+/* Server side */
+
+/* On start */
+void fair_init()
+{
+    shares = getenv("TS_FAIR_SHARE");
+    user_slots = getenv("TS_USER_SLOTS");
+}
+
+/* The user of the other end of the socket. Without SO_PEERCRED, the one
+ * running the server. */
+int fair_peer_uid(int s)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+        return cred.uid;
+#endif
+    return getuid();
+}
+
+/* The value for the user in "user=value,...", or def */
+static int config_value(const char *list, const struct User *u, int def)
+{
+    char uid[20];
+    int value = def;
+    int len;
+
+    if (list == 0)
+        return def;
+    sprintf(uid, "%i", u->uid);
+    while (*list != '\0')
+    {
+        len = strcspn(list, "=,");
+        if (list[len] == '=')
+        {
+            if ((len == strlen(u->name) && strncmp(list, u->name, len) == 0)
+                    || (len == strlen(uid) && strncmp(list, uid, len) == 0))
+                return atoi(list + len + 1);
+            if (len == 1 && list[0] == '*')
+                value = atoi(list + len + 1);
+        }
+        list += strcspn(list, ",");
+        if (*list == ',')
+            ++list;
+    }
+    return value;
+}
+
+static struct User * find_user(int uid)
+{
+    struct User **last;
+    struct User *u;
+    struct passwd *pw;
+
+    for (last = &first_user; *last != 0; last = &(*last)->next)
+        if ((*last)->uid == uid)
+            return *last;
+
+    u = (struct User *) malloc(sizeof(*u));
+    if (u == 0)
+        error("Cannot allocate memory for the user %i", uid);
+    u->uid = uid;
+    pw = getpwuid(uid);
+    if (pw != 0)
+    {
+        strncpy(u->name, pw->pw_name, sizeof(u->name) - 1);
+        u->name[sizeof(u->name) - 1] = '\0';
+    }
+    else
+        sprintf(u->name, "%i", uid);
+    u->share = config_value(shares, u, 1);
+    if (u->share < 1)
+        u->share = 1;
+    u->max_slots = config_value(user_slots, u, 0);
+    if (u->max_slots < 0)
+        u->max_slots = 0;
+    u->deficit = 0;
+    u->used = 0;
+    u->running = 0;
+    u->queued = 0;
+    u->head = 0;
+    u->next = 0;
+    *last = u;
+    return u;
+}
+
+/* Before choosing the job to run, or listing them */
+void fair_new_pass(const struct Job *first)
+{
+    struct User *u;
+    const struct Job *p;
+
+    for (u = first_user; u != 0; u = u->next)
+    {
+        u->running = 0;
+        u->queued = 0;
+        u->head = 0;
+    }
+    for (p = first; p != 0; p = p->next)
+    {
+        u = find_user(p->uid);
+        if (p->state == RUNNING && !p->suspended)
+            u->running += p->num_slots;
+        else if (p->state == QUEUED || p->state == HOLDING_CLIENT)
+            ++u->queued;
+    }
+}
+
+/* Whether the job fits in the slots of its user */
+int fair_admits(const struct Job *p)
+{
+    struct User *u;
+
+    u = find_user(p->uid);
+    return u->max_slots == 0 || u->running + p->num_slots <= u->max_slots;
+}
+
+int fair_sharing()
+{
+    return shares != 0;
+}
+
+/* Where the job of the user to run next goes, as jobs.c picks it */
+struct Job ** fair_head(const struct Job *p)
+{
+    return &find_user(p->uid)->head;
+}
+
+static double job_cost(const struct Job *p)
+{
+    return p->num_slots * (p->estimate > 0 ? p->estimate : 1);
+}
+
+/* Of the heads of the users, the one to run, taking its cost. 0 if none. */
+struct Job * fair_pick()
+{
+    struct User *u;
+    double rounds;
+    double need;
+
+    if (first_user == 0)
+        return 0;
+    if (current == 0)
+        current = first_user;
+    for (u = first_user; u != 0; u = u->next)
+        if (u->queued == 0)
+            u->deficit = 0;
+
+    while (1)
+    {
+        /* The user whose turn it is keeps it while it has credit. A
+         * thousandth less, for the rounding. */
+        u = current;
+        do
+        {
+            if (u->head != 0 && u->deficit >= job_cost(u->head) - 0.001)
+            {
+                u->deficit -= job_cost(u->head);
+                current = u;
+                return u->head;
+            }
+            u = u->next != 0 ? u->next : first_user;
+        } while (u != current);
+
+        /* No one has credit yet: as many rounds as the first one to have
+         * it needs, at once, in fractions of a round not to give more */
+        rounds = -1;
+        for (u = first_user; u != 0; u = u->next)
+            if (u->head != 0)
+            {
+                need = (job_cost(u->head) - u->deficit) / u->share;
+                if (rounds < 0 || need < rounds)
+                    rounds = need;
+            }
+        if (rounds < 0)
+            return 0;
+        for (u = first_user; u != 0; u = u->next)
+            if (u->head != 0)
+                u->deficit += rounds * u->share;
+    }
+}
+
+/* After each run */
+void fair_learn(const struct Job *p, const struct Result *result)
+{
+    /* real_ms is in seconds */
+    find_user(p->uid)->used += p->num_slots * result->real_ms;
+}
+
+/* For the list, after fair_new_pass(). Only if there is more than one
+ * user, or fair share or caps. */
+void fair_list(int s)
+{
+    char line[200];
+    char cap[30];
+    struct User *u;
+    int users = 0;
+
+    for (u = first_user; u != 0; u = u->next)
+        if (u->running > 0 || u->queued > 0)
+            ++users;
+    if (users < 2 && shares == 0 && user_slots == 0)
+        return;
+
+    for (u = first_user; u != 0; u = u->next)
+    {
+        if (u->running == 0 && u->queued == 0 && u->used == 0)
+            continue;
+        cap[0] = '\0';
+        if (u->max_slots > 0)
+            sprintf(cap, " of %i", u->max_slots);
+        snprintf(line, sizeof(line), "User %s: %i slots running%s, "
+                "%i queued, share %i, %.0f slot-s run\n", u->name,
+                u->running, cap, u->queued, u->share, u->used);
+        send_list_line(s, line);
+    }
+}
@@ -0,0 +1,330 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Grep.
+ * "ts --grep" looks for a literal string in the outputs of many jobs.
+ * The server forks a process for it, so the queue goes on meanwhile. That
+ * process reads the outputs with a pool of threads: each thread takes the
+ * next job, and sends its matching lines to the client as "jobid:line",
+ * in LIST_LINE messages. The lines of a job are never interleaved with
+ * those of another job. */
+
+enum
+{
+    GREP_BUFFER = 1024 * 1024, /* bytes read at once; longer lines are cut */
+    GREP_FLUSH = 64 * 1024 /* bytes of matches sent at once */
+};
+
+struct Matches
+{
+    char *data;
+    int used;
+    int allocated;
+};
+
+/* Globals, shared by the threads */
+static const char *pattern;
+static int pattern_len;
+static int njobs;
+static const int *jobids;
+static char * const *jobnames;
+static int next_job;
+static int client_socket;
+static int client_gone;
+static pthread_mutex_t grep_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the first occurrence of the pattern in [p, end), or 0.
+ * The C library vectorizes memchr, so the search for the first byte of
+ * the pattern goes many bytes at a time; memcmp checks the candidates. */
+static const char * find_literal(const char *p, const char *end)
+{
+    if (pattern_len == 0)
+        return p;
+
+    while (end - p >= pattern_len)
+    {
+        p = memchr(p, pattern[0], end - p - pattern_len + 1);
+        if (p == 0)
+            return 0;
+        if (memcmp(p + 1, pattern + 1, pattern_len - 1) == 0)
+            return p;
+        ++p;
+    }
+    return 0;
+}
+
+static int send_all(int fd, const char *data, int bytes)
+{
+    while (bytes > 0)
+    {
+        int res;
+        res = write(fd, data, bytes);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += res;
+        bytes -= res;
+    }
+    return 0;
+}
+
+static void flush_matches(struct Matches *o)
+{
+    struct msg m;
+
+    if (o->used == 0)
+        return;
+
+    /* c_wait_server_lines() wants a string */
+    o->data[o->used++] = '\0';
+    m.type = LIST_LINE;
+    m.u.size = o->used;
+
+    pthread_mutex_lock(&grep_lock);
+    if (!client_gone
+            && (send_all(client_socket, (char *) &m, sizeof(m)) == -1
+                || send_all(client_socket, o->data, o->used) == -1))
+        client_gone = 1;
+    pthread_mutex_unlock(&grep_lock);
+
+    o->used = 0;
+}
+
+static void add_match(struct Matches *o, int jobid, const char *line,
+        int len)
+{
+    /* "jobid:", the line, "\n" and the final '\0' */
+    if (o->used + len + 20 > o->allocated)
+    {
+        o->allocated = o->used + len + 20 + GREP_FLUSH;
+        o->data = (char *) realloc(o->data, o->allocated);
+        if (o->data == 0)
+            error("Cannot allocate memory for the grep matches");
+    }
+    o->used += sprintf(o->data + o->used, "%i:", jobid);
+    memcpy(o->data + o->used, line, len);
+    o->used += len;
+    o->data[o->used++] = '\n';
+
+    if (o->used >= GREP_FLUSH)
+        flush_matches(o);
+}
+
+/* [begin, end) holds whole lines */
+static void grep_lines(struct Matches *o, int jobid, const char *begin,
+        const char *end)
+{
+    const char *p = begin;
+    const char *match;
+
+    while (p < end && (match = find_literal(p, end)) != 0)
+    {
+        const char *line = match;
+        const char *eol;
+
+        while (line > p && line[-1] != '\n')
+            --line;
+        eol = memchr(match, '\n', end - match);
+        if (eol == 0)
+            eol = end;
+        add_match(o, jobid, line, eol - line);
+        p = eol + 1;
+    }
+}
+
+static void grep_job(struct Matches *o, int jobid, const char *name,
+        char *buf)
+{
+    long start, end, pos;
+    int used = 0;
+    int fd;
+
+    fd = store_open(name, &start, &end);
+    if (fd == -1)
+        return;
+
+    pos = start;
+    while (1)
+    {
+        int want;
+        int res;
+        int eof;
+        int limit;
+        int gone;
+
+        pthread_mutex_lock(&grep_lock);
+        gone = client_gone;
+        pthread_mutex_unlock(&grep_lock);
+        if (gone)
+            break;
+
+        want = GREP_BUFFER - used;
+        if (end != -1 && end - pos < want)
+            want = end - pos;
+        res = (want > 0) ? read(fd, buf + used, want) : 0;
+        if (res == -1 && errno == EINTR)
+            continue;
+        eof = (res <= 0);
+        if (!eof)
+        {
+            used += res;
+            pos += res;
+        }
+
+        /* Up to the last complete line, unless it doesn't fit */
+        limit = used;
+        if (!eof)
+        {
+            while (limit > 0 && buf[limit - 1] != '\n')
+                --limit;
+            if (limit == 0)
+            {
+                if (used < GREP_BUFFER)
+                    continue;
+                limit = used;
+            }
+        }
+
+        grep_lines(o, jobid, buf, buf + limit);
+        used -= limit;
+        memmove(buf, buf + limit, used);
+
+        if (eof)
+            break;
+    }
+    close(fd);
+}
+
+static void * grep_worker(void *arg)
+{
+    struct Matches matches;
+    char *buf;
+
+    buf = (char *) malloc(GREP_BUFFER);
+    if (buf == 0)
+        error("Cannot allocate memory for the grep buffer");
+    matches.data = 0;
+    matches.used = 0;
+    matches.allocated = 0;
+
+    while (1)
+    {
+        int i;
+        int gone;
+
+        pthread_mutex_lock(&grep_lock);
+        i = next_job++;
+        gone = client_gone;
+        pthread_mutex_unlock(&grep_lock);
+
+        if (i >= njobs || gone)
+            break;
+        grep_job(&matches, jobids[i], jobnames[i], buf);
+        flush_matches(&matches);
+    }
+
+    free(matches.data);
+    free(buf);
+    return 0;
+}
+
+static int grep_threads()
+{
+    char *str;
+    long n;
+
+    str = getenv("TS_GREP_THREADS");
+    if (str != NULL)
+        n = atol(str);
+    else
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    if (n > njobs)
+        n = njobs;
+    return n;
+}
+
+static void grep_main()
+{
+    pthread_t *threads;
+    int nthreads;
+    int started = 0;
+    int i;
+
+    nthreads = grep_threads();
+    threads = (pthread_t *) malloc(nthreads * sizeof(*threads));
+    if (threads == 0)
+        error("Cannot allocate memory for %i grep threads", nthreads);
+
+    for (i = 0; i < nthreads; ++i)
+        if (pthread_create(&threads[started], NULL, grep_worker, NULL) == 0)
+            ++started;
+
+    /* Without threads, do it here */
+    if (started == 0)
+        grep_worker(NULL);
+
+    for (i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+/* Server side. Sends the matches in the outputs to the socket s, from
+ * another process. The caller can close s when this returns. */
+void grep_outputs(int s, const char *pat, int n, const int *ids,
+        char * const *names)
+{
+    int pid;
+    int fd;
+
+    pid = fork();
+    switch (pid)
+    {
+        case 0:
+            /* The grandchild is not left as a zombie of the server */
+            if (fork() != 0)
+                exit(0);
+            /* Don't keep the other clients waiting for an EOF */
+            for (fd = 3; fd < FD_SETSIZE; ++fd)
+                if (fd != s)
+                    close(fd);
+            signal(SIGTERM, SIG_DFL);
+
+            pattern = pat;
+            pattern_len = strlen(pat);
+            njobs = n;
+            jobids = ids;
+            jobnames = names;
+            next_job = 0;
+            client_socket = s;
+            client_gone = 0;
+            grep_main();
+            exit(0);
+        case -1:
+            warning("Cannot fork for grep");
+            break;
+        default:
+            waitpid(pid, NULL, 0);
+    }
+}
@@ -0,0 +1,213 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Line index.
+ * With TS_INDEX_LINES=N, the relay writes "<output>.idx" while the job
+ * runs: an array of longs, where the first is N and the k-th is the
+ * offset in the output where the line k*N+1 starts. Reading some lines
+ * in the middle of a huge output is then a seek plus a short scan. */
+
+enum { ISIZE = 16384 };
+
+char * index_path(const char *name)
+{
+    char *path;
+
+    path = (char *) malloc(strlen(name) + 5);
+    if (path == 0)
+        error("Cannot allocate memory for the index path");
+    sprintf(path, "%s.idx", name);
+    return path;
+}
+
+/* Returns -1 if the index cannot be created */
+int index_create(const char *name, long interval)
+{
+    char *path;
+    int fd;
+
+    path = index_path(name);
+    fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+    free(path);
+    if (fd == -1)
+        return -1;
+    write(fd, &interval, sizeof(interval));
+    return fd;
+}
+
+/* The bytes written to the output at ix->offset */
+void index_feed(struct Line_index *ix, const char *buf, int len)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+
+    while (p < end && (p = memchr(p, '\n', end - p)) != 0)
+    {
+        ++p;
+        ++ix->lines;
+        if (ix->lines % ix->interval == 0)
+        {
+            long offset = ix->offset + (p - buf);
+            write(ix->fd, &offset, sizeof(offset));
+        }
+    }
+    ix->offset += len;
+}
+
+/* Offset of the output where the line 'line' starts, or of an earlier
+ * line known to the index; 'line' is updated to it. */
+static long index_lookup(const char *name, long *line)
+{
+    char *path;
+    int fd;
+    long interval;
+    long k;
+    long offset = 0;
+
+    path = index_path(name);
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1)
+    {
+        *line = 1;
+        return 0;
+    }
+
+    if (read(fd, &interval, sizeof(interval)) != sizeof(interval)
+            || interval <= 0)
+        k = 0;
+    else
+        k = (*line - 1) / interval;
+
+    /* The job may not have got that far yet */
+    for (; k > 0; --k)
+        if (pread(fd, &offset, sizeof(offset), k * sizeof(offset))
+                == sizeof(offset))
+            break;
+    close(fd);
+
+    if (k == 0)
+    {
+        *line = 1;
+        return 0;
+    }
+    *line = k * interval + 1;
+    return offset;
+}
+
+static int write_out(const char *buf, int len)
+{
+    while (len > 0)
+    {
+        int res;
+        res = write(1, buf, len);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/* Shows the lines first..last (from 1, last -1 for all), or the bytes
+ * first..last (from 0), of the output as it is now. */
+int cat_range(const char *name, long first, long last, int by_lines)
+{
+    char buf[ISIZE];
+    long start, end, pos;
+    long line = 1;
+    int fd;
+
+    fd = store_open(name, &start, &end);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: cannot open the output file %s\n", name);
+        return -1;
+    }
+
+    if (by_lines)
+    {
+        line = first;
+        pos = start + index_lookup(name, &line);
+    }
+    else
+        pos = start + first;
+
+    while (1)
+    {
+        int want = ISIZE;
+        int res;
+        char *from;
+        char *to;
+
+        if (end != -1 && end - pos < want)
+            want = end - pos;
+        if (!by_lines && last != -1 && start + last + 1 - pos < want)
+            want = start + last + 1 - pos;
+        if (want <= 0)
+            break;
+
+        res = pread(fd, buf, want, pos);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        pos += res;
+
+        from = buf;
+        to = buf + res;
+        if (by_lines)
+        {
+            char *p;
+            /* Skip up to the first line wanted */
+            while (line < first && from < to
+                    && (p = memchr(from, '\n', to - from)) != 0)
+            {
+                from = p + 1;
+                ++line;
+            }
+            if (line < first)
+                continue;
+            /* And stop after the last */
+            if (last != -1)
+            {
+                p = from;
+                while (p < to && line <= last
+                        && (p = memchr(p, '\n', to - p)) != 0)
+                {
+                    ++p;
+                    ++line;
+                }
+                if (p == 0)
+                    p = to;
+                to = p;
+            }
+        }
+
+        if (write_out(from, to - from) == -1)
+            break;
+        if (by_lines && last != -1 && line > last)
+            break;
+    }
+
+    close(fd);
+    return 0;
+}
@@ -23,6 +23,9 @@ void pinfo_init(struct Procinfo *p)
     p->end_time.tv_usec = 0;
     p->enqueue_time.tv_sec = 0;
     p->enqueue_time.tv_usec = 0;
+    p->suspend_time.tv_sec = 0;
+    p->suspend_time.tv_usec = 0;
+    p->suspended = 0;
 }
 
 void pinfo_free(struct Procinfo *p)
@@ -105,6 +108,7 @@ void pinfo_set_start_time(struct Procinfo *p)
     gettimeofday(&p->start_time, 0);
     p->end_time.tv_sec = 0;
     p->end_time.tv_usec = 0;
+    p->suspended = 0;
 }
 
 void pinfo_set_end_time(struct Procinfo *p)
@@ -134,3 +138,37 @@ float pinfo_time_run(const struct Procinfo *p)
 
     return t;
 }
+
+void pinfo_set_suspend_time(struct Procinfo *p)
+{
+    gettimeofday(&p->suspend_time, 0);
+}
+
+void pinfo_set_resume_time(struct Procinfo *p)
+{
+    struct timeval now;
+
+    if (p->suspend_time.tv_sec == 0)
+        return;
+    gettimeofday(&now, 0);
+    p->suspended += now.tv_sec - p->suspend_time.tv_sec;
+    p->suspended += (float) (now.tv_usec - p->suspend_time.tv_usec) / 1000000.;
+    p->suspend_time.tv_sec = 0;
+    p->suspend_time.tv_usec = 0;
+}
+
+/* Including the suspension going on */
+float pinfo_time_suspended(const struct Procinfo *p)
+{
+    float t;
+    struct timeval now;
+
+    t = p->suspended;
+    if (p->suspend_time.tv_sec != 0)
+    {
+        gettimeofday(&now, 0);
+        t += now.tv_sec - p->suspend_time.tv_sec;
+        t += (float) (now.tv_usec - p->suspend_time.tv_usec) / 1000000.;
+    }
+    return t;
+}
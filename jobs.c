@@ -8,10 +8,20 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
 #include "main.h"
 
+enum
+{
+    RETRY_MAX_DELAY = 3600, /* seconds, for the exponential backoff */
+    PIPE_AWAITED = -2 /* pipe_to of a job waiting for one to take its output */
+};
+
 /* The list will access them */
 int busy_slots = 0;
 int max_slots = 1;
@@ -23,6 +33,14 @@ struct Notify
     struct Notify *next;
 };
 
+/* Of the dependencies of a job */
+enum
+{
+    DEPEND_WAITS,
+    DEPEND_MET,
+    DEPEND_FAILED
+};
+
 /* Globals */
 static struct Job *firstjob = 0;
 static struct Job *first_finished_job = 0;
@@ -36,12 +54,78 @@ static int last_finished_jobid;
 
 static struct Notify *first_notify = 0;
 
+/* From RUNJOB to the exec of the job, in ms, for --stats */
+static long launches = 0;
+static double launch_total = 0;
+static double launch_max = 0;
+
 int max_jobs;
 
 static struct Job * get_job(int jobid);
+static void signal_job(const struct Job *p, int sig);
 void notify_errorlevel(struct Job *p);
 
-static void send_list_line(int s, const char * str)
+/* Returns -1 if not set */
+static long get_env_long(const char *name)
+{
+    char *str;
+
+    str = getenv(name);
+    if (str == NULL)
+        return -1;
+    return labs(atol(str));
+}
+
+/* Plain output files are only removed if the user asked for it */
+static int reclaim_plain_outputs()
+{
+    return getenv("TS_RECLAIM") != NULL
+        || getenv("TS_KEEP_COUNT") != NULL
+        || getenv("TS_KEEP_BYTES") != NULL
+        || getenv("TS_KEEP_AGE") != NULL;
+}
+
+/* Hand the output of the job to the reclaimer */
+static void release_output(struct Job *p)
+{
+    if (p->output_filename == 0 || p->output_reclaimed || p->cached)
+        return;
+    if (!store_is_virtual(p->output_filename) && !reclaim_plain_outputs())
+        return;
+    cache_forget(p->output_filename);
+    reclaim_output(p->output_filename);
+    p->output_reclaimed = 1;
+}
+
+/* The queue limits bound those of the job */
+static long tighter_limit(long job, long queue)
+{
+    if (queue <= 0)
+        return job;
+    if (job <= 0 || queue < job)
+        return queue;
+    return job;
+}
+
+static void set_output_limits(struct Job *p)
+{
+    char *str;
+
+    p->output_limit = tighter_limit(p->output_limit,
+            get_env_long("TS_MAXOUTPUT"));
+    p->output_rate = tighter_limit(p->output_rate,
+            get_env_long("TS_OUTPUT_RATE"));
+    if (p->output_policy == -1)
+    {
+        str = getenv("TS_OUTPUT_POLICY");
+        if (str != NULL)
+            p->output_policy = output_policy_from_string(str);
+        if (p->output_policy == -1)
+            p->output_policy = OUTPUT_TRUNCATE;
+    }
+}
+
+void send_list_line(int s, const char * str)
 {
     struct msg m;
 
@@ -218,7 +302,7 @@ const char * jstate2string(enum Jobstate s)
     return jobstate;
 }
 
-void s_list(int s)
+void s_list(int s, int format)
 {
     const struct Job **job_list;
     int job_list_size = 0;
@@ -239,6 +323,22 @@ void s_list(int s)
     for (job = first_finished_job; job != NULL; job = job->next)
         job_list[job_list_size++] = job;
 
+    predict_etas(firstjob, max_slots);
+
+    if (format == LIST_TSV)
+    {
+        int i;
+        for (i = 0; i < job_list_size; ++i)
+        {
+            char *line;
+            line = joblist_line_tsv(job_list[i]);
+            send_list_line(s, line);
+            free(line);
+        }
+        free(job_list);
+        return;
+    }
+
     /* Print jobs to list of strings */
     table = joblist_table(job_list, job_list_size);
 
@@ -250,6 +350,10 @@ void s_list(int s)
     }
     free(table);
     free(job_list);
+
+    /* The usage of each user, on a shared queue */
+    fair_new_pass(firstjob);
+    fair_list(s);
 }
 
 static struct Job * newjobptr()
@@ -277,6 +381,20 @@ static struct Job * newjobptr()
     return p->next;
 }
 
+/* The memory of a job out of the lists. Its output is the caller's. */
+static void free_job(struct Job *p)
+{
+    free(p->command);
+    free(p->output_filename);
+    pinfo_free(&p->info);
+    free(p->label);
+    free(p->key);
+    free(p->depends);
+    free(p->notify_errorlevel_to);
+    free(p->args);
+    free(p);
+}
+
 /* Returns -1 if no last job id found */
 static int find_last_jobid_in_queue(int neglect_jobid)
 {
@@ -312,112 +430,370 @@ static int find_last_stored_jobid_finished()
     return last_jobid;
 }
 
-/* Returns job id or -1 on error */
-int s_newjob(int s, struct msg *m)
+static void clear_batch_progress(struct Batch_progress *b)
+{
+    b->done = 0;
+    b->failed = 0;
+    b->first_failed = -1;
+    b->first_errorlevel = 0;
+    b->slowest = -1;
+    b->slowest_time = 0;
+}
+
+/* Commands are numbered from 1 for the user */
+static void add_batch_info(struct Job *p)
+{
+    pinfo_addinfo(&p->info, 100, "Batch: %i of %i commands run, %i failed\n",
+            p->batch.done, p->batch_size, p->batch.failed);
+    if (p->batch.first_failed >= 0)
+        pinfo_addinfo(&p->info, 100, "First failure: command %i, exit code "
+                "%i\n", p->batch.first_failed + 1, p->batch.first_errorlevel);
+    if (p->batch.slowest >= 0)
+        pinfo_addinfo(&p->info, 100, "Slowest: command %i, %f s\n",
+                p->batch.slowest + 1, p->batch.slowest_time);
+}
+
+/* A job found in the cache will not run. It shows the output of the job
+ * that stored it, which is not for it to reclaim. */
+static void take_cached_result(struct Job *p)
+{
+    time_t created;
+    char *output;
+
+    if (!cache_lookup(p->cache_key, &p->result, &output, &created))
+    {
+        pinfo_addinfo(&p->info, 100, "Cache key: %s\n", p->cache_key);
+        return;
+    }
+    p->cached = 1;
+    p->output_filename = output;
+    pinfo_addinfo(&p->info, 100, "Cached: the result of a run on %s",
+            ctime(&created));
+}
+
+/* The queued or running job of the key, or 0 */
+static struct Job * find_job_with_key(const char *key)
 {
     struct Job *p;
-    int res;
 
-    p = newjobptr();
+    for (p = firstjob; p != 0; p = p->next)
+        if (p->key != 0 && strcmp(p->key, key) == 0
+                && (p->state == QUEUED || p->state == RUNNING
+                    || p->state == HOLDING_CLIENT))
+            return p;
+    return 0;
+}
 
-    p->jobid = jobids++;
-    if (count_not_finished_jobs() < max_jobs)
-        p->state = QUEUED;
+/* One more job it waits for */
+static void add_depend(struct Job *p, int jobid, int finished, int errorlevel)
+{
+    struct Depend *d;
+
+    d = (struct Depend *) realloc(p->depends,
+            (p->depends_size + 1) * sizeof(*d));
+    if (d == 0)
+        error("Cannot allocate memory for the dependencies of the job %i",
+                p->jobid);
+    p->depends = d;
+    d += p->depends_size++;
+    d->jobid = jobid;
+    d->finished = finished;
+    d->errorlevel = errorlevel;
+}
+
+/* On a job still in the queue, which will notify its result, or on a
+ * finished one */
+static void depend_on_job(struct Job *p, int jobid)
+{
+    struct Job *parent;
+
+    parent = findjob(jobid);
+    if (parent != 0 && parent != p)
+    {
+        add_notify_errorlevel_to(parent, p->jobid);
+        add_depend(p, jobid, 0, 0);
+        return;
+    }
+
+    parent = find_finished_job(jobid);
+    /* We consider as if the job not found didn't finish well */
+    add_depend(p, jobid, 1, parent != 0 ? parent->result.errorlevel : -1);
+}
+
+/* -d: on the last job queued */
+static void depend_on_previous(struct Job *p)
+{
+    struct Job *parent;
+    int jobid;
+    int errorlevel;
+
+    /* As we already have 'p' in the queue,
+     * neglect it during the find_last_jobid_in_queue() */
+    jobid = find_last_jobid_in_queue(p->jobid);
+
+    /* We don't trust the last jobid in the queue (running or queued)
+     * if it's not the last added job. In that case, let
+     * the next control flow handle it as if it could not
+     * do_depend on any still queued job. */
+    if (jobid != -1 && last_finished_jobid <= jobid)
+    {
+        depend_on_job(p, jobid);
+        return;
+    }
+
+    /* Otherwise take the finished job, or the last_errorlevel */
+    jobid = find_last_stored_jobid_finished();
+
+    /* If we have a newer result stored, use it */
+    /* NOTE:
+     *   Reading this now, I don't know how jobid can be
+     *   greater than last_finished_jobid */
+    if (last_finished_jobid < jobid)
+    {
+        parent = find_finished_job(jobid);
+        if (!parent)
+            error("jobid %i suddenly disappeared from the finished list",
+                jobid);
+        errorlevel = parent->result.errorlevel;
+    }
     else
-        p->state = HOLDING_CLIENT;
+        errorlevel = last_errorlevel;
+    add_depend(p, jobid, 1, errorlevel);
+}
+
+/* On the jobs of the label, finished or not */
+static void depend_on_label(struct Job *p, const char *label)
+{
+    struct Job *q;
+
+    for (q = first_finished_job; q != 0; q = q->next)
+        if (q->label != 0 && strcmp(q->label, label) == 0)
+            add_depend(p, q->jobid, 1, q->result.errorlevel);
+    for (q = firstjob; q != 0; q = q->next)
+        if (q != p && q->label != 0 && strcmp(q->label, label) == 0)
+        {
+            add_notify_errorlevel_to(q, p->jobid);
+            add_depend(p, q->jobid, 0, 0);
+        }
+}
+
+/* --pipe-from: a job yet to start, whose output no other job takes. If it
+ * is not one, the job will be skipped. */
+static void pipe_from_job(struct Job *p)
+{
+    struct Job *producer;
+
+    producer = findjob(p->pipe_from);
+    if (producer == 0 || producer == p || producer->pipe_to >= 0
+            || producer->attempt > 0
+            || (producer->state != QUEUED
+                && producer->state != HOLDING_CLIENT))
+    {
+        pinfo_addinfo(&p->info, 100, "Input: the job %i cannot give its "
+                "output\n", p->pipe_from);
+        return;
+    }
+    producer->pipe_to = p->jobid;
+    producer->pipe_tee = p->pipe_tee;
+    pinfo_addinfo(&producer->info, 100, "Output: piped to the job %i%s\n",
+            p->jobid, p->pipe_tee ? ", and stored" : "");
+    pinfo_addinfo(&p->info, 100, "Input: piped from the job %i\n",
+            producer->jobid);
+}
+
+/* Queued, not to start before 'when' */
+static void delay_job(struct Job *p, time_t when)
+{
+    time_t now = time(NULL);
+
+    p->fire_time = when;
+    if (when <= now)
+        return;
+    p->delayed = 1;
+    timer_add(when - now, TIMER_START, p->jobid);
+}
+
+/* The rest of a NEWJOB that will not make a job */
+static void skip_newjob_bytes(int s, const struct msg *m)
+{
+    char *buffer;
+    int size;
+
+    size = m->u.newjob.command_size + m->u.newjob.label_size
+        + m->u.newjob.env_size + m->u.newjob.depend_jobids_size
+        + m->u.newjob.depend_labels_size;
+    buffer = (char *) malloc(size);
+    if (buffer == 0)
+        error("Cannot allocate memory in s_newjob (%i)", size);
+    if (recv_bytes(s, buffer, size) != size)
+        error("wrong bytes received");
+    free(buffer);
+}
+
+/* The job of a NEWJOB, queued, before the bytes after the message */
+static struct Job * job_from_msg(const struct msg *m)
+{
+    struct Job *p;
+
+    p = newjobptr();
+    p->key = 0;
+    p->jobid = jobids++;
+    p->state = QUEUED;
     p->num_slots = m->u.newjob.num_slots;
     p->store_output = m->u.newjob.store_output;
+    p->output_reclaimed = 0;
+    p->output_limit = m->u.newjob.output_limit;
+    p->output_rate = m->u.newjob.output_rate;
+    p->output_policy = m->u.newjob.output_policy;
+    p->memory_max = m->u.newjob.memory_max;
+    p->cpu_max = m->u.newjob.cpu_max;
+    p->io_weight = m->u.newjob.io_weight;
+    p->memory_estimate = 0;
+    p->timeout = m->u.newjob.timeout;
+    p->deadline = m->u.newjob.deadline;
+    p->timed_out = NOT_TIMED_OUT;
+    p->retries = m->u.newjob.retries;
+    p->retry_delay = m->u.newjob.retry_delay;
+    memcpy(p->retry_on, m->u.newjob.retry_on, sizeof(p->retry_on));
+    p->retry_on[MAX_RETRY_ON - 1] = 0;
+    p->attempt = 0;
+    p->retry_pending = 0;
+    p->fire_time = 0;
+    p->delayed = 0;
+    p->every = m->u.newjob.every;
+    p->runs = 0;
+    p->priority = m->u.newjob.priority;
+    p->suspended = 0;
+    p->batch_size = m->u.newjob.batch_size;
+    clear_batch_progress(&p->batch);
+    memcpy(p->cache_key, m->u.newjob.cache_key, sizeof(p->cache_key));
+    p->cache_key[CACHE_KEY_SIZE - 1] = '\0';
+    p->cached = 0;
     p->should_keep_finished = m->u.newjob.should_keep_finished;
     p->notify_errorlevel_to = 0;
     p->notify_errorlevel_to_size = 0;
     p->do_depend = m->u.newjob.do_depend;
-    p->depend_on = -1; /* By default. May be overriden in the next conditions */
-    if (m->u.newjob.do_depend == 1)
+    p->depend_mode = m->u.newjob.depend_mode;
+    if (p->depend_mode < DEPEND_ALL_OK || p->depend_mode > DEPEND_ALWAYS)
+        p->depend_mode = DEPEND_ALL_OK;
+    p->depends = 0;
+    p->depends_size = 0;
+    p->path = 0;
+    p->eta = -1;
+    p->history = 0;
+    p->history_generation = -1;
+    p->pipe_from = m->u.newjob.pipe_from;
+    p->pipe_to = m->u.newjob.pipe_out ? PIPE_AWAITED : -1;
+    p->pipe_tee = m->u.newjob.pipe_tee;
+    p->pipe_name = 0;
+
+    pinfo_init(&p->info);
+    pinfo_set_enqueue_time(&p->info);
+    p->label = 0;
+    p->args = 0;
+    p->args_size = 0;
+    p->uid = -1;
+
+    return p;
+}
+
+/* After the bytes of a NEWJOB */
+static void job_settle(struct Job *p, const struct msg *m)
+{
+    if (p->pipe_from >= 0)
+        pipe_from_job(p);
+    if (p->pipe_to == PIPE_AWAITED)
+        pinfo_addinfo(&p->info, 100, "Output: waits for a job to take it\n");
+
+    /* They apply only if the client runs the job in a cgroup */
+    if (p->memory_max > 0)
+        pinfo_addinfo(&p->info, 100, "Memory limit: %ld bytes\n",
+                p->memory_max);
+    if (p->cpu_max > 0)
+        pinfo_addinfo(&p->info, 100, "CPU limit: %i%%\n", p->cpu_max);
+    if (p->io_weight > 0)
+        pinfo_addinfo(&p->info, 100, "IO weight: %i\n", p->io_weight);
+
+    if (p->timeout > 0)
+        pinfo_addinfo(&p->info, 100, "Timeout: %i s\n", p->timeout);
+    /* Set again on each RUNJOB */
+    set_output_limits(p);
+    if (p->store_output && (p->output_limit > 0 || p->output_rate > 0))
+        pinfo_addinfo(&p->info, 200, "Output limit: %ld bytes (%s), "
+                "rate: %ld bytes/s\n", p->output_limit,
+                output_policy_to_string(p->output_policy), p->output_rate);
+    /* A recurring job counts from its first run */
+    if (m->u.newjob.not_before > 0)
+        delay_job(p, (time_t) m->u.newjob.not_before);
+    else if (p->every > 0)
+        p->fire_time = time(NULL);
+    if (p->delayed)
     {
-        /* Depend on the last queued job. */
+        char date[30];
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+                localtime(&p->fire_time));
+        pinfo_addinfo(&p->info, 100, "Not before: %s\n", date);
+    }
+    if (p->every > 0)
+        pinfo_addinfo(&p->info, 100, "Every: %i s\n", p->every);
 
-        /* As we already have 'p' in the queue,
-         * neglect it during the find_last_jobid_in_queue() */
-        if (m->u.newjob.depend_on == -1)
-        {
-            p->depend_on = find_last_jobid_in_queue(p->jobid);
-
-            /* We don't trust the last jobid in the queue (running or queued)
-             * if it's not the last added job. In that case, let
-             * the next control flow handle it as if it could not
-             * do_depend on any still queued job. */
-            if (last_finished_jobid > p->depend_on)
-                p->depend_on = -1;
-
-            /* If it's queued still without result, let it know
-             * its result to p when it finishes. */
-            if (p->depend_on != -1)
-            {
-                struct Job *depended_job;
-                depended_job = findjob(p->depend_on);
-                if (depended_job != 0)
-                    add_notify_errorlevel_to(depended_job, p->jobid);
-                else
-                    warning("The jobid %i is queued to do_depend on the jobid %i"
-                        " suddenly non existent in the queue", p->jobid,
-                        p->depend_on);
-            }
-            else /* Otherwise take the finished job, or the last_errorlevel */
-            {
-                if (m->u.newjob.depend_on == -1)
-                {
-                    int ljobid = find_last_stored_jobid_finished();
-                    p->depend_on = ljobid;
-
-                    /* If we have a newer result stored, use it */
-                    /* NOTE:
-                     *   Reading this now, I don't know how ljobid can be
-                     *   greater than last_finished_jobid */
-                    if (last_finished_jobid < ljobid)
-                    {
-                        struct Job *parent;
-                        parent = find_finished_job(ljobid);
-                        if (!parent)
-                            error("jobid %i suddenly disappeared from the finished list",
-                                ljobid);
-                        p->dependency_errorlevel = parent->result.errorlevel;
-                    }
-                    else
-                        p->dependency_errorlevel = last_errorlevel;
-                }
-            }
-        }
-        else
-        {
-            /* The user decided what's the job this new job depends on */
-            struct Job *depended_job;
+    if (p->deadline > 0)
+    {
+        pinfo_addinfo(&p->info, 100, "Deadline: %i s in the queue\n",
+                p->deadline);
+        /* For a delayed job, from its time on */
+        if (!p->delayed)
+            timer_add(p->deadline, TIMER_DEADLINE, p->jobid);
+    }
+    if (p->retries > 0)
+        pinfo_addinfo(&p->info, 100, "Retries: %i, from %i s on\n",
+                p->retries, p->retry_delay);
+    if (p->priority != 0)
+        pinfo_addinfo(&p->info, 100, "Priority: %i\n", p->priority);
+    if (p->key != 0)
+        pinfo_addinfo(&p->info, strlen(p->key) + 100, "Key: %s\n", p->key);
+    p->estimate = predict_runtime(p);
+    if (p->cache_key[0] != '\0')
+        take_cached_result(p);
+}
 
-            p->depend_on = m->u.newjob.depend_on;
+/* Returns job id or -1 on error. With the key of a job still to end, it
+ * returns that one, setting attached. */
+int s_newjob(int s, struct msg *m, int uid, int *attached)
+{
+    struct Job *p;
+    char *key = 0;
+    int res;
 
-            depended_job = findjob(p->depend_on);
-            if (depended_job != 0)
-                add_notify_errorlevel_to(depended_job, p->jobid);
-            else
-            {
-                struct Job *parent;
-                parent = find_finished_job(p->depend_on);
-                if (parent)
-                {
-                    p->dependency_errorlevel = parent->result.errorlevel;
-                }
-                else
-                {
-                    /* We consider as if the job not found
-                       didn't finish well */
-                    p->dependency_errorlevel = -1;
-                }
-            }
+    *attached = 0;
+    if (m->u.newjob.key_size > 0)
+    {
+        key = (char *) malloc(m->u.newjob.key_size);
+        if (key == 0)
+            error("Cannot allocate memory in s_newjob key_size(%i)",
+                    m->u.newjob.key_size);
+        res = recv_bytes(s, key, m->u.newjob.key_size);
+        if (res == -1)
+            error("wrong bytes received");
+        key[m->u.newjob.key_size - 1] = '\0';
+
+        p = find_job_with_key(key);
+        if (p != 0)
+        {
+            skip_newjob_bytes(s, m);
+            free(key);
+            pinfo_addinfo(&p->info, 100, "Attached: a submission of the "
+                    "same key\n");
+            *attached = 1;
+            return p->jobid;
         }
     }
 
-
-    pinfo_init(&p->info);
-    pinfo_set_enqueue_time(&p->info);
+    p = job_from_msg(m);
+    p->key = key;
+    p->uid = uid;
+    if (count_not_finished_jobs() >= max_jobs)
+        p->state = HOLDING_CLIENT;
 
     /* load the command */
     p->command = malloc(m->u.newjob.command_size);
@@ -429,7 +805,6 @@ int s_newjob(int s, struct msg *m)
         error("wrong bytes received");
 
     /* load the label */
-    p->label = 0;
     if (m->u.newjob.label_size > 0)
     {
         char *ptr;
@@ -459,9 +834,144 @@ int s_newjob(int s, struct msg *m)
         free(ptr);
     }
 
+    /* load the dependencies */
+    if (m->u.newjob.depend_previous)
+        depend_on_previous(p);
+    if (m->u.newjob.depend_jobids_size > 0)
+    {
+        int *jobids;
+        int i;
+
+        jobids = (int *) malloc(m->u.newjob.depend_jobids_size);
+        if (jobids == 0)
+            error("Cannot allocate memory in s_newjob depend_jobids_size(%i)",
+                    m->u.newjob.depend_jobids_size);
+        res = recv_bytes(s, (char *) jobids, m->u.newjob.depend_jobids_size);
+        if (res == -1)
+            error("wrong bytes received");
+        for (i = 0; i < m->u.newjob.depend_jobids_size / (int) sizeof(int);
+                ++i)
+            depend_on_job(p, jobids[i]);
+        free(jobids);
+    }
+    if (m->u.newjob.depend_labels_size > 0)
+    {
+        char *labels;
+        char *label;
+
+        labels = (char *) malloc(m->u.newjob.depend_labels_size);
+        if (labels == 0)
+            error("Cannot allocate memory in s_newjob depend_labels_size(%i)",
+                    m->u.newjob.depend_labels_size);
+        res = recv_bytes(s, labels, m->u.newjob.depend_labels_size);
+        if (res == -1)
+            error("wrong bytes received");
+        labels[m->u.newjob.depend_labels_size - 1] = '\0';
+        for (label = strtok(labels, ","); label != 0; label = strtok(0, ","))
+            depend_on_label(p, label);
+        free(labels);
+    }
+    job_settle(p, m);
+
+    return p->jobid;
+}
+
+/* The client of a NEWJOB attached to the job waits for it, as with -w */
+void s_newjob_attached(int s, int jobid)
+{
+    struct msg m;
+
+    m.type = NEWJOB_ATTACHED;
+    m.u.jobid = jobid;
+    send_msg(s, &m);
+    s_wait_job(s, jobid);
+}
+
+/* A job of the watch, queued by the server itself. It keeps args, the
+ * directory first. With settle, it waits that many seconds. */
+int s_add_watched_job(int watch, int uid, const char *label, int num_slots,
+        char *args, int args_size, int settle)
+{
+    struct Job *p;
+    struct msg m;
+    const char *arg;
+    int size;
+    int i;
+
+    memset(&m, 0, sizeof(m));
+    m.type = NEWJOB;
+    m.u.newjob.store_output = 1;
+    m.u.newjob.should_keep_finished = 1;
+    m.u.newjob.num_slots = num_slots;
+    m.u.newjob.output_policy = -1;
+    m.u.newjob.pipe_from = -1;
+    m.u.newjob.retry_delay = 1;
+    if (settle > 0)
+        m.u.newjob.not_before = time(NULL) + settle;
+
+    p = job_from_msg(&m);
+    p->uid = uid;
+    p->args = args;
+    p->args_size = args_size;
+
+    /* The command shown, from the arguments */
+    arg = args + strlen(args) + 1;
+    size = args_size - (arg - args);
+    p->command = (char *) malloc(size);
+    if (p->command == 0)
+        error("Cannot allocate memory for the command of the watch %i",
+                watch);
+    memcpy(p->command, arg, size);
+    for (i = 0; i < size - 1; ++i)
+        if (p->command[i] == '\0')
+            p->command[i] = ' ';
+
+    if (label != 0)
+    {
+        p->label = (char *) malloc(strlen(label) + 1);
+        if (p->label == 0)
+            error("Cannot allocate memory for the label of the watch %i",
+                    watch);
+        strcpy(p->label, label);
+    }
+    pinfo_addinfo(&p->info, 100, "Watch: %i\n", watch);
+    job_settle(p, &m);
+
     return p->jobid;
 }
 
+/* Whether a job of the same arguments is still to start, for a watch to
+ * queue no other. With settle, it waits that many seconds more. */
+int s_watch_coalesce(const char *args, int args_size, int settle)
+{
+    struct Job *p;
+
+    for (p = firstjob; p != 0; p = p->next)
+        if (p->state == QUEUED && p->args != 0 && p->args_size == args_size
+                && memcmp(p->args, args, args_size) == 0)
+        {
+            if (p->delayed && settle > 0)
+            {
+                p->fire_time = time(NULL) + settle;
+                timer_add(settle, TIMER_START, p->jobid);
+            }
+            return 1;
+        }
+    return 0;
+}
+
+/* The arguments of a job of a watch, or 0 */
+const char * s_job_args(int jobid, int *size)
+{
+    struct Job *p;
+
+    p = findjob(jobid);
+    if (p == 0)
+        return 0;
+    *size = p->args_size;
+    return p->args;
+}
+
 /* This assumes the jobid exists */
 void s_removejob(int jobid)
 {
@@ -474,11 +984,7 @@ void s_removejob(int jobid)
 
         /* First job is to be removed */
         newfirst = firstjob->next;
-        free(firstjob->command);
-        free(firstjob->output_filename);
-        pinfo_free(&firstjob->info);
-        free(firstjob->label);
-        free(firstjob);
+        free_job(firstjob);
         firstjob = newfirst;
         return;
     }
@@ -496,56 +1002,366 @@ void s_removejob(int jobid)
 
     newnext = p->next->next;
 
-    free(p->next->command);
-    free(p->next);
+    free_job(p->next);
     p->next = newnext;
 }
 
+/* Bytes estimated for the running jobs, for TS_MEMORY_BUDGET */
+static long running_memory()
+{
+    struct Job *p;
+    long used = 0;
+
+    for (p = firstjob; p != 0; p = p->next)
+        if (p->state == RUNNING)
+            used += p->memory_estimate;
+    return used;
+}
+
+/* Whether the job fits in what is left of the memory budget. Alone, a job
+ * always runs, or the queue would stall. */
+static int memory_admits(struct Job *p, long budget, long used)
+{
+    if (budget <= 0)
+        return 1;
+    p->memory_estimate = memory_estimate(p);
+    return busy_slots == 0 || used + p->memory_estimate <= budget;
+}
+
+/* DEPEND_MET if the job can run, as far as its dependencies go;
+ * DEPEND_FAILED, with the errorlevel to report, if it never will */
+static int depend_result(const struct Job *p, int *errorlevel)
+{
+    int pending = 0;
+    int ok = 0;
+    int i;
+
+    *errorlevel = 0;
+    for (i = 0; i < p->depends_size; ++i)
+    {
+        const struct Depend *d = &p->depends[i];
+
+        if (!d->finished)
+            ++pending;
+        else if (d->errorlevel == 0)
+            ++ok;
+        else if (*errorlevel == 0)
+            *errorlevel = d->errorlevel;
+    }
+
+    switch (p->depend_mode)
+    {
+        case DEPEND_ANY_OK:
+            if (ok > 0 || p->depends_size == 0)
+            {
+                *errorlevel = 0;
+                return DEPEND_MET;
+            }
+            return pending > 0 ? DEPEND_WAITS : DEPEND_FAILED;
+        case DEPEND_ALWAYS:
+            *errorlevel = 0;
+            return pending > 0 ? DEPEND_WAITS : DEPEND_MET;
+        default:
+            /* One failure is enough, whatever the rest do */
+            if (*errorlevel != 0)
+                return DEPEND_FAILED;
+            return pending > 0 ? DEPEND_WAITS : DEPEND_MET;
+    }
+}
+
+/* The job taking the output of another starts right after it: it waits
+ * while that one is queued, and fails if it went away without a fifo. A
+ * retry has no input. */
+static int pipe_result(const struct Job *p)
+{
+    const struct Job *producer;
+
+    if (p->pipe_from < 0 || p->attempt > 0)
+        return DEPEND_MET;
+    producer = findjob(p->pipe_from);
+    if (producer == 0 || producer->pipe_to != p->jobid)
+        return DEPEND_FAILED;
+    if (producer->state == QUEUED || producer->state == HOLDING_CLIENT)
+        return DEPEND_WAITS;
+    return producer->pipe_name != 0 ? DEPEND_MET : DEPEND_FAILED;
+}
+
+/* Whether the queued job could start now, but for the slots */
+static int waits_dependency(const struct Job *p)
+{
+    int errorlevel;
+
+    return depend_result(p, &errorlevel) != DEPEND_MET
+        || pipe_result(p) != DEPEND_MET;
+}
+
+static int depend_failed(const struct Job *p)
+{
+    int errorlevel;
+
+    return depend_result(p, &errorlevel) == DEPEND_FAILED
+        || pipe_result(p) == DEPEND_FAILED;
+}
+
+/* The job taking the output of p, if it will start with p. 0 if p runs
+ * alone. */
+static struct Job * pipe_consumer(const struct Job *p)
+{
+    struct Job *consumer;
+
+    if (p->pipe_to < 0 || p->attempt > 0)
+        return 0;
+    consumer = findjob(p->pipe_to);
+    if (consumer == 0 || (consumer->state != QUEUED
+                && consumer->state != HOLDING_CLIENT))
+        return 0;
+    return consumer;
+}
+
+/* A producer waits until the jobs down its pipes could start, but for it */
+static int consumers_ready(const struct Job *p)
+{
+    struct Job *consumer;
+    int errorlevel;
+
+    if (p->pipe_to == PIPE_AWAITED)
+        return 0;
+    consumer = pipe_consumer(p);
+    if (consumer == 0)
+        return 1;
+    return consumer->state == QUEUED && !consumer->retry_pending
+        && !consumer->delayed
+        && depend_result(consumer, &errorlevel) == DEPEND_MET
+        && consumers_ready(consumer);
+}
+
+/* The slots of the job and of those starting with it, down its pipes */
+static int slots_needed(const struct Job *p)
+{
+    const struct Job *q;
+    int slots = 0;
+
+    for (q = p; q != 0; q = pipe_consumer(q))
+        slots += q->num_slots;
+    /* Not to wait forever: the pipeline may go over the maximum */
+    if (slots > max_slots)
+        slots = p->num_slots > max_slots ? p->num_slots : max_slots;
+    return slots;
+}
+
+static int job_ready(struct Job *p, long budget, long used)
+{
+    if (p->state != QUEUED || p->retry_pending || p->delayed
+            || waits_dependency(p) || !consumers_ready(p))
+        return 0;
+    return memory_admits(p, budget, used) && aimd_admits(p)
+        && fair_admits(p) && rate_admits(p);
+}
+
+/* Of two ready jobs, whether a runs before b: the one heading the longer
+ * critical path, and with TS_SCHEDULER=sjf, then the shorter one */
+static int runs_before(const struct Job *a, const struct Job *b)
+{
+    if (a->path != b->path)
+        return a->path > b->path;
+    return predict_sjf() && a->estimate < b->estimate;
+}
+
+/* After learning from a job, for the ones still to start */
+static void refresh_estimates()
+{
+    struct Job *p;
+
+    for (p = firstjob; p != 0; p = p->next)
+        if (p->state == QUEUED || p->state == HOLDING_CLIENT)
+            p->estimate = predict_runtime(p);
+}
+
+static int start_job(struct Job *p, long budget)
+{
+    rate_take(p);
+    busy_slots = busy_slots + p->num_slots;
+    if (budget > 0)
+        pinfo_addinfo(&p->info, 100, "Memory estimate: %ld KiB\n",
+                p->memory_estimate / 1024);
+    return p->jobid;
+}
+
+/* The ready job of the highest priority over 0, or 0 if none */
+static struct Job * most_urgent_job(long budget, long used)
+{
+    struct Job *p;
+    struct Job *urgent = 0;
+
+    for (p = firstjob; p != 0; p = p->next)
+        if (p->priority > 0
+                && (urgent == 0 || p->priority > urgent->priority)
+                && job_ready(p, budget, used))
+            urgent = p;
+    return urgent;
+}
+
+static int preemptible(const struct Job *p, int priority)
+{
+    return p->state == RUNNING && !p->suspended && p->pid > 0
+        && p->priority < priority && p->timed_out == NOT_TIMED_OUT;
+}
+
+static int started_later(const struct Job *a, const struct Job *b)
+{
+    return a->info.start_time.tv_sec > b->info.start_time.tv_sec
+        || (a->info.start_time.tv_sec == b->info.start_time.tv_sec
+            && a->info.start_time.tv_usec > b->info.start_time.tv_usec);
+}
+
+/* Stops the running jobs of lower priority than the urgent one, the lowest
+ * and newest first, until it fits. Their slots count as free. Returns 0,
+ * stopping none, if it would not fit anyway. */
+static int suspend_for(const struct Job *urgent)
+{
+    struct Job *p;
+    int needed;
+    int available = 0;
+
+    needed = urgent->num_slots - (max_slots - busy_slots);
+    for (p = firstjob; p != 0; p = p->next)
+        if (preemptible(p, urgent->priority))
+            available += p->num_slots;
+    if (available < needed)
+        return 0;
+
+    while (needed > 0)
+    {
+        struct Job *victim = 0;
+
+        for (p = firstjob; p != 0; p = p->next)
+            if (preemptible(p, urgent->priority)
+                    && (victim == 0 || p->priority < victim->priority
+                        || (p->priority == victim->priority
+                            && started_later(p, victim))))
+                victim = p;
+
+        signal_job(victim, SIGSTOP);
+        victim->suspended = 1;
+        pinfo_set_suspend_time(&victim->info);
+        pinfo_addinfo(&victim->info, 100, "Suspended for the job %i\n",
+                urgent->jobid);
+        busy_slots = busy_slots - victim->num_slots;
+        needed -= victim->num_slots;
+    }
+    return 1;
+}
+
+static void continue_job(struct Job *p)
+{
+    signal_job(p, SIGCONT);
+    p->suspended = 0;
+    pinfo_set_resume_time(&p->info);
+    busy_slots = busy_slots + p->num_slots;
+}
+
+/* The stopped jobs go on once their slots are free, the highest priority
+ * first */
+static void resume_suspended()
+{
+    while (1)
+    {
+        struct Job *p;
+        struct Job *best = 0;
+
+        for (p = firstjob; p != 0; p = p->next)
+            if (p->state == RUNNING && p->suspended
+                    && p->num_slots <= max_slots - busy_slots
+                    && (best == 0 || p->priority > best->priority))
+                best = p;
+        if (best == 0)
+            return;
+        continue_job(best);
+    }
+}
+
+/* When the server goes away, no job should stay stopped */
+void s_continue_suspended()
+{
+    struct Job *p;
+
+    for (p = firstjob; p != 0; p = p->next)
+        if (p->state == RUNNING && p->suspended)
+            continue_job(p);
+}
+
 /* -1 if no one should be run. */
 int next_run_job()
 {
     struct Job *p;
+    struct Job *best;
+    long budget;
+    long used;
+    int free_slots;
+
+    /* Only a job waiting for tokens in this pass wakes the server up */
+    rate_new_pass();
+
+    /* The jobs past their deadline, in the cache, or whose dependencies
+     * failed, don't need a free slot: the client only reports them
+     * skipped, or done. The jobs taking the output of one just started
+     * have their slots counted with it. A delayed job waits for its time,
+     * whatever it is for. */
+    for (p = firstjob; p != 0; p = p->next)
+        if (p->state == QUEUED && !p->delayed
+                && (p->timed_out == DEADLINE_PASSED
+                    || (p->cached && !waits_dependency(p))
+                    || depend_failed(p)
+                    || (p->pipe_from >= 0 && p->attempt == 0
+                        && !waits_dependency(p))))
+        {
+            busy_slots = busy_slots + p->num_slots;
+            return p->jobid;
+        }
+
+    /* If there are no jobs to run... */
+    if (firstjob == 0)
+        return -1;
 
-    const int free_slots = max_slots - busy_slots;
+    budget = memory_budget();
+    used = (budget > 0) ? running_memory() : 0;
+    fair_new_pass(firstjob);
+
+    /* A job of a higher priority goes first, stopping others if needed */
+    p = most_urgent_job(budget, used);
+    if (p != 0 && (slots_needed(p) <= max_slots - busy_slots
+                || suspend_for(p)))
+        return start_job(p, budget);
+
+    resume_suspended();
 
     /* busy_slots may be bigger than the maximum slots,
      * if the user was running many jobs, and suddenly
      * trimmed the maximum slots down. */
+    free_slots = max_slots - busy_slots;
     if (free_slots <= 0)
         return -1;
-
-    /* If there are no jobs to run... */
-    if (firstjob == 0)
-        return -1;
-
-    /* Look for a runnable task */
-    p = firstjob;
-    while(p != 0)
-    {
-        if (p->state == QUEUED)
+
+    /* Look for a runnable task. The ones behind may fit where this one
+     * doesn't. Of a dependency graph, the one heading the critical path
+     * goes first. */
+    dag_update_paths(firstjob);
+    best = 0;
+    for (p = firstjob; p != 0; p = p->next)
+        if (free_slots >= slots_needed(p) && job_ready(p, budget, used))
         {
-            if (p->depend_on >= 0)
-            {
-                struct Job *do_depend_job = get_job(p->depend_on);
-                /* We won't try to run any job do_depending on an unfinished
-                 * job */
-                if (do_depend_job != NULL &&
-                    (do_depend_job->state == QUEUED || do_depend_job->state == RUNNING))
-                {
-                    /* Next try */
-                    p = p->next;
-                    continue;
-                }
-            }
+            struct Job **head = fair_head(p);
 
-            if (free_slots >= p->num_slots)
-            {
-                busy_slots = busy_slots + p->num_slots;
-                return p->jobid;
-            }
+            if (*head == 0 || runs_before(p, *head))
+                *head = p;
+            if (best == 0 || runs_before(p, best))
+                best = p;
         }
-        p = p->next;
-    }
+    /* With fair share, the user comes first, and then its job */
+    if (best != 0 && fair_sharing())
+        best = fair_pick();
+    if (best != 0)
+        return start_job(best, budget);
 
     return -1;
 }
@@ -592,11 +1408,8 @@ static void new_finished_job(struct Job *j)
         struct Job *tmp;
         tmp = first_finished_job;
         first_finished_job = first_finished_job->next;
-        free(tmp->command);
-        free(tmp->output_filename);
-        pinfo_free(&tmp->info);
-        free(tmp->label);
-        free(tmp);
+        release_output(tmp);
+        free_job(tmp);
     }
     p->next = j;
     p->next->next = 0;
@@ -641,22 +1454,103 @@ static int in_notify_list(int jobid)
     return 0;
 }
 
+/* Server side fifos, named after the server and the job giving the output */
+static char * make_fifo(int jobid)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    char *name;
+
+    if (tmpdir == NULL)
+        tmpdir = "/tmp";
+    name = (char *) malloc(strlen(tmpdir) + 50);
+    if (name == 0)
+        error("Cannot allocate memory for the fifo name");
+    sprintf(name, "%s/ts-pipe.%i.%i", tmpdir, (int) getpid(), jobid);
+    unlink(name);
+    if (mkfifo(name, 0600) == -1)
+    {
+        warning("Cannot create the fifo %s", name);
+        free(name);
+        return 0;
+    }
+    return name;
+}
+
+/* Opening a fifo waits for the other end. When one of the jobs ends, the
+ * other one may still wait there: a quick open and close of the end it
+ * waits for frees it, with an end of file or a broken pipe. */
+static void release_fifo(const char *name, int flags)
+{
+    int fd;
+
+    fd = open(name, flags | O_NONBLOCK);
+    if (fd != -1)
+        close(fd);
+}
+
+/* When an attempt of the job ends */
+static void end_pipes(struct Job *p)
+{
+    struct Job *producer;
+
+    if (p->pipe_name != 0)
+    {
+        release_fifo(p->pipe_name, O_WRONLY);
+        unlink(p->pipe_name);
+        free(p->pipe_name);
+        p->pipe_name = 0;
+    }
+
+    if (p->pipe_from >= 0 && p->state == RUNNING)
+    {
+        producer = findjob(p->pipe_from);
+        if (producer != 0 && producer->pipe_to == p->jobid
+                && producer->pipe_name != 0)
+            release_fifo(producer->pipe_name, O_RDONLY);
+    }
+}
+
 void job_finished(const struct Result *result, int jobid)
 {
     struct Job *p;
-
-    if (busy_slots <= 0)
-        error("Wrong state in the server. busy_slots = %i instead of greater than 0", busy_slots);
+    struct Result cached;
 
     p = findjob(jobid);
     if (p == 0)
         error("on jobid %i finished, it doesn't exist", jobid);
 
+    /* The client didn't run it; the cache has the result */
+    if (p->cached && !result->skipped)
+    {
+        cached = p->result;
+        result = &cached;
+    }
+
     /* The job may be not only in running state, but also in other states, as
      * we call this to clean up the jobs list in case of the client closing the
      * connection. */
     if (p->state == RUNNING)
-        busy_slots = busy_slots - p->num_slots;
+    {
+        /* A stopped job already left its slots */
+        if (p->suspended)
+        {
+            p->suspended = 0;
+            pinfo_set_resume_time(&p->info);
+        }
+        else
+        {
+            if (busy_slots <= 0)
+                error("Wrong state in the server. busy_slots = %i instead of greater than 0", busy_slots);
+            busy_slots = busy_slots - p->num_slots;
+        }
+        if (!p->cached)
+        {
+            aimd_learn(p, result);
+            fair_learn(p, result);
+        }
+    }
+    affinity_release(p->jobid);
+    end_pipes(p);
 
     /* Mark state */
     if (result->skipped)
@@ -664,6 +1558,12 @@ void job_finished(const struct Result *result, int jobid)
     else
         p->state = FINISHED;
     p->result = *result;
+    if (!result->skipped && !p->cached)
+    {
+        memory_learn(p);
+        predict_learn(p);
+        refresh_estimates();
+    }
     last_finished_jobid = p->jobid;
     notify_errorlevel(p);
     pinfo_set_end_time(&p->info);
@@ -672,6 +1572,25 @@ void job_finished(const struct Result *result, int jobid)
         pinfo_addinfo(&p->info, 100, "Exit status: killed by signal %i\n", p->result.signal);
     else
         pinfo_addinfo(&p->info, 100, "Exit status: died with exit code %i\n", p->result.errorlevel);
+    if (p->result.output_exceeded)
+        pinfo_addinfo(&p->info, 100, "Output limit of %ld bytes exceeded (%s)\n",
+                p->output_limit, output_policy_to_string(p->output_policy));
+    p->result.timed_out = p->timed_out;
+    if (p->timed_out == TIMED_OUT)
+        pinfo_addinfo(&p->info, 100, "Timed out after %i s\n", p->timeout);
+    else if (p->timed_out == DEADLINE_PASSED)
+        pinfo_addinfo(&p->info, 100, "Not run: the deadline of %i s "
+                "in the queue passed\n", p->deadline);
+    if (p->info.suspended > 0)
+        pinfo_addinfo(&p->info, 100, "Suspended for %f s in total\n",
+                p->info.suspended);
+    if (p->batch_size > 0)
+        add_batch_info(p);
+
+    if (p->cache_key[0] != '\0' && !p->cached && p->state == FINISHED
+            && !result->died_by_signal && result->errorlevel == 0
+            && p->timed_out == NOT_TIMED_OUT && !result->output_exceeded)
+        cache_store(p->cache_key, result, p->output_filename);
 
     /* Find the pointing node, to
      * update it removing the finished job. */
@@ -706,6 +1625,202 @@ void job_finished(const struct Result *result, int jobid)
 
         *jpointer = newfirst;
     }
+
+    s_apply_retention();
+}
+
+/* Whether the result is a failure the job wants to retry */
+static int retryable(const struct Job *p, const struct Result *result)
+{
+    int i;
+
+    if (result->skipped
+            || (!result->died_by_signal && result->errorlevel == 0))
+        return 0;
+    /* Without --retry-on, any failure */
+    if (p->retry_on[0] == 0)
+        return 1;
+    for (i = 0; i < MAX_RETRY_ON && p->retry_on[i] != 0; ++i)
+    {
+        if (result->died_by_signal && -p->retry_on[i] == result->signal)
+            return 1;
+        /* The errorlevel is a signed char */
+        if (!result->died_by_signal
+                && p->retry_on[i] == (result->errorlevel & 0xff))
+            return 1;
+    }
+    return 0;
+}
+
+/* Doubling on each attempt, and random in its upper half, so the jobs
+ * failing together don't come back together */
+static int retry_backoff(const struct Job *p)
+{
+    static int seeded = 0;
+    long delay;
+    int i;
+
+    if (!seeded)
+    {
+        srand(time(NULL) ^ getpid());
+        seeded = 1;
+    }
+    delay = p->retry_delay;
+    for (i = 1; i < p->attempt && delay < RETRY_MAX_DELAY; ++i)
+        delay *= 2;
+    if (delay > RETRY_MAX_DELAY)
+        delay = RETRY_MAX_DELAY;
+    return (delay + 1) / 2 + rand() % (delay / 2 + 1);
+}
+
+/* The slots and the rest the attempt took, back on ENDJOB */
+static void end_attempt(struct Job *p, const struct Result *result)
+{
+    if (p->suspended)
+    {
+        p->suspended = 0;
+        pinfo_set_resume_time(&p->info);
+    }
+    else
+        busy_slots = busy_slots - p->num_slots;
+    affinity_release(p->jobid);
+    end_pipes(p);
+    p->result = *result;
+}
+
+/* "exit code 3 (timeout), started 2024-01-02 03:04:05, 1.5s real, ..." */
+static void attempt_string(char *buf, const struct Job *p,
+        const struct Result *result, const char *output)
+{
+    char date[30];
+    int len;
+
+    if (result->skipped)
+        len = sprintf(buf, "skipped");
+    else if (result->died_by_signal)
+        len = sprintf(buf, "killed by signal %i", result->signal);
+    else
+        len = sprintf(buf, "exit code %i", result->errorlevel);
+    if (p->timed_out == TIMED_OUT)
+        len += sprintf(buf + len, " (timeout)");
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+            localtime(&p->info.start_time.tv_sec));
+    sprintf(buf + len, ", started %s, %fs real, %fs user, %fs system, "
+            "output %s", date, result->real_ms, result->user_ms,
+            result->system_ms, output);
+}
+
+/* After a run of a recurring job, it goes back to the queue for the next
+ * time of its schedule, the ones missed meanwhile skipped. The run stays in
+ * its info, and the client waits for the next RUNJOB. */
+static int repeat_job(int s, struct Job *p, const struct Result *result)
+{
+    struct msg m;
+    char *line;
+    char date[30];
+    const char *output;
+    time_t now = time(NULL);
+    time_t next;
+
+    end_attempt(p, result);
+    if (!result->skipped)
+    {
+        memory_learn(p);
+        aimd_learn(p, result);
+        fair_learn(p, result);
+        predict_learn(p);
+        refresh_estimates();
+    }
+
+    ++p->runs;
+    next = p->fire_time + p->every * ((now - p->fire_time) / p->every + 1);
+
+    output = p->output_filename != 0 ? p->output_filename : "stdout";
+    line = (char *) malloc(strlen(output) + 300);
+    if (line == 0)
+        error("Cannot allocate memory for the info of the job %i", p->jobid);
+    attempt_string(line, p, result, output);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&next));
+    pinfo_addinfo(&p->info, strlen(line) + 100, "Run %i: %s; next at %s\n",
+            p->runs, line, date);
+    free(line);
+
+    p->state = QUEUED;
+    p->pid = 0;
+    p->timed_out = NOT_TIMED_OUT;
+    p->attempt = 0;
+    /* Only the first run takes the output of another job */
+    p->pipe_from = -1;
+    delay_job(p, next);
+
+    m.type = RETRYJOB;
+    m.u.retry.attempt = p->runs + 1;
+    m.u.retry.delay = next - now;
+    send_msg(s, &m);
+    return 1;
+}
+
+/* On ENDJOB of a job with retries. If the failure is retryable and there
+ * are attempts left, the job goes back to the queue with its jobid, its
+ * place and its dependencies, and the attempt stays in its info. Then the
+ * client waits for another RUNJOB. Otherwise, it answers ENDJOB_OK and the
+ * caller finishes the job: only the last attempt reaches the dependents.
+ * A recurring job goes back to the queue after its last attempt, unless
+ * its dependencies failed. Returns 1 if the job is queued again. */
+int s_retry_job(int s, const struct Result *result, int jobid)
+{
+    struct Job *p;
+    struct msg m;
+    char *line;
+    const char *output;
+    int delay;
+
+    p = findjob(jobid);
+    if (p == 0 || (p->retries == 0 && p->every == 0))
+        return 0;
+
+    if (p->state != RUNNING || p->attempt >= p->retries
+            || !retryable(p, result))
+    {
+        if (p->attempt > 0)
+            pinfo_addinfo(&p->info, 100, "Last attempt: %i of %i\n",
+                    p->attempt + 1, p->retries + 1);
+        if (p->state == RUNNING && p->every > 0 && !depend_failed(p))
+            return repeat_job(s, p, result);
+        m.type = ENDJOB_OK;
+        send_msg(s, &m);
+        return 0;
+    }
+
+    end_attempt(p, result);
+    memory_learn(p);
+    aimd_learn(p, result);
+    fair_learn(p, result);
+
+    ++p->attempt;
+    delay = retry_backoff(p);
+
+    output = p->output_filename != 0 ? p->output_filename : "stdout";
+    line = (char *) malloc(strlen(output) + 300);
+    if (line == 0)
+        error("Cannot allocate memory for the info of the job %i", p->jobid);
+    attempt_string(line, p, result, output);
+    pinfo_addinfo(&p->info, strlen(line) + 100, "Attempt %i of %i: %s; "
+            "retry in %i s\n", p->attempt, p->retries + 1, line, delay);
+    free(line);
+
+    /* The output of the attempt stays, named in the info */
+    p->state = QUEUED;
+    p->pid = 0;
+    p->timed_out = NOT_TIMED_OUT;
+    p->retry_pending = 1;
+    timer_add(delay, TIMER_RETRY, p->jobid);
+
+    m.type = RETRYJOB;
+    m.u.retry.attempt = p->attempt + 1;
+    m.u.retry.delay = delay;
+    send_msg(s, &m);
+    return 1;
 }
 
 void s_clear_finished()
@@ -722,18 +1837,180 @@ void s_clear_finished()
     {
         struct Job *tmp;
         tmp = p->next;
-        free(p->command);
-        free(p->output_filename);
-        pinfo_free(&p->info);
-        free(p->label);
-        free(p);
+        release_output(p);
+        free_job(p);
         p = tmp;
     }
 }
 
-void s_process_runjob_ok(int jobid, char *oname, int pid)
+/* Reclaim the outputs of the finished jobs beyond the retention
+ * policy, counting from the most recent. The jobs stay in the list. */
+void s_apply_retention()
+{
+    long keep_count, keep_bytes, keep_age;
+    struct Job **finished;
+    struct Job *p;
+    int nfinished = 0;
+    int i;
+    long count = 0;
+    long bytes = 0;
+    time_t now;
+
+    keep_count = get_env_long("TS_KEEP_COUNT");
+    keep_bytes = get_env_long("TS_KEEP_BYTES");
+    keep_age = get_env_long("TS_KEEP_AGE");
+    if (keep_count < 0 && keep_bytes < 0 && keep_age < 0)
+        return;
+
+    for (p = first_finished_job; p != 0; p = p->next)
+        ++nfinished;
+    if (nfinished == 0)
+        return;
+
+    finished = (struct Job **) malloc(nfinished * sizeof(*finished));
+    if (finished == 0)
+        error("Cannot allocate memory for the retention of %i jobs",
+                nfinished);
+    for (i = 0, p = first_finished_job; p != 0; p = p->next)
+        finished[i++] = p;
+
+    now = time(NULL);
+    for (i = nfinished - 1; i >= 0; --i)
+    {
+        p = finished[i];
+        if (p->output_filename == 0 || p->output_reclaimed)
+            continue;
+        ++count;
+        bytes += p->result.output_bytes;
+        if ((keep_count >= 0 && count > keep_count)
+                || (keep_bytes >= 0 && bytes > keep_bytes)
+                || (keep_age >= 0
+                    && now - p->info.end_time.tv_sec > keep_age))
+            release_output(p);
+    }
+
+    free(finished);
+}
+
+/* Seconds until the next output gets too old for TS_KEEP_AGE,
+ * -1 if none will. */
+int s_retention_timeout()
+{
+    long keep_age;
+    struct Job *p;
+    long next = -1;
+    time_t now;
+
+    keep_age = get_env_long("TS_KEEP_AGE");
+    if (keep_age < 0)
+        return -1;
+
+    now = time(NULL);
+    for (p = first_finished_job; p != 0; p = p->next)
+    {
+        long left;
+        if (p->output_filename == 0 || p->output_reclaimed)
+            continue;
+        left = p->info.end_time.tv_sec + keep_age - now + 1;
+        if (left < 0)
+            left = 0;
+        if (next == -1 || left < next)
+            next = left;
+    }
+    return next;
+}
+
+void s_send_stats(int s)
+{
+    char line[200];
+    long files, bytes;
+    int pending;
+
+    reclaim_stats(&files, &bytes, &pending);
+    snprintf(line, sizeof(line), "Reclaimed outputs: %ld files, %ld bytes\n",
+            files, bytes);
+    send_list_line(s, line);
+    snprintf(line, sizeof(line), "Outputs waiting to be reclaimed: %i\n",
+            pending);
+    send_list_line(s, line);
+
+    if (memory_budget() > 0)
+        memory_stats(s, running_memory());
+    rate_stats(s);
+    aimd_stats(s);
+    cache_stats(s);
+    predict_stats(s);
+    watch_stats(s);
+
+    if (launches > 0)
+    {
+        snprintf(line, sizeof(line), "Launch latency: %.3f ms mean, "
+                "%.3f ms max, %ld jobs\n", launch_total / launches,
+                launch_max, launches);
+        send_list_line(s, line);
+    }
+}
+
+static int grep_wants(const struct Job *p, const struct msg *m,
+        const char *label)
+{
+    if (!p->store_output || p->output_filename == 0 || p->output_reclaimed)
+        return 0;
+    if (m->u.grep.state != -1 && p->state != m->u.grep.state)
+        return 0;
+    if (m->u.grep.jobid_from != -1 && p->jobid < m->u.grep.jobid_from)
+        return 0;
+    if (m->u.grep.jobid_to != -1 && p->jobid > m->u.grep.jobid_to)
+        return 0;
+    if (label != 0 && (p->label == 0 || strcmp(p->label, label) != 0))
+        return 0;
+    return 1;
+}
+
+void s_grep(int s, const struct msg *m, const char *pattern,
+        const char *label)
+{
+    struct Job *p;
+    int *jobids;
+    char **names;
+    int n = 0;
+
+    for (p = firstjob; p != 0; p = p->next)
+        ++n;
+    for (p = first_finished_job; p != 0; p = p->next)
+        ++n;
+
+    jobids = (int *) malloc((n + 1) * sizeof(*jobids));
+    names = (char **) malloc((n + 1) * sizeof(*names));
+    if (jobids == 0 || names == 0)
+        error("Cannot allocate memory to grep %i jobs", n);
+
+    /* Oldest first */
+    n = 0;
+    for (p = first_finished_job; p != 0; p = p->next)
+        if (grep_wants(p, m, label))
+        {
+            jobids[n] = p->jobid;
+            names[n++] = p->output_filename;
+        }
+    for (p = firstjob; p != 0; p = p->next)
+        if (grep_wants(p, m, label))
+        {
+            jobids[n] = p->jobid;
+            names[n++] = p->output_filename;
+        }
+
+    grep_outputs(s, pattern, n, jobids, names);
+
+    free(jobids);
+    free(names);
+}
+
+void s_process_runjob_ok(int jobid, char *oname, int pid,
+        const struct timeval *exec_time)
 {
     struct Job *p;
+    double latency;
     p = findjob(jobid);
     if (p == 0)
         error("Job %i already run not found on runjob_ok", jobid);
@@ -742,14 +2019,84 @@ void s_process_runjob_ok(int jobid, char *oname, int pid)
                 p->state);
 
     p->pid = pid;
-    p->output_filename = oname;
+    /* The one of the attempt before is named in the info, and given back
+     * as if the job were cleared */
+    if (!p->cached)
+    {
+        release_output(p);
+        free(p->output_filename);
+        p->output_filename = oname;
+        p->output_reclaimed = 0;
+    }
     pinfo_set_start_time(&p->info);
+
+    /* The client runs in this same machine, with the same clock */
+    if (exec_time->tv_sec != 0)
+    {
+        latency = (exec_time->tv_sec - p->dispatch_time.tv_sec) * 1000.
+            + (exec_time->tv_usec - p->dispatch_time.tv_usec) / 1000.;
+        if (latency < 0)
+            latency = 0;
+        pinfo_addinfo(&p->info, 100, "Launch latency: %.3f ms\n", latency);
+        ++launches;
+        launch_total += latency;
+        if (latency > launch_max)
+            launch_max = latency;
+    }
+
+    if (p->timeout > 0 && pid > 0)
+        timer_add(p->timeout, TIMER_TIMEOUT, jobid);
+}
+
+void s_batch_progress(int jobid, const struct Batch_progress *progress)
+{
+    struct Job *p;
+
+    p = findjob(jobid);
+    if (p == 0 || p->state != RUNNING)
+        return;
+    p->batch = *progress;
+}
+
+void s_process_stored_output(int jobid, char *vname)
+{
+    struct Job *p;
+    p = findjob(jobid);
+    if (p == 0)
+        error("Job %i not found on stored output", jobid);
+
+    free(p->output_filename);
+    p->output_filename = vname;
+}
+
+/* On RUNJOB: the fifo from the job before, and the one to the job after,
+ * if that one starts too */
+static void pipe_fifos(struct Job *p, const char **in, const char **out)
+{
+    struct Job *producer;
+
+    *in = 0;
+    *out = 0;
+    if (p->pipe_from >= 0 && p->attempt == 0
+            && pipe_result(p) == DEPEND_MET)
+    {
+        producer = findjob(p->pipe_from);
+        *in = producer->pipe_name;
+    }
+    if (pipe_consumer(p) != 0)
+    {
+        p->pipe_name = make_fifo(p->jobid);
+        *out = p->pipe_name;
+    }
 }
 
 void s_send_runjob(int s, int jobid)
 {
     struct msg m;
     struct Job *p;
+    char *cpus;
+    const char *pipe_in;
+    const char *pipe_out;
 
     p = findjob(jobid);
     if (p == 0) 
@@ -758,20 +2105,66 @@ void s_send_runjob(int s, int jobid)
 
     m.type = RUNJOB;
 
-    /* TODO
-     * We should make the dependencies update the jobids they're do_depending on.
-     * Then, on finish, these could set the errorlevel to send to its dependency childs.
-     * We cannot consider that the jobs will leave traces in the finished job list (-nf?) . */
+    /* The results of the jobs it depends on came on their finish */
+    depend_result(p, &m.u.runjob.last_errorlevel);
+
+    set_output_limits(p);
+    m.u.runjob.output_limit = p->output_limit;
+    m.u.runjob.output_rate = p->output_rate;
+    m.u.runjob.output_policy = p->output_policy;
+    m.u.runjob.index_lines = get_env_long("TS_INDEX_LINES");
+    if (m.u.runjob.index_lines < 0)
+        m.u.runjob.index_lines = 0;
+
+    m.u.runjob.skip = (p->timed_out == DEADLINE_PASSED
+            || pipe_result(p) == DEPEND_FAILED);
+    m.u.runjob.cached = p->cached;
+
+    if (p->timed_out != DEADLINE_PASSED && m.u.runjob.skip)
+        pinfo_addinfo(&p->info, 100, "Not run: the job %i gave no output\n",
+                p->pipe_from);
 
-    m.u.last_errorlevel = p->dependency_errorlevel;
+    pipe_in = pipe_out = 0;
+    if (!m.u.runjob.skip && !m.u.runjob.cached)
+        pipe_fifos(p, &pipe_in, &pipe_out);
+    else
+        p->pipe_to = -1; /* The job after it will be skipped */
+    m.u.runjob.pipe_in_size = pipe_in != 0 ? strlen(pipe_in) + 1 : 0;
+    m.u.runjob.pipe_out_size = pipe_out != 0 ? strlen(pipe_out) + 1 : 0;
+    m.u.runjob.pipe_tee = p->pipe_tee;
+
+    cpus = 0;
+    m.u.runjob.numa_node = -1;
+    if (!m.u.runjob.skip && !m.u.runjob.cached)
+        cpus = affinity_assign(p->jobid, p->num_slots,
+                &m.u.runjob.numa_node);
+    m.u.runjob.cpus_size = 0;
+    if (cpus != 0)
+    {
+        m.u.runjob.cpus_size = strlen(cpus) + 1;
+        if (m.u.runjob.numa_node >= 0)
+            pinfo_addinfo(&p->info, strlen(cpus) + 100,
+                    "CPUs: %s (NUMA node %i)\n", cpus, m.u.runjob.numa_node);
+        else
+            pinfo_addinfo(&p->info, strlen(cpus) + 100, "CPUs: %s\n", cpus);
+    }
 
+    /* From the attempt before */
+    clear_batch_progress(&p->batch);
+
+    gettimeofday(&p->dispatch_time, NULL);
     send_msg(s, &m);
+    send_bytes(s, cpus, m.u.runjob.cpus_size);
+    send_bytes(s, pipe_in, m.u.runjob.pipe_in_size);
+    send_bytes(s, pipe_out, m.u.runjob.pipe_out_size);
+    free(cpus);
 }
 
 void s_job_info(int s, int jobid)
 {
     struct Job *p = 0;
     struct msg m;
+    char depends[60];
 
     if (jobid == -1)
     {
@@ -821,20 +2214,35 @@ void s_job_info(int s, int jobid)
     m.type = INFO_DATA;
     send_msg(s, &m);
     pinfo_dump(&p->info, s);
-    fd_nprintf(s, 100, "Command: ");
-    if (p->depend_on != -1)
-        fd_nprintf(s, 100, "[%i]&& ", p->depend_on);
+    depend_string(depends, sizeof(depends), p);
+    fd_nprintf(s, 100, "Command: %s", depends);
     write(s, p->command, strlen(p->command));
     fd_nprintf(s, 100, "\n");
     fd_nprintf(s, 100, "Slots required: %i\n", p->num_slots);
     fd_nprintf(s, 100, "Enqueue time: %s",
             ctime(&p->info.enqueue_time.tv_sec));
+    if (p->state == QUEUED || p->state == RUNNING)
+        predict_info(s, p);
+    if (p->state == QUEUED && p->delayed)
+        fd_nprintf(s, 100, "Next run: %s", ctime(&p->fire_time));
+    if (p->state == QUEUED)
+    {
+        dag_update_paths(firstjob);
+        if (p->path > 0)
+            fd_nprintf(s, 100, "Critical path: %fs estimated\n", p->path);
+    }
     if (p->state == RUNNING)
     {
         fd_nprintf(s, 100, "Start time: %s",
                 ctime(&p->info.start_time.tv_sec));
         fd_nprintf(s, 100, "Time running: %fs\n",
                 pinfo_time_until_now(&p->info));
+        if (p->suspended)
+            fd_nprintf(s, 100, "Suspended since: %s",
+                    ctime(&p->info.suspend_time.tv_sec));
+        if (pinfo_time_suspended(&p->info) > 0)
+            fd_nprintf(s, 100, "Time suspended: %fs\n",
+                    pinfo_time_suspended(&p->info));
     } else if (p->state == FINISHED)
     {
         fd_nprintf(s, 100, "Start time: %s",
@@ -843,6 +2251,29 @@ void s_job_info(int s, int jobid)
                 ctime(&p->info.end_time.tv_sec));
         fd_nprintf(s, 100, "Time run: %fs\n",
                 pinfo_time_run(&p->info));
+        fd_nprintf(s, 100, "CPU time: %fs user, %fs system\n",
+                p->result.user_ms, p->result.system_ms);
+        fd_nprintf(s, 100, "Max RSS: %ld KiB\n", p->result.maxrss);
+        fd_nprintf(s, 100, "Major page faults: %ld\n", p->result.majflt);
+        fd_nprintf(s, 100, "Context switches: %ld voluntary, "
+                "%ld involuntary\n", p->result.nvcsw, p->result.nivcsw);
+        if (p->result.read_bytes >= 0)
+            fd_nprintf(s, 100, "Storage I/O: %ld bytes read, "
+                    "%ld bytes written\n", p->result.read_bytes,
+                    p->result.write_bytes);
+        if (p->result.cgroup.user_usec >= 0)
+        {
+            fd_nprintf(s, 100, "Cgroup CPU time: %fs user, %fs system\n",
+                    p->result.cgroup.user_usec / 1000000.,
+                    p->result.cgroup.system_usec / 1000000.);
+            if (p->result.cgroup.memory_peak >= 0)
+                fd_nprintf(s, 100, "Cgroup memory peak: %ld KiB\n",
+                        p->result.cgroup.memory_peak / 1024);
+            if (p->result.cgroup.read_bytes >= 0)
+                fd_nprintf(s, 100, "Cgroup I/O: %ld bytes read, "
+                        "%ld bytes written\n", p->result.cgroup.read_bytes,
+                        p->result.cgroup.write_bytes);
+        }
     }
 }
 
@@ -905,6 +2336,14 @@ void s_send_output(int s, int jobid)
         return;
     }
 
+    if (p->output_reclaimed)
+    {
+        char tmp[50];
+        sprintf(tmp, "The output of job %i was reclaimed.\n", p->jobid);
+        send_list_line(s, tmp);
+        return;
+    }
+
     m.type = ANSWER_OUTPUT;
     m.u.output.store_output = p->store_output;
     m.u.output.pid = p->pid;
@@ -929,7 +2368,14 @@ void notify_errorlevel(struct Job *p)
         notified = get_job(p->notify_errorlevel_to[i]);
         if (notified)
         {
-            notified->dependency_errorlevel = p->result.errorlevel;
+            int j;
+
+            for (j = 0; j < notified->depends_size; ++j)
+                if (notified->depends[j].jobid == p->jobid)
+                {
+                    notified->depends[j].finished = 1;
+                    notified->depends[j].errorlevel = p->result.errorlevel;
+                }
         }
     }
 }
@@ -996,7 +2442,8 @@ int s_remove_job(int s, int *jobid)
         }
     }
 
-    if (p == 0 || p->state == RUNNING || p == firstjob)
+    /* The first one may be about to run, unless it waits for its time */
+    if (p == 0 || p->state == RUNNING || (p == firstjob && !p->delayed))
     {
         char tmp[50];
         if (*jobid == -1)
@@ -1021,15 +2468,13 @@ int s_remove_job(int s, int *jobid)
     /* Update the list pointers */
     if (p == first_finished_job)
         first_finished_job = p->next;
+    else if (p == firstjob)
+        firstjob = p->next;
     else
         before_p->next = p->next;
 
-    free(p->notify_errorlevel_to);
-    free(p->command);
-    free(p->output_filename);
-    pinfo_free(&p->info);
-    free(p->label);
-    free(p);
+    release_output(p);
+    free_job(p);
 
     m.type = REMOVEJOB_OK;
     send_msg(s, &m);
@@ -1134,12 +2579,8 @@ static void destroy_finished_job(struct Job *j)
         }
     }
 
-    free(j->notify_errorlevel_to);
-    free(j->command);
-    free(j->output_filename);
-    pinfo_free(&j->info);
-    free(j->label);
-    free(j);
+    release_output(j);
+    free_job(j);
 }
 
 /* This is called when a job finishes */
@@ -1298,7 +2739,7 @@ void s_wait_running_job(int s, int jobid)
 void s_set_max_slots(int new_max_slots)
 {
     if (new_max_slots > 0)
-        max_slots = new_max_slots;
+        max_slots = adapt_manual_slots(new_max_slots);
     else
         warning("Received new_max_slots=%i", new_max_slots);
 }
@@ -1312,6 +2753,119 @@ void s_get_max_slots(int s)
     m.u.max_slots = max_slots;
 
     send_msg(s, &m);
+
+    /* Why it is so, with TS_ADAPTIVE_SLOTS */
+    adapt_report(s);
+}
+
+/* Seconds from SIGTERM to SIGKILL for the jobs out of time */
+static int timeout_grace()
+{
+    long grace;
+
+    grace = get_env_long("TS_TIMEOUT_GRACE");
+    return grace >= 0 ? grace : 10;
+}
+
+static void signal_job(const struct Job *p, int sig)
+{
+    /* A job in a cgroup dies with all it started */
+    if (sig == SIGKILL && cgroup_kill(p->pid) == 0)
+        return;
+    /* The job may not have called setsid() yet */
+    if (kill(-p->pid, sig) == -1)
+        kill(p->pid, sig);
+}
+
+/* Seconds of the attempt running, but for the time stopped */
+static float time_running(const struct Job *p)
+{
+    return pinfo_time_until_now(&p->info) - pinfo_time_suspended(&p->info);
+}
+
+/* From the timer wheel. The job may be gone, or in another state. */
+void s_timer_fired(enum Timer_type type, int jobid)
+{
+    struct Job *p;
+    float left;
+
+    p = findjob(jobid);
+    if (p == 0)
+        return;
+
+    switch (type)
+    {
+        case TIMER_TIMEOUT:
+            if (p->state != RUNNING || p->pid <= 0
+                    || p->timed_out == TIMED_OUT)
+                return;
+            /* The time stopped doesn't count. Early, the timer was left by
+             * an attempt before, or the job was suspended. */
+            left = p->timeout - time_running(p);
+            if (left >= 1 || p->suspended)
+            {
+                timer_add(left >= 1 ? left : 1, TIMER_TIMEOUT, jobid);
+                return;
+            }
+            p->timed_out = TIMED_OUT;
+            signal_job(p, SIGTERM);
+            timer_add(timeout_grace(), TIMER_KILL, jobid);
+            break;
+        case TIMER_KILL:
+            if (p->state != RUNNING || p->timed_out != TIMED_OUT)
+                return;
+            left = p->timeout + timeout_grace() - time_running(p);
+            if (left >= 1)
+                timer_add(left, TIMER_KILL, jobid);
+            else
+                signal_job(p, SIGKILL);
+            break;
+        case TIMER_DEADLINE:
+            /* next_run_job() will send it to the client, to skip it. A job
+             * waiting to retry had already started. A delayed job counts
+             * from its time, and the timer may be of a run before. */
+            if ((p->state == QUEUED || p->state == HOLDING_CLIENT)
+                    && p->attempt == 0 && !p->delayed
+                    && (p->fire_time == 0
+                        || time(NULL) - p->fire_time >= p->deadline))
+                p->timed_out = DEADLINE_PASSED;
+            break;
+        case TIMER_RETRY:
+            p->retry_pending = 0;
+            break;
+        case TIMER_START:
+            if (p->state != QUEUED || !p->delayed
+                    || p->fire_time > time(NULL))
+                return;
+            p->delayed = 0;
+            if (p->deadline > 0)
+                timer_add(p->deadline, TIMER_DEADLINE, jobid);
+            break;
+    }
+}
+
+/* For TS_AIMD */
+int s_running_with_label(const char *label)
+{
+    struct Job *p;
+    int n = 0;
+
+    for (p = firstjob; p != 0; p = p->next)
+        if (p->state == RUNNING && p->label != 0
+                && strcmp(p->label, label) == 0)
+            ++n;
+    return n;
+}
+
+/* Whether some job waits for a slot */
+int s_jobs_waiting()
+{
+    struct Job *p;
+
+    for (p = firstjob; p != 0; p = p->next)
+        if (p->state == QUEUED && !p->retry_pending && !p->delayed)
+            return 1;
+    return 0;
 }
 
 void s_move_urgent(int s, int jobid)
@@ -1517,6 +3071,8 @@ void joblist_dump(int fd)
     for (job = first_finished_job; job != NULL; job = job->next)
         job_list[job_list_size++] = job;
 
+    predict_etas(firstjob, max_slots);
+
     /* Write to file with leading "#", including header */
     table = joblist_table(job_list, job_list_size);
     for (line_ptr = table; *line_ptr != NULL; ++line_ptr)
@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include "main.h"
 
 /* From jobs.c */
@@ -23,6 +24,9 @@ static const char * ofilename_shown(const struct Job *p)
     if (p->state == SKIPPED)
     {
         output_filename = "(no output)";
+    } else if (p->output_reclaimed)
+    {
+        output_filename = "(reclaimed)";
     } else if (p->store_output)
     {
         if (p->state == QUEUED)
@@ -43,6 +47,74 @@ static const char * ofilename_shown(const struct Job *p)
     return output_filename;
 }
 
+/* Mark of the jobs suspended, retrying, out of time, over their output
+ * limit, taken from the cache, or of the batches */
+static const char * result_mark(const struct Job *p)
+{
+    static char mark[40];
+
+    if (p->state == RUNNING && p->suspended)
+        return "(suspended) ";
+    if ((p->state == QUEUED || p->state == RUNNING) && p->attempt > 0)
+    {
+        sprintf(mark, "(retry %i/%i) ", p->attempt, p->retries);
+        return mark;
+    }
+    if (p->state == RUNNING && p->batch_size > 0)
+    {
+        sprintf(mark, "(%i/%i) ", p->batch.done, p->batch_size);
+        return mark;
+    }
+    if (p->state == SKIPPED && p->result.timed_out == DEADLINE_PASSED)
+        return "(deadline) ";
+    if (p->state != FINISHED)
+        return "";
+    if (p->cached)
+        return "(cached) ";
+    if (p->result.timed_out == TIMED_OUT)
+        return "(timeout) ";
+    if (p->batch.failed > 0)
+    {
+        sprintf(mark, "(%i/%i failed) ", p->batch.failed, p->batch_size);
+        return mark;
+    }
+    if (!p->result.output_exceeded)
+        return "";
+    switch (p->output_policy)
+    {
+        case OUTPUT_THROTTLE:
+            return "(throttled) ";
+        case OUTPUT_KILL:
+            return "(killed) ";
+        default:
+            return "(truncated) ";
+    }
+}
+
+/* "45s", "12m05s", "3h20m" or "2d04h" */
+static void eta_string(char *buf, double seconds)
+{
+    long s = (long) (seconds + 0.5);
+
+    if (s < 60)
+        sprintf(buf, "%lis", s);
+    else if (s < 60 * 60)
+        sprintf(buf, "%lim%02lis", s / 60, s % 60);
+    else if (s < 24 * 60 * 60)
+        sprintf(buf, "%lih%02lim", s / (60 * 60), s / 60 % 60);
+    else
+        sprintf(buf, "%lid%02lih", s / (24 * 60 * 60), s / (60 * 60) % 24);
+}
+
+/* "at 14:30:05", or "at 10-21 14:30" past the next day */
+static void fire_string(char *buf, int size, time_t when)
+{
+    if (when - time(NULL) < 24 * 60 * 60)
+        strftime(buf, size, "at %H:%M:%S", localtime(&when));
+    else
+        strftime(buf, size, "at %m-%d %H:%M", localtime(&when));
+}
+
 /* This is an approach the make the printed table more readable, even if
  * there are long entries for output file, times, label and command. */
 char **joblist_table(const struct Job **job_list, int job_list_size)
@@ -63,7 +135,10 @@ char **joblist_table(const struct Job **job_list, int job_list_size)
     const char *const header_elevel = "Err"; /* short to save space */
     const char *const header_times = "Times (r/u/s)";
     const char *const header_command_template = "Command [run=%d/%d]";
-    char header_command[30]; /* 30 is rought estimation, enough */
+    const char *const header_drain_template = "Command [run=%d/%d, drain %s]";
+    char header_command[60]; /* 60 is rought estimation, enough */
+    double drain = -1; /* ETA of the last job */
+    char eta_str[30];
     /* Other variables */
     const struct Job **job_pptr; /* job list iterator */
     const struct Job **const job_list_end = job_list + job_list_size;
@@ -76,7 +151,7 @@ char **joblist_table(const struct Job **job_list, int job_list_size)
     char *output_str; /* initialize later when "col_width_output" is set */
     char elevel_str[10]; /* should be more than sufficient to render number */
     char *times_str = malloc(col_width_times + 10); /* space to compare */
-    char depend_str[18]; /* should be sufficient for string like "[int]&& " */
+    char depend_str[60]; /* like "[int,int]&& ", cut with "..." */
     char *command_str; /* use malloc, might be long */
 
     /* Short output_str and times_str can not be arrays because of ISO C90 */
@@ -100,16 +175,28 @@ char **joblist_table(const struct Job **job_list, int job_list_size)
     if (!(col_width_command > 0)) /* assert */
         error("Assert (col_width_command > 0) failed: %d!\n", col_width_command);
 
-    snprintf(header_command, 30, header_command_template, busy_slots, max_slots);
+    for (job_pptr = job_list; job_pptr != job_list_end; ++job_pptr)
+        if ((*job_pptr)->state == QUEUED || (*job_pptr)->state == RUNNING)
+            if ((*job_pptr)->eta > drain)
+                drain = (*job_pptr)->eta;
+    if (drain >= 0)
+    {
+        eta_string(eta_str, drain);
+        snprintf(header_command, 60, header_drain_template, busy_slots,
+                max_slots, eta_str);
+    }
+    else
+        snprintf(header_command, 60, header_command_template, busy_slots,
+                max_slots);
 
     output_str = malloc(col_width_output + 1);
     if (output_str == NULL)
         error("Malloc for %i failed.\n", col_width_output + 1);
 
-    /* Estimate header plus two lines for each job (worst case) */
-    table = malloc((1 + job_list_size * 2) * sizeof(char *));
+    /* Estimate header plus two lines for each job (worst case), and NULL */
+    table = malloc((2 + job_list_size * 2) * sizeof(char *));
     if (table == NULL)
-        error("Malloc for %i failed.\n", (1 + job_list_size * 2) * sizeof(char *));
+        error("Malloc for %i failed.\n", (2 + job_list_size * 2) * sizeof(char *));
     format_str = malloc(100); /* rough upper limit */
     if (format_str == NULL)
         error("Malloc for %i failed.\n", 100);
@@ -179,24 +266,27 @@ char **joblist_table(const struct Job **job_list, int job_list_size)
                     job_ptr->result.real_ms,
                     job_ptr->result.user_ms,
                     job_ptr->result.system_ms);
+        } else if (job_ptr->state == QUEUED && job_ptr->delayed)
+            fire_string(times_str, col_width_times + 10, job_ptr->fire_time);
+        else if ((job_ptr->state == QUEUED || job_ptr->state == RUNNING)
+                && job_ptr->eta >= 0)
+        {
+            eta_string(eta_str, job_ptr->eta);
+            snprintf(times_str, col_width_times + 10, "eta %s", eta_str);
         } else
             strcpy(times_str, "");
 
         /* Prepare depend_str, will be included in command_str */
-        if (!job_ptr->do_depend)
-            strcpy(depend_str, "");
-        else if (job_ptr->depend_on == -1)
-            strcpy(depend_str, "&& ");
-        else
-            snprintf(depend_str, 18, "[%i]&& ", job_ptr->depend_on);
+        depend_string(depend_str, sizeof(depend_str), job_ptr);
 
         /* Prepare command string */
         if (job_ptr->label)
-            snprintf(command_str, table_width + 1, "%s[%s] %s",
-                depend_str, job_ptr->label, job_ptr->command);
+            snprintf(command_str, table_width + 1, "%s%s[%s] %s",
+                result_mark(job_ptr), depend_str, job_ptr->label,
+                job_ptr->command);
         else
-            snprintf(command_str, table_width + 1, "%s%s",
-                depend_str, job_ptr->command);
+            snprintf(command_str, table_width + 1, "%s%s%s",
+                result_mark(job_ptr), depend_str, job_ptr->command);
 
         /* Print line */
         if (strlen(command_str) <= col_width_command) /* -> all in one line */
@@ -252,6 +342,55 @@ char **joblist_table(const struct Job **job_list, int job_list_size)
     return table;
 }
 
+/* One line, tab separated, for scripts:
+ * id state errorlevel real user system maxrss(KiB) majflt nvcsw nivcsw
+ * read_bytes write_bytes output label command
+ * Unknown values are "-". */
+char * joblist_line_tsv(const struct Job *p)
+{
+    char *line;
+    char *c;
+    int maxlen;
+    int len;
+    const char *label;
+
+    label = p->label ? p->label : "-";
+    maxlen = 300 + strlen(ofilename_shown(p)) + strlen(label)
+        + strlen(p->command);
+    line = (char *) malloc(maxlen);
+    if (line == NULL)
+        error("Malloc for %i failed.\n", maxlen);
+
+    len = sprintf(line, "%i\t%s\t", p->jobid, jstate2string(p->state));
+    if (p->state == FINISHED)
+    {
+        len += sprintf(line + len, "%i\t%.3f\t%.3f\t%.3f\t%ld\t%ld\t%ld\t%ld\t",
+                p->result.errorlevel, p->result.real_ms, p->result.user_ms,
+                p->result.system_ms, p->result.maxrss, p->result.majflt,
+                p->result.nvcsw, p->result.nivcsw);
+        if (p->result.read_bytes >= 0)
+            len += sprintf(line + len, "%ld\t%ld\t", p->result.read_bytes,
+                    p->result.write_bytes);
+        else
+            len += sprintf(line + len, "-\t-\t");
+    }
+    else
+        len += sprintf(line + len, "-\t-\t-\t-\t-\t-\t-\t-\t-\t-\t");
+    sprintf(line + len, "%s\t%s\t%s\n", ofilename_shown(p), label,
+            p->command);
+
+    /* Keep one job per line and the columns in place */
+    for (c = line + len; c[1] != '\0'; ++c)
+        if (*c == '\n')
+            *c = ' ';
+    c = line + len + strlen(ofilename_shown(p)) + 1 + strlen(label) + 1;
+    for (; *c != '\n'; ++c)
+        if (*c == '\t')
+            *c = ' ';
+
+    return line;
+}
+
 char * joblistdump_headers()
 {
     char * line;
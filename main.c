@@ -11,6 +11,8 @@
 
 #include <stdio.h>
 #include <sys/time.h>
+#include <time.h>
+#include <getopt.h>
 
 #include "main.h"
 
@@ -29,7 +31,7 @@ static char version[] = "Task Spooler v1.0 - a task queue system for the unix us
 "Copyright (C) 2007-2016  Lluis Batlle i Rossell";
 
 
-static void default_command_line()
+void default_command_line()
 {
     command_line.request = c_LIST;
     command_line.need_server = 0;
@@ -40,11 +42,54 @@ static void default_command_line()
     command_line.send_output_by_mail = 0;
     command_line.label = 0;
     command_line.do_depend = 0;
-    command_line.depend_on = -1; /* -1 means depend on previous */
+    command_line.depend.previous = 0;
+    command_line.depend.jobids = 0;
+    command_line.depend.num_jobids = 0;
+    command_line.depend.labels = 0;
+    command_line.depend.mode = DEPEND_ALL_OK;
+    command_line.pipe.from = -1;
+    command_line.pipe.tee = 0;
+    command_line.pipe.wait_consumer = 0;
+    command_line.pipe.in = 0;
+    command_line.pipe.out = 0;
+    command_line.pipe.out_tee = 0;
     command_line.max_slots = 1;
     command_line.wait_enqueuing = 1;
     command_line.stderr_apart = 0;
     command_line.num_slots = 1;
+    command_line.output_limit = 0;
+    command_line.output_rate = 0;
+    command_line.output_policy = -1;
+    command_line.index_lines = 0;
+    command_line.memory_max = 0;
+    command_line.cpu_max = 0;
+    command_line.io_weight = 0;
+    command_line.cpus = 0;
+    command_line.numa_node = -1;
+    command_line.timeout = 0;
+    command_line.deadline = 0;
+    command_line.not_before = 0;
+    command_line.every = 0;
+    command_line.retries = 0;
+    command_line.retry_delay = 1;
+    command_line.retry_on[0] = 0;
+    command_line.priority = 0;
+    command_line.key = 0;
+    command_line.attached = 0;
+    command_line.cache.use = 0;
+    command_line.cache.inputs = 0;
+    command_line.cache.num_inputs = 0;
+    command_line.batch.file = 0;
+    command_line.batch.lines = 0;
+    command_line.batch.num = 0;
+    command_line.list_format = LIST_TABLE;
+    command_line.range.set = 0;
+    command_line.grep.pattern = 0;
+    command_line.grep.state = -1;
+    command_line.grep.jobid_from = -1;
+    command_line.grep.jobid_to = -1;
+    command_line.watch.dir = 0;
+    command_line.watch.glob = 0;
 }
 
 void get_command(int index, int argc, char **argv)
@@ -77,6 +122,383 @@ static int get_two_jobs(const char *str, int *j1, int *j2)
     return 1;
 }
 
+/* "a-b", "a-" or "a", for --lines and --bytes */
+static void get_range(const char *str, long min)
+{
+    char *end;
+
+    command_line.range.set = 1;
+    command_line.range.first = strtol(str, &end, 10);
+    command_line.range.last = command_line.range.first;
+    if (*end == '-')
+    {
+        str = end + 1;
+        if (*str == '\0')
+        {
+            command_line.range.last = -1;
+            end = (char *) str;
+        }
+        else
+            command_line.range.last = strtol(str, &end, 10);
+    }
+    if (*end != '\0' || command_line.range.first < min
+            || (command_line.range.last != -1
+                && command_line.range.last < command_line.range.first))
+    {
+        fprintf(stderr, "Wrong range. Use a-b, a- or a, from %li.\n", min);
+        exit(-1);
+    }
+}
+
+/* For --input, which implies --cache */
+static void add_cache_input(char *name)
+{
+    char **inputs;
+
+    inputs = (char **) realloc(command_line.cache.inputs,
+            (command_line.cache.num_inputs + 1) * sizeof(char *));
+    if (inputs == 0)
+        error("Cannot allocate memory for the inputs");
+    inputs[command_line.cache.num_inputs++] = name;
+    command_line.cache.inputs = inputs;
+    command_line.cache.use = 1;
+}
+
+/* "3,5,7" for -D, which may be given many times */
+static void add_depend_jobids(const char *str)
+{
+    int *jobids;
+    char *end;
+
+    command_line.do_depend = 1;
+    while (*str != '\0')
+    {
+        jobids = (int *) realloc(command_line.depend.jobids,
+                (command_line.depend.num_jobids + 1) * sizeof(int));
+        if (jobids == 0)
+            error("Cannot allocate memory for the dependencies");
+        command_line.depend.jobids = jobids;
+        jobids[command_line.depend.num_jobids++] = strtol(str, &end, 10);
+        if (end == str || (*end != ',' && *end != '\0'))
+        {
+            fprintf(stderr, "Wrong -D. Use jobids separated by commas.\n");
+            exit(-1);
+        }
+        str = end;
+        if (*str == ',')
+            ++str;
+    }
+}
+
+/* For --depend-label, which may be given many times */
+static void add_depend_label(const char *label)
+{
+    char *labels;
+    int len = 0;
+
+    command_line.do_depend = 1;
+    if (command_line.depend.labels != 0)
+        len = strlen(command_line.depend.labels);
+    labels = (char *) realloc(command_line.depend.labels,
+            len + strlen(label) + 2);
+    if (labels == 0)
+        error("Cannot allocate memory for the dependencies");
+    if (len > 0)
+        labels[len++] = ',';
+    strcpy(labels + len, label);
+    command_line.depend.labels = labels;
+}
+
+static int get_depend_mode(const char *str)
+{
+    if (strcmp(str, "all-ok") == 0)
+        return DEPEND_ALL_OK;
+    if (strcmp(str, "any-ok") == 0)
+        return DEPEND_ANY_OK;
+    if (strcmp(str, "always") == 0)
+        return DEPEND_ALWAYS;
+    fprintf(stderr, "Wrong --depend-mode. Use all-ok, any-ok or always.\n");
+    exit(-1);
+}
+
+static int get_state(const char *str)
+{
+    int state;
+
+    for (state = QUEUED; state <= SKIPPED; ++state)
+        if (strcmp(str, jstate2string(state)) == 0)
+            return state;
+    fprintf(stderr, "Wrong --state. Use queued, running, finished or "
+            "skipped.\n");
+    exit(-1);
+}
+
+/* Bytes, with an optional k, M or G suffix */
+/* Bytes, with an optional k, M or G suffix. -1 if wrong. */
+long parse_size(const char *str)
+{
+    char *end;
+    long size;
+
+    size = strtol(str, &end, 10);
+    switch(*end)
+    {
+        case 'k': case 'K':
+            size *= 1024;
+            ++end;
+            break;
+        case 'm': case 'M':
+            size *= 1024 * 1024;
+            ++end;
+            break;
+        case 'g': case 'G':
+            size *= 1024 * 1024 * 1024;
+            ++end;
+            break;
+    }
+    if (end == str || *end != '\0' || size < 0)
+        return -1;
+    return size;
+}
+
+static long get_size(const char *str, const char *option)
+{
+    long size;
+
+    size = parse_size(str);
+    if (size == -1)
+    {
+        fprintf(stderr, "Wrong size for --%s.\n", option);
+        exit(-1);
+    }
+    return size;
+}
+
+/* Seconds, with an optional s, m, h or d suffix */
+static int get_duration(const char *str, const char *option)
+{
+    char *end;
+    long seconds;
+
+    seconds = strtol(str, &end, 10);
+    switch(*end)
+    {
+        case 's':
+            ++end;
+            break;
+        case 'm':
+            seconds *= 60;
+            ++end;
+            break;
+        case 'h':
+            seconds *= 60 * 60;
+            ++end;
+            break;
+        case 'd':
+            seconds *= 24 * 60 * 60;
+            ++end;
+            break;
+    }
+    if (end == str || *end != '\0' || seconds <= 0)
+    {
+        fprintf(stderr, "Wrong time for --%s. Use seconds, or a number "
+                "followed by s, m, h or d.\n", option);
+        exit(-1);
+    }
+    return seconds;
+}
+
+/* For --at: "HH:MM[:SS]", today or else tomorrow, "YYYY-MM-DD HH:MM[:SS]",
+ * or a time from now as for --deadline */
+static long get_start_time(const char *str)
+{
+    struct tm tm;
+    time_t now;
+    time_t t;
+    int year, month, day, hour, min;
+    int sec = 0;
+    int n = 0;
+    int k = 0;
+    int dated = 0;
+
+    now = time(NULL);
+    if (strchr(str, ':') == NULL)
+        return now + get_duration(str, "at");
+
+    tm = *localtime(&now);
+    if (sscanf(str, "%d-%d-%d%*[ T]%d:%d%n", &year, &month, &day, &hour,
+                &min, &n) == 5)
+    {
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+        dated = 1;
+    }
+    else if (sscanf(str, "%d:%d%n", &hour, &min, &n) != 2)
+        n = 0;
+    if (n > 0 && str[n] == ':' && sscanf(str + n, ":%d%n", &sec, &k) == 1)
+        n += k;
+    if (n == 0 || str[n] != '\0' || hour < 0 || hour > 23 || min < 0
+            || min > 59 || sec < 0 || sec > 59
+            || (dated && (month < 1 || month > 12 || day < 1 || day > 31)))
+    {
+        fprintf(stderr, "Wrong time for --at. Use HH:MM[:SS], "
+                "YYYY-MM-DD HH:MM[:SS], or a time from now.\n");
+        exit(-1);
+    }
+
+    tm.tm_hour = hour;
+    tm.tm_min = min;
+    tm.tm_sec = sec;
+    tm.tm_isdst = -1;
+    t = mktime(&tm);
+    if (!dated && t <= now)
+    {
+        tm.tm_mday += 1;
+        tm.tm_isdst = -1;
+        t = mktime(&tm);
+    }
+    return t;
+}
+
+/* Signal names for --retry-on */
+static const struct
+{
+    const char *name;
+    int number;
+} signal_names[] =
+{
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"ILL", SIGILL},
+    {"ABRT", SIGABRT}, {"BUS", SIGBUS}, {"FPE", SIGFPE}, {"KILL", SIGKILL},
+    {"SEGV", SIGSEGV}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+    {"TERM", SIGTERM}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+    {"XCPU", SIGXCPU}, {"XFSZ", SIGXFSZ}
+};
+
+/* "75,SIGKILL,SIG15" into exit codes, and signals as negative numbers */
+static void get_retry_on(const char *str)
+{
+    int n = 0;
+
+    while (*str != '\0')
+    {
+        char *end;
+        long value;
+        int len;
+        unsigned int i;
+
+        len = strcspn(str, ",");
+        if (n == MAX_RETRY_ON - 1)
+        {
+            fprintf(stderr, "Too many --retry-on values. The maximum is "
+                    "%i.\n", MAX_RETRY_ON - 1);
+            exit(-1);
+        }
+        if (strncmp(str, "SIG", 3) == 0)
+        {
+            value = strtol(str + 3, &end, 10);
+            if (end == str + 3)
+                for (i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]);
+                        ++i)
+                    if (strlen(signal_names[i].name) == len - 3
+                            && strncmp(str + 3, signal_names[i].name,
+                                len - 3) == 0)
+                    {
+                        value = signal_names[i].number;
+                        end = (char *) str + len;
+                    }
+            value = -value;
+        }
+        else
+            value = strtol(str, &end, 10);
+        if (end != str + len || value == 0 || value > 255 || value < -64)
+        {
+            fprintf(stderr, "Wrong --retry-on. Use exit codes and signals, "
+                    "like 75,SIGKILL.\n");
+            exit(-1);
+        }
+        command_line.retry_on[n++] = value;
+        str += len;
+        if (*str == ',')
+            ++str;
+    }
+    command_line.retry_on[n] = 0;
+}
+
+/* Long options without a short equivalent */
+enum
+{
+    OPT_STATS = 256,
+    OPT_MAX_OUTPUT,
+    OPT_OUTPUT_RATE,
+    OPT_OUTPUT_POLICY,
+    OPT_GREP,
+    OPT_STATE,
+    OPT_IDS,
+    OPT_LINES,
+    OPT_BYTES,
+    OPT_MEMORY_MAX,
+    OPT_CPU_MAX,
+    OPT_IO_WEIGHT,
+    OPT_TIMEOUT,
+    OPT_DEADLINE,
+    OPT_RETRIES,
+    OPT_RETRY_DELAY,
+    OPT_RETRY_ON,
+    OPT_PRIORITY,
+    OPT_BATCH,
+    OPT_CACHE,
+    OPT_INPUT,
+    OPT_KEY,
+    OPT_DEPEND_LABEL,
+    OPT_DEPEND_MODE,
+    OPT_PIPE_FROM,
+    OPT_PIPE_TEE,
+    OPT_PIPE_OUT,
+    OPT_AT,
+    OPT_EVERY,
+    OPT_WATCH,
+    OPT_GLOB,
+    OPT_UNWATCH
+};
+
+static struct option long_options[] =
+{
+    {"stats", no_argument, NULL, OPT_STATS},
+    {"max-output", required_argument, NULL, OPT_MAX_OUTPUT},
+    {"output-rate", required_argument, NULL, OPT_OUTPUT_RATE},
+    {"output-policy", required_argument, NULL, OPT_OUTPUT_POLICY},
+    {"grep", required_argument, NULL, OPT_GREP},
+    {"state", required_argument, NULL, OPT_STATE},
+    {"ids", required_argument, NULL, OPT_IDS},
+    {"lines", required_argument, NULL, OPT_LINES},
+    {"bytes", required_argument, NULL, OPT_BYTES},
+    {"memory-max", required_argument, NULL, OPT_MEMORY_MAX},
+    {"cpu-max", required_argument, NULL, OPT_CPU_MAX},
+    {"io-weight", required_argument, NULL, OPT_IO_WEIGHT},
+    {"timeout", required_argument, NULL, OPT_TIMEOUT},
+    {"deadline", required_argument, NULL, OPT_DEADLINE},
+    {"retries", required_argument, NULL, OPT_RETRIES},
+    {"retry-delay", required_argument, NULL, OPT_RETRY_DELAY},
+    {"retry-on", required_argument, NULL, OPT_RETRY_ON},
+    {"priority", required_argument, NULL, OPT_PRIORITY},
+    {"batch", required_argument, NULL, OPT_BATCH},
+    {"cache", no_argument, NULL, OPT_CACHE},
+    {"input", required_argument, NULL, OPT_INPUT},
+    {"key", required_argument, NULL, OPT_KEY},
+    {"depend-label", required_argument, NULL, OPT_DEPEND_LABEL},
+    {"depend-mode", required_argument, NULL, OPT_DEPEND_MODE},
+    {"pipe-from", required_argument, NULL, OPT_PIPE_FROM},
+    {"pipe-tee", required_argument, NULL, OPT_PIPE_TEE},
+    {"pipe-out", no_argument, NULL, OPT_PIPE_OUT},
+    {"at", required_argument, NULL, OPT_AT},
+    {"every", required_argument, NULL, OPT_EVERY},
+    {"watch", required_argument, NULL, OPT_WATCH},
+    {"glob", required_argument, NULL, OPT_GLOB},
+    {"unwatch", required_argument, NULL, OPT_UNWATCH},
+    {NULL, 0, NULL, 0}
+};
+
 void parse_opts(int argc, char **argv)
 {
     int c;
@@ -84,7 +506,8 @@ void parse_opts(int argc, char **argv)
 
     /* Parse options */
     while(1) {
-        c = getopt(argc, argv, ":VhKgClnfmBEr:t:c:o:p:w:k:u:s:U:i:N:L:dS:D:");
+        c = getopt_long(argc, argv, ":VhKgClMnfmBEr:t:c:o:p:w:k:u:s:U:i:N:L:dS:D:",
+                long_options, NULL);
 
         if (c == -1)
             break;
@@ -102,12 +525,16 @@ void parse_opts(int argc, char **argv)
             case 'l':
                 command_line.request = c_LIST;
                 break;
+            case 'M':
+                command_line.request = c_LIST;
+                command_line.list_format = LIST_TSV;
+                break;
             case 'h':
                 command_line.request = c_SHOW_HELP;
                 break;
             case 'd':
                 command_line.do_depend = 1;
-                command_line.depend_on = -1;
+                command_line.depend.previous = 1;
                 break;
             case 'V':
                 command_line.request = c_SHOW_VERSION;
@@ -181,8 +608,7 @@ void parse_opts(int argc, char **argv)
                 }
                 break;
             case 'D':
-                command_line.do_depend = 1;
-                command_line.depend_on = atoi(optarg);
+                add_depend_jobids(optarg);
                 break;
             case 'U':
                 command_line.request = c_SWAP_JOBS;
@@ -207,6 +633,135 @@ void parse_opts(int argc, char **argv)
             case 'E':
                 command_line.stderr_apart = 1;
                 break;
+            case OPT_STATS:
+                command_line.request = c_SHOW_STATS;
+                break;
+            case OPT_MAX_OUTPUT:
+                command_line.output_limit = get_size(optarg, "max-output");
+                break;
+            case OPT_OUTPUT_RATE:
+                command_line.output_rate = get_size(optarg, "output-rate");
+                break;
+            case OPT_OUTPUT_POLICY:
+                command_line.output_policy = output_policy_from_string(optarg);
+                if (command_line.output_policy == -1)
+                {
+                    fprintf(stderr, "Wrong --output-policy. "
+                            "Use truncate, throttle or kill.\n");
+                    exit(-1);
+                }
+                break;
+            case OPT_GREP:
+                command_line.request = c_GREP;
+                command_line.grep.pattern = optarg;
+                break;
+            case OPT_STATE:
+                command_line.grep.state = get_state(optarg);
+                break;
+            case OPT_IDS:
+                if (!get_two_jobs(optarg, &command_line.grep.jobid_from,
+                            &command_line.grep.jobid_to))
+                {
+                    command_line.grep.jobid_from = atoi(optarg);
+                    command_line.grep.jobid_to = command_line.grep.jobid_from;
+                }
+                break;
+            case OPT_LINES:
+            case OPT_BYTES:
+                command_line.range.by_lines = (c == OPT_LINES);
+                get_range(optarg, c == OPT_LINES ? 1 : 0);
+                break;
+            case OPT_MEMORY_MAX:
+                command_line.memory_max = get_size(optarg, "memory-max");
+                break;
+            case OPT_CPU_MAX:
+                command_line.cpu_max = atoi(optarg);
+                if (command_line.cpu_max <= 0)
+                {
+                    fprintf(stderr, "Wrong --cpu-max. Use a percent of "
+                            "one cpu, like 50 or 200.\n");
+                    exit(-1);
+                }
+                break;
+            case OPT_IO_WEIGHT:
+                command_line.io_weight = atoi(optarg);
+                if (command_line.io_weight < 1
+                        || command_line.io_weight > 10000)
+                {
+                    fprintf(stderr, "Wrong --io-weight. Use 1 to 10000.\n");
+                    exit(-1);
+                }
+                break;
+            case OPT_TIMEOUT:
+                command_line.timeout = get_duration(optarg, "timeout");
+                break;
+            case OPT_DEADLINE:
+                command_line.deadline = get_duration(optarg, "deadline");
+                break;
+            case OPT_AT:
+                command_line.not_before = get_start_time(optarg);
+                break;
+            case OPT_EVERY:
+                command_line.every = get_duration(optarg, "every");
+                break;
+            case OPT_RETRIES:
+                command_line.retries = atoi(optarg);
+                if (command_line.retries < 0)
+                {
+                    fprintf(stderr, "Wrong --retries. Use the number of "
+                            "attempts after the first.\n");
+                    exit(-1);
+                }
+                break;
+            case OPT_RETRY_DELAY:
+                command_line.retry_delay = get_duration(optarg,
+                        "retry-delay");
+                break;
+            case OPT_RETRY_ON:
+                get_retry_on(optarg);
+                break;
+            case OPT_PRIORITY:
+                command_line.priority = atoi(optarg);
+                break;
+            case OPT_BATCH:
+                command_line.batch.file = optarg;
+                break;
+            case OPT_CACHE:
+                command_line.cache.use = 1;
+                break;
+            case OPT_INPUT:
+                add_cache_input(optarg);
+                break;
+            case OPT_KEY:
+                command_line.key = optarg;
+                break;
+            case OPT_DEPEND_LABEL:
+                add_depend_label(optarg);
+                break;
+            case OPT_DEPEND_MODE:
+                command_line.depend.mode = get_depend_mode(optarg);
+                break;
+            case OPT_PIPE_FROM:
+                command_line.pipe.from = atoi(optarg);
+                break;
+            case OPT_PIPE_TEE:
+                command_line.pipe.from = atoi(optarg);
+                command_line.pipe.tee = 1;
+                break;
+            case OPT_PIPE_OUT:
+                command_line.pipe.wait_consumer = 1;
+                break;
+            case OPT_WATCH:
+                command_line.request = c_WATCH;
+                command_line.watch.dir = optarg;
+                break;
+            case OPT_GLOB:
+                command_line.watch.glob = optarg;
+                break;
+            case OPT_UNWATCH:
+                command_line.request = c_UNWATCH;
+                command_line.jobid = atoi(optarg);
+                break;
             case ':':
                 switch(optopt)
                 {
@@ -279,6 +834,33 @@ void parse_opts(int argc, char **argv)
         get_command(optind, argc, argv);
     }
 
+    /* The command of the jobs of the watch */
+    if (command_line.request == c_WATCH)
+    {
+        if (optind >= argc)
+        {
+            fprintf(stderr, "--watch needs a command to run.\n");
+            exit(-1);
+        }
+        get_command(optind, argc, argv);
+    }
+
+    /* The command shown for the batch */
+    if (command_line.batch.file != 0)
+    {
+        static char *batch_command[3] = { "batch", 0, 0 };
+
+        if (command_line.request != c_LIST)
+        {
+            fprintf(stderr, "--batch takes the commands from the file.\n");
+            exit(-1);
+        }
+        command_line.request = c_QUEUE;
+        batch_command[1] = command_line.batch.file;
+        command_line.command.array = batch_command;
+        command_line.command.num = 2;
+    }
+
     if (command_line.request != c_SHOW_HELP &&
             command_line.request != c_SHOW_VERSION)
         command_line.need_server = 1;
@@ -346,13 +928,44 @@ static void print_help(const char *cmd)
     printf("  TS_SAVELIST  filename which will store the list, if the server dies.\n");
     printf("  TS_SLOTS   amount of jobs which can run at once, read on server start.\n");
     printf("  TMPDIR     directory where to place the output files and the default socket.\n");
+    printf("  TS_OUTPUT_STORE  directory to append the outputs into segment files.\n");
+    printf("  TS_SEGMENT_SIZE  size in bytes at which a new segment is started.\n");
+    printf("  TS_RECLAIM  remove the output files of cleared and evicted jobs.\n");
+    printf("  TS_KEEP_COUNT, TS_KEEP_BYTES, TS_KEEP_AGE  keep only the outputs of the\n"
+           "             last finished jobs by count, total bytes or age in seconds.\n");
+    printf("  TS_MAXOUTPUT, TS_OUTPUT_RATE, TS_OUTPUT_POLICY  output limits for all jobs.\n");
+    printf("  TS_INDEX_LINES  index the outputs every that many lines, for --lines.\n");
+    printf("  TS_GREP_THREADS  threads for --grep. As many as cpus by default.\n");
+    printf("  TS_CGROUP  delegated cgroup v2 directory, to run each job in a cgroup.\n");
+    printf("  TS_AFFINITY  pin each job to a cpu per slot, within a NUMA node if possible.\n");
+    printf("  TS_ADAPTIVE_SLOTS  min-max slots, following the cpu, memory and io pressure.\n");
+    printf("  TS_ADAPTIVE_INTERVAL  seconds between the checks of the pressure (5).\n");
+    printf("  TS_MEMORY_BUDGET  bytes (k, M, G) for the peak memory learnt of the jobs.\n");
+    printf("  TS_TIMEOUT_GRACE  seconds from SIGTERM to SIGKILL on --timeout (10).\n");
+    printf("  TS_START_RATE  rate[:burst], jobs started per second at most.\n");
+    printf("  TS_LABEL_START_RATE  label=rate[:burst],... the same for each label.\n");
+    printf("  TS_AIMD  label=max[:target],... running jobs of the label, growing on\n"
+           "             success within target seconds, halving on failure.\n");
+    printf("  TS_PREFORK  fork each job while it is queued, to start it sooner.\n");
+    printf("  TS_CACHE  file keeping the results of --cache jobs, read on server start.\n");
+    printf("  TS_CACHE_SIZE  results kept in TS_CACHE, the last used (1000).\n");
+    printf("  TS_CACHE_ENV  variables that make a --cache job different, as A,B.\n");
+    printf("  TS_HISTORY  file keeping the run times of the jobs, for the ETAs.\n");
+    printf("  TS_HISTORY_SIZE  run time histories kept, the last used (10000).\n");
+    printf("  TS_SCHEDULER  sjf to run the shortest expected job first (fifo).\n");
+    printf("  TS_WATCH_SETTLE  seconds a watched file must be left alone before its job.\n");
+    printf("  TS_FAIR_SHARE  user=share,... slots shared among the users by weight.\n");
+    printf("  TS_USER_SLOTS  user=slots,... slots each user may have running.\n");
     printf("Actions:\n");
     printf("  -K       kill the task spooler server\n");
     printf("  -C       clear the list of finished jobs\n");
     printf("  -l       show the job list (default action)\n");
+    printf("  -M       show the job list with resource usage, tab separated.\n");
     printf("  -S [num] get/set the number of max simultaneous jobs of the server.\n");
+    printf("           With TS_ADAPTIVE_SLOTS, it also shows the last changes.\n");
     printf("  -t [id]  \"tail -n 10 -f\" the output of the job. Last run if not specified.\n");
     printf("  -c [id]  like -t, but shows all the lines. Last run if not specified.\n");
+    printf("           With --lines <a-b> or --bytes <a-b>, only that part of the output.\n");
     printf("  -p [id]  show the pid of the job. Last run if not specified.\n");
     printf("  -o [id]  show the output file. Of last job run, if not specified.\n");
     printf("  -i [id]  show job information. Of last job run, if not specified.\n");
@@ -360,9 +973,14 @@ static void print_help(const char *cmd)
     printf("  -r [id]  remove a job. The last added, if not specified.\n");
     printf("  -w [id]  wait for a job. The last added, if not specified.\n");
     printf("  -k [id]  send SIGTERM to the job process group. The last run, if not specified.\n");
+    printf("           With TS_CGROUP, kill all the processes of the job cgroup.\n");
     printf("  -u [id]  put that job first. The last added, if not specified.\n");
     printf("  -U <id-id>  swap two jobs in the queue.\n");
     printf("  -B       in case of full queue on the server, quit (2) instead of waiting.\n");
+    printf("  --stats  show the server statistics.\n");
+    printf("  --grep <text>  show the output lines of the jobs with that text, as\n"
+           "           'id:line'. Filter the jobs with -L <lab>, --state <state>\n"
+           "           and --ids <id-id>.\n");
     printf("  -h       show this help\n");
     printf("  -V       show the program version\n");
     printf("Options adding jobs:\n");
@@ -373,8 +991,39 @@ static void print_help(const char *cmd)
     printf("  -m       send the output by e-mail (uses sendmail).\n");
     printf("  -d       the job will be run only if the job before ends well\n");
     printf("  -D <id>  the job will be run only if the job of given id ends well.\n");
+    printf("           Many ids can be given, separated by commas.\n");
     printf("  -L <lab> name this task with a label, to be distinguished on listing.\n");
     printf("  -N <num> number of slots required by the job (1 default).\n");
+    printf("  --max-output <size>  limit the bytes of output (k, M, G suffixes).\n");
+    printf("  --output-rate <size>  limit the bytes per second of output.\n");
+    printf("  --output-policy <p>  over the limit: truncate (default), throttle, kill.\n");
+    printf("  --memory-max <size>  memory.max of the job cgroup (needs TS_CGROUP).\n");
+    printf("  --cpu-max <percent>  cpu.max of the job cgroup, in percent of one cpu.\n");
+    printf("  --io-weight <n>  io.weight of the job cgroup, from 1 to 10000.\n");
+    printf("  --timeout <time>  kill the job after running that long (s, m, h, d).\n");
+    printf("  --deadline <time>  skip the job if it didn't start within that time.\n");
+    printf("  --at <when>  don't start the job before HH:MM[:SS], YYYY-MM-DD HH:MM[:SS]\n"
+           "             or a time from now (s, m, h, d).\n");
+    printf("  --every <time>  run the job again each time, from its first run or --at.\n");
+    printf("  --retries <num>  run the job again up to num times, if it fails.\n");
+    printf("  --retry-delay <time>  before the first retry, doubling each time (1s).\n");
+    printf("  --retry-on <list>  only retry on these exit codes or SIGnals.\n");
+    printf("  --priority <num>  over 0, stop running jobs of lower priority to run.\n");
+    printf("  --batch <file>  queue the commands in file (- for stdin), one per line,\n"
+           "             as one job running them in turn.\n");
+    printf("  --cache  take the result of the same job that ended well (needs TS_CACHE).\n");
+    printf("  --input <file>  the job reads file, for the cache key. Implies --cache.\n");
+    printf("  --key <key>  if a job of the same key is queued or running, take it.\n");
+    printf("  --depend-label <lab>  depend on the jobs of the label, as with -D.\n");
+    printf("  --depend-mode <m>  run if all-ok (default), any-ok or always (all end).\n");
+    printf("  --pipe-out  don't start the job before another takes its output.\n");
+    printf("  --pipe-from <id>  the output of the queued job id is the input of this\n"
+           "             one. Both start together.\n");
+    printf("  --pipe-tee <id>  as --pipe-from, and the job id stores its output too.\n");
+    printf("  --watch <dir>  queue the command for each file written or moved into dir,\n"
+           "             {} being the file. With -L and -N for the jobs.\n");
+    printf("  --glob <pattern>  with --watch, only for the files matching pattern.\n");
+    printf("  --unwatch <id>  stop the watch id, as shown by --stats.\n");
 }
 
 static void print_version()
@@ -434,6 +1083,8 @@ int main(int argc, char **argv)
                     command_line.command.num);
         if (!command_line.need_server)
             error("The command %i needs the server", command_line.request);
+        if (command_line.batch.file != 0)
+            batch_read();
         c_new_job();
         command_line.jobid = c_wait_newjob_ok();
         if (command_line.store_output)
@@ -441,7 +1092,13 @@ int main(int argc, char **argv)
             printf("%i\n", command_line.jobid);
             fflush(stdout);
         }
-        if (command_line.should_go_background)
+        /* The job of the same key runs for us */
+        if (command_line.attached)
+        {
+            if (!command_line.should_go_background)
+                errorlevel = c_wait_job_recv();
+        }
+        else if (command_line.should_go_background)
         {
             go_background();
             c_wait_server_commands();
@@ -456,6 +1113,28 @@ int main(int argc, char **argv)
         c_list_jobs();
         c_wait_server_lines();
         break;
+    case c_GREP:
+        if (!command_line.need_server)
+            error("The command %i needs the server", command_line.request);
+        c_grep();
+        c_wait_server_lines();
+        break;
+    case c_WATCH:
+        if (!command_line.need_server)
+            error("The command %i needs the server", command_line.request);
+        c_watch();
+        break;
+    case c_UNWATCH:
+        if (!command_line.need_server)
+            error("The command %i needs the server", command_line.request);
+        c_unwatch();
+        break;
+    case c_SHOW_STATS:
+        if (!command_line.need_server)
+            error("The command %i needs the server", command_line.request);
+        c_show_stats();
+        c_wait_server_lines();
+        break;
     case c_KILL_SERVER:
         if (!command_line.need_server)
             error("The command %i needs the server", command_line.request);
@@ -518,6 +1197,7 @@ int main(int argc, char **argv)
         break;
     case c_GET_MAX_SLOTS:
         c_get_max_slots();
+        c_wait_server_lines();
         break;
     case c_SWAP_JOBS:
         if (!command_line.need_server)
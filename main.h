@@ -7,7 +7,9 @@
 enum
 {
     CMD_LEN=500,
-    PROTOCOL_VERSION=730
+    MAX_RETRY_ON=8,
+    CACHE_KEY_SIZE=17,
+    PROTOCOL_VERSION=750
 };
 
 enum msg_types
@@ -41,7 +43,18 @@ enum msg_types
     GET_MAX_SLOTS_OK,
     GET_VERSION,
     VERSION,
-    NEWJOB_NOK
+    NEWJOB_NOK,
+    STORED_OUTPUT,
+    GET_STATS,
+    GREP,
+    ENDJOB_OK,
+    RETRYJOB,
+    BATCH_PROGRESS,
+    NEWJOB_ATTACHED,
+    WATCH,
+    UNWATCH,
+    WATCH_OK,
+    TAKEJOB
 };
 
 enum Request
@@ -64,7 +77,11 @@ enum Request
     c_INFO,
     c_SET_MAX_SLOTS,
     c_GET_MAX_SLOTS,
-    c_KILL_JOB
+    c_KILL_JOB,
+    c_SHOW_STATS,
+    c_GREP,
+    c_WATCH,
+    c_UNWATCH
 };
 
 struct Command_line {
@@ -77,8 +94,23 @@ struct Command_line {
     int send_output_by_mail;
     int gzip;
     int do_depend;
-    int depend_on; /* -1 means depend on previous */
+    struct {
+        int previous; /* -d */
+        int *jobids; /* -D */
+        int num_jobids;
+        char *labels; /* --depend-label, separated by commas. 0 if none */
+        int mode; /* enum Depend_mode */
+    } depend;
+    struct {
+        int from; /* The job whose output is the input. -1 if none */
+        int tee; /* That job also stores its output */
+        int wait_consumer; /* --pipe-out: not to start before one */
+        char *in; /* The fifos, from the server. 0 if none */
+        char *out;
+        int out_tee; /* From the server: the output also goes to the file */
+    } pipe;
     int max_slots; /* How many jobs to run at once */
+    int list_format; /* LIST_TABLE or LIST_TSV */
     int jobid; /* When queuing a job, main.c will fill it automatically from
                   the server answer to NEWJOB */
     int jobid2;
@@ -88,7 +120,96 @@ struct Command_line {
         int num;
     } command;
     char *label;
+    char *key; /* Idempotency key. 0 if none */
+    int attached; /* To a job of the same key, on NEWJOB */
     int num_slots; /* Slots for the job to use. Default 1 */
+    long output_limit; /* Bytes of output. 0 means no limit */
+    long output_rate; /* Bytes per second. 0 means no limit */
+    int output_policy; /* -1 means the server default */
+    long index_lines; /* Lines between index checkpoints. 0 means none */
+    long memory_max; /* Bytes, for the job cgroup. 0 means no limit */
+    int cpu_max; /* Percent of one cpu. 0 means no limit */
+    int io_weight; /* 1-10000. 0 means the cgroup default */
+    char *cpus; /* From the server, with TS_AFFINITY. 0 means not pinned */
+    int numa_node; /* To bind the memory to. -1 means none */
+    int timeout; /* Seconds running. 0 means no limit */
+    int deadline; /* Seconds queued. 0 means no limit */
+    long not_before; /* --at, a time_t. 0 means now */
+    int every; /* Seconds between runs. 0 means it runs once */
+    int retries; /* Attempts after the first one */
+    int retry_delay; /* Seconds before the first retry */
+    int retry_on[MAX_RETRY_ON]; /* Exit codes, or -signal. 0 ends it */
+    int priority; /* Higher ones preempt the running jobs. 0 by default */
+    struct {
+        int use;
+        char **inputs; /* Files the key depends on */
+        int num_inputs;
+    } cache;
+    struct {
+        char *file; /* 0 if the job is not a batch */
+        char **lines; /* The commands */
+        int num;
+    } batch;
+    struct {
+        long first;
+        long last; /* -1 means up to the end */
+        int by_lines;
+        int set;
+    } range;
+    struct {
+        char *pattern;
+        int state; /* -1 means any */
+        int jobid_from; /* -1 means no bound */
+        int jobid_to;
+    } grep;
+    struct {
+        char *dir; /* --watch */
+        char *glob; /* 0 means any file */
+    } watch;
+};
+
+struct Line_index
+{
+    int fd;
+    long interval;
+    long lines;
+    long offset;
+};
+
+enum Depend_mode
+{
+    DEPEND_ALL_OK,
+    DEPEND_ANY_OK,
+    DEPEND_ALWAYS
+};
+
+enum List_format
+{
+    LIST_TABLE,
+    LIST_TSV
+};
+
+enum Output_policy
+{
+    OUTPUT_TRUNCATE,
+    OUTPUT_THROTTLE,
+    OUTPUT_KILL
+};
+
+enum Timeout_result
+{
+    NOT_TIMED_OUT,
+    TIMED_OUT,
+    DEADLINE_PASSED
+};
+
+enum Timer_type
+{
+    TIMER_TIMEOUT,
+    TIMER_KILL,
+    TIMER_DEADLINE,
+    TIMER_RETRY,
+    TIMER_START
 };
 
 enum Process_type {
@@ -124,15 +245,39 @@ struct msg
             int should_keep_finished;
             int label_size;
             int env_size;
+            int key_size; /* The key comes first, if not 0 */
             int do_depend;
-            int depend_on; /* -1 means depend on previous */
+            int depend_previous;
+            int depend_mode;
+            int depend_jobids_size; /* After the environment, the jobids */
+            int depend_labels_size; /* and the labels */
+            int pipe_from;
+            int pipe_tee;
+            int pipe_out; /* It waits for a job to take its output */
             int wait_enqueuing;
             int num_slots;
+            long output_limit;
+            long output_rate;
+            int output_policy;
+            long memory_max;
+            int cpu_max;
+            int io_weight;
+            int timeout;
+            int deadline;
+            long not_before;
+            int every;
+            int retries;
+            int retry_delay;
+            int retry_on[MAX_RETRY_ON];
+            int priority;
+            int batch_size; /* Commands of a batch. 0 if not a batch */
+            char cache_key[CACHE_KEY_SIZE]; /* "" without --cache */
         } newjob;
         struct {
             int ofilename_size;
             int store_output;
             int pid;
+            struct timeval exec_time; /* RUNJOB_OK: right before the exec */
         } output;
         int jobid;
         struct Result {
@@ -143,6 +288,22 @@ struct msg
             float system_ms;
             float real_ms;
             int skipped;
+            long output_bytes;
+            int output_exceeded;
+            int timed_out; /* enum Timeout_result, set by the server */
+            long maxrss; /* KiB */
+            long majflt;
+            long nvcsw;
+            long nivcsw;
+            long read_bytes; /* -1 if unknown */
+            long write_bytes;
+            struct {
+                long user_usec; /* -1 if not in a cgroup */
+                long system_usec;
+                long memory_peak; /* bytes */
+                long read_bytes;
+                long write_bytes;
+            } cgroup;
         } result;
         int size;
         enum Jobstate state;
@@ -150,9 +311,49 @@ struct msg
             int jobid1;
             int jobid2;
         } swap;
-        int last_errorlevel;
+        struct {
+            int last_errorlevel;
+            long output_limit;
+            long output_rate;
+            int output_policy;
+            long index_lines;
+            int cpus_size; /* The cpu list follows, if not 0 */
+            int numa_node;
+            int skip; /* Its deadline passed, or its input went away */
+            int cached; /* Not to run: the result is in the cache */
+            int pipe_in_size; /* The fifo names follow the cpus, if not 0 */
+            int pipe_out_size;
+            int pipe_tee; /* The output goes to the fifo and the file */
+        } runjob;
+        struct {
+            int attempt; /* The one coming */
+            int delay; /* Seconds */
+        } retry;
+        struct Batch_progress {
+            int done;
+            int failed;
+            int first_failed; /* Index of the command, -1 if none */
+            int first_errorlevel;
+            int slowest; /* Index of the command, -1 if none ran */
+            float slowest_time;
+        } batch;
         int max_slots;
         int version;
+        int list_format;
+        struct {
+            int pattern_size;
+            int label_size;
+            int state;
+            int jobid_from;
+            int jobid_to;
+        } grep;
+        struct {
+            int dir_size; /* The directory, the glob, the label and the */
+            int glob_size; /* arguments follow, each ending in '\0' */
+            int label_size;
+            int args_size;
+            int num_slots;
+        } watch;
     } u;
 };
 
@@ -164,6 +365,15 @@ struct Procinfo
     struct timeval enqueue_time;
     struct timeval start_time;
     struct timeval end_time;
+    struct timeval suspend_time; /* Since when, while suspended */
+    float suspended; /* Seconds suspended, before suspend_time */
+};
+
+struct Depend
+{
+    int jobid; /* -1 if there was no job before, with -d */
+    int finished;
+    int errorlevel; /* Once finished */
 };
 
 struct Job
@@ -178,13 +388,58 @@ struct Job
     int pid;
     int should_keep_finished;
     int do_depend;
-    int depend_on;
+    int depend_mode;
+    struct Depend *depends; /* The jobs it waits for */
+    int depends_size;
+    double path; /* Estimated seconds of the longest chain of queued jobs
+                    waiting for it, its own included. 0 if none waits */
+    double estimate; /* Seconds it is expected to run. -1 if unknown */
+    struct History *history; /* Of predict.c, for estimate. 0 if none */
+    long history_generation; /* Of predict.c, when history was found */
+    double eta; /* Seconds until it is expected to end, for the list */
+    int pipe_from; /* The job whose output is its input. -1 if none */
+    int pipe_to; /* The job taking its output. -1 if none, -2 while it
+                    waits for one */
+    int pipe_tee; /* Of the job taking the output */
+    char *pipe_name; /* The fifo, while it runs. 0 if none */
     int *notify_errorlevel_to;
     int notify_errorlevel_to_size;
-    int dependency_errorlevel;
     char *label;
+    char *key; /* Idempotency key. 0 if none */
     struct Procinfo info;
     int num_slots;
+    int output_reclaimed;
+    long output_limit;
+    long output_rate;
+    int output_policy;
+    long memory_max;
+    int cpu_max;
+    int io_weight;
+    long memory_estimate; /* bytes, taken from TS_MEMORY_BUDGET */
+    int timeout;
+    int deadline;
+    int timed_out;
+    int retries;
+    int retry_delay;
+    int retry_on[MAX_RETRY_ON];
+    int attempt; /* Attempts finished, when retrying */
+    int retry_pending; /* Queued, but waiting for the backoff */
+    time_t fire_time; /* Of the run to come, or the first run of a
+                         recurring job. 0 if it was free to start */
+    int delayed; /* Queued, but waiting for fire_time */
+    int every; /* Seconds between runs. 0 if it runs once */
+    int runs; /* Runs ended, of a recurring job */
+    int priority;
+    int suspended; /* Running, but stopped to leave its slots */
+    struct timeval dispatch_time; /* Of the last RUNJOB */
+    int batch_size; /* Commands of a batch. 0 if not a batch */
+    struct Batch_progress batch;
+    char cache_key[CACHE_KEY_SIZE]; /* "" without --cache */
+    int cached; /* Its result comes from the cache */
+    char *args; /* Of a job queued by a watch, with no client: its directory
+                   and its arguments, each ending in '\0'. 0 if none */
+    int args_size;
+    int uid; /* Of the client that queued it */
 };
 
 enum ExitCodes
@@ -195,14 +450,22 @@ enum ExitCodes
 };
 
 
+/* main.c */
+void default_command_line();
+long parse_size(const char *str);
+
 /* client.c */
 void c_new_job();
 void c_list_jobs();
+void clear_result(struct Result *r);
 void c_shutdown_server();
 void c_wait_server_lines();
 void c_clear_finished();
 int c_wait_server_commands();
-void c_send_runjob_ok(const char *ofname, int pid);
+void c_send_runjob_ok(const char *ofname, int pid,
+        const struct timeval *exec_time);
+void c_send_batch_progress(const struct Batch_progress *progress);
+void c_send_stored_output(const char *vname);
 int c_tail();
 int c_cat();
 void c_show_output_file();
@@ -221,16 +484,25 @@ char *build_command_string();
 void c_send_max_slots(int max_slots);
 void c_get_max_slots();
 void c_check_version();
+void c_show_stats();
+void c_grep();
+void c_watch();
+void c_unwatch();
 
 /* jobs.c */
-void s_list(int s);
-int s_newjob(int s, struct msg *m);
+void s_list(int s, int format);
+int s_newjob(int s, struct msg *m, int uid, int *attached);
+void s_newjob_attached(int s, int jobid);
 void s_removejob(int jobid);
 void job_finished(const struct Result *result, int jobid);
+int s_retry_job(int s, const struct Result *result, int jobid);
 int next_run_job();
 void s_mark_job_running(int jobid);
 void s_clear_finished();
-void s_process_runjob_ok(int jobid, char *oname, int pid);
+void s_process_runjob_ok(int jobid, char *oname, int pid,
+        const struct timeval *exec_time);
+void s_batch_progress(int jobid, const struct Batch_progress *progress);
+void s_process_stored_output(int jobid, char *vname);
 void s_send_output(int socket, int jobid);
 int s_remove_job(int s, int *jobid);
 void s_remove_notification(int s);
@@ -248,9 +520,23 @@ void s_job_info(int s, int jobid);
 void s_send_runjob(int s, int jobid);
 void s_set_max_slots(int new_max_slots);
 void s_get_max_slots(int s);
+int s_jobs_waiting();
+int s_running_with_label(const char *label);
+void s_continue_suspended();
+void s_timer_fired(enum Timer_type type, int jobid);
 int job_is_running(int jobid);
 int job_is_holding_client(int jobid);
 int wake_hold_client();
+void s_apply_retention();
+int s_retention_timeout();
+void s_send_stats(int s);
+void send_list_line(int s, const char * str);
+void s_grep(int s, const struct msg *m, const char *pattern,
+        const char *label);
+int s_add_watched_job(int watch, int uid, const char *label, int num_slots,
+        char *args, int args_size, int settle);
+int s_watch_coalesce(const char *args, int args_size, int settle);
+const char * s_job_args(int jobid, int *size);
 
 /* server.c */
 void server_main(int notify_fd, char *_path);
@@ -265,6 +551,10 @@ void create_socket_path(char **path);
 
 /* execute.c */
 int run_job();
+void prefork_job();
+void cancel_prefork();
+int output_policy_from_string(const char *str);
+const char * output_policy_to_string(int policy);
 
 /* client_run.c */
 void c_run_tail(const char *filename);
@@ -303,6 +593,7 @@ void warning_msg(const struct msg *m, const char *str, ...);
 char **joblist_table(const struct Job **job_list, int job_list_size);
 char * joblistdump_torun(const struct Job *p);
 char * joblistdump_headers();
+char * joblist_line_tsv(const struct Job *p);
 
 /* print.c */
 int fd_nprintf(int fd, int maxsize, const char *fmt, ...);
@@ -318,6 +609,9 @@ void pinfo_set_start_time(struct Procinfo *p);
 void pinfo_set_end_time(struct Procinfo *p);
 float pinfo_time_until_now(const struct Procinfo *p);
 float pinfo_time_run(const struct Procinfo *p);
+void pinfo_set_suspend_time(struct Procinfo *p);
+void pinfo_set_resume_time(struct Procinfo *p);
+float pinfo_time_suspended(const struct Procinfo *p);
 void pinfo_init(struct Procinfo *p);
 
 /* env.c */
@@ -325,3 +619,123 @@ char * get_environment();
 
 /* tail.c */
 int tail_file(const char *fname, int last_lines);
+
+/* store.c */
+const char * store_directory();
+int store_is_virtual(const char *name);
+char * store_commit(const char *spoolname, int jobid);
+int store_open(const char *name, long *start, long *end);
+long store_release(const char *name);
+
+/* reclaim.c */
+void reclaim_output(const char *name);
+int reclaim_fdset(fd_set *readset, fd_set *writeset, int maxfd);
+void reclaim_process(fd_set *readset, fd_set *writeset);
+void reclaim_stats(long *files, long *bytes, int *pending);
+
+/* index.c */
+char * index_path(const char *name);
+int index_create(const char *name, long interval);
+void index_feed(struct Line_index *ix, const char *buf, int len);
+int cat_range(const char *name, long first, long last, int by_lines);
+
+/* cgroup.c */
+const char * cgroup_directory();
+char * cgroup_create(int jobid);
+void cgroup_enter(const char *cgroup);
+void cgroup_collect(const char *cgroup, struct Result *result);
+void cgroup_remove(const char *cgroup);
+int cgroup_kill(int pid);
+
+/* timer.c */
+void timer_add(int seconds, enum Timer_type type, int jobid);
+void timer_run();
+int timer_timeout();
+
+/* memory.c */
+char * job_signature(const struct Job *p);
+long memory_budget();
+long memory_estimate(const struct Job *p);
+void memory_learn(const struct Job *p);
+void memory_stats(int s, long used);
+
+/* rate.c */
+void rate_init();
+void rate_new_pass();
+int rate_admits(const struct Job *p);
+void rate_take(const struct Job *p);
+int rate_timeout();
+void rate_stats(int s);
+
+/* dag.c */
+void dag_update_paths(struct Job *first);
+void depend_string(char *buf, int size, const struct Job *p);
+
+/* predict.c */
+void predict_init();
+void predict_save();
+void predict_learn(const struct Job *p);
+double predict_runtime(struct Job *p);
+int predict_sjf();
+void predict_etas(struct Job *first, int max_slots);
+void predict_info(int s, const struct Job *p);
+void predict_stats(int s);
+
+/* cache.c */
+void cache_key(char *key);
+void cache_init();
+int cache_lookup(const char *key, struct Result *result, char **output,
+        time_t *created);
+void cache_store(const char *key, const struct Result *result,
+        const char *output);
+void cache_forget(const char *output);
+void cache_stats(int s);
+
+/* batch.c */
+void batch_read();
+void run_batch(int fd_progress);
+void batch_follow(int fd_progress);
+
+/* aimd.c */
+void aimd_init();
+int aimd_admits(const struct Job *p);
+void aimd_learn(const struct Job *p, const struct Result *result);
+void aimd_stats(int s);
+
+/* adapt.c */
+void adapt_init();
+int adapt_timeout();
+void adapt_check();
+int adapt_manual_slots(int slots);
+void adapt_report(int s);
+
+/* affinity.c */
+void affinity_init();
+char * affinity_assign(int jobid, int nslots, int *node);
+void affinity_release(int jobid);
+void affinity_apply(const char *cpulist, int node);
+
+/* watch.c */
+void watch_init();
+int watch_add(const char *dir, const char *glob, const char *label,
+        int num_slots, const char *args, int args_size, int uid);
+int watch_remove(int id);
+int watch_fdset(fd_set *readset, int maxfd);
+void watch_process(fd_set *readset);
+void watch_run_job(int jobid);
+void watch_stats(int s);
+
+/* fair.c */
+void fair_init();
+int fair_peer_uid(int s);
+void fair_new_pass(const struct Job *first);
+int fair_admits(const struct Job *p);
+int fair_sharing();
+struct Job ** fair_head(const struct Job *p);
+struct Job * fair_pick();
+void fair_learn(const struct Job *p, const struct Result *result);
+void fair_list(int s);
+
+/* grep.c */
+void grep_outputs(int s, const char *pattern, int njobs, const int *jobids,
+        char * const *names);
@@ -0,0 +1,153 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Memory admission.
+ * With TS_MEMORY_BUDGET, the server learns the peak memory of the finished
+ * jobs, by label (or by program, for jobs without label), and only starts
+ * a job if the estimates of the running jobs and its own fit in the budget.
+ * The estimate follows a new higher peak at once, and a lower one slowly. */
+
+struct Estimate
+{
+    char *signature;
+    long bytes;
+    int samples;
+    struct Estimate *next;
+};
+
+/* Globals */
+static struct Estimate *first_estimate = 0;
+
+/* TS_MEMORY_BUDGET, as parse_size() reads it. 0 without a budget. */
+long memory_budget()
+{
+    char *str;
+    long size;
+
+    str = getenv("TS_MEMORY_BUDGET");
+    if (str == NULL)
+        return 0;
+    size = parse_size(str);
+    return size > 0 ? size : 0;
+}
+
+/* The label, or the program without arguments (malloc'ed) */
+char * job_signature(const struct Job *p)
+{
+    char *sig;
+    int len;
+
+    if (p->label != 0)
+        len = strlen(p->label);
+    else
+        len = strcspn(p->command, " ");
+    sig = (char *) malloc(len + 1);
+    if (sig == 0)
+        error("Cannot allocate memory for the job signature");
+    strncpy(sig, p->label != 0 ? p->label : p->command, len);
+    sig[len] = '\0';
+    return sig;
+}
+
+static struct Estimate * find_estimate(const char *signature)
+{
+    struct Estimate *e;
+
+    for (e = first_estimate; e != 0; e = e->next)
+        if (strcmp(e->signature, signature) == 0)
+            return e;
+    return 0;
+}
+
+/* Server side. The bytes the job is expected to take; for a kind of job
+ * never seen, the mean of the others. */
+long memory_estimate(const struct Job *p)
+{
+    struct Estimate *e;
+    char *sig;
+    long total = 0;
+    int n = 0;
+
+    sig = job_signature(p);
+    e = find_estimate(sig);
+    free(sig);
+    if (e != 0)
+        return e->bytes;
+
+    for (e = first_estimate; e != 0; e = e->next)
+    {
+        total += e->bytes;
+        ++n;
+    }
+    return n > 0 ? total / n : 0;
+}
+
+/* Server side, when the job finishes */
+void memory_learn(const struct Job *p)
+{
+    struct Estimate *e;
+    char *sig;
+    long peak;
+
+    /* The cgroup counts all the processes of the job; wait4() only the
+     * biggest one */
+    if (p->result.cgroup.memory_peak >= 0)
+        peak = p->result.cgroup.memory_peak;
+    else
+        peak = p->result.maxrss * 1024;
+    if (peak <= 0)
+        return;
+
+    sig = job_signature(p);
+    e = find_estimate(sig);
+    if (e == 0)
+    {
+        e = (struct Estimate *) malloc(sizeof(*e));
+        if (e == 0)
+            error("Cannot allocate memory for the memory estimates");
+        e->signature = sig;
+        e->bytes = peak;
+        e->samples = 0;
+        e->next = first_estimate;
+        first_estimate = e;
+    }
+    else
+        free(sig);
+
+    /* Up at once, down by a quarter of the difference */
+    if (peak > e->bytes)
+        e->bytes = peak;
+    else
+        e->bytes -= (e->bytes - peak) / 4;
+    ++e->samples;
+}
+
+/* For --stats */
+void memory_stats(int s, long used)
+{
+    struct Estimate *e;
+    char line[300];
+
+    snprintf(line, sizeof(line), "Memory budget: %ld of %ld KiB estimated "
+            "in use\n", used / 1024, memory_budget() / 1024);
+    send_list_line(s, line);
+
+    for (e = first_estimate; e != 0; e = e->next)
+    {
+        snprintf(line, sizeof(line), "  %.200s: %ld KiB (%i jobs)\n",
+                e->signature, e->bytes / 1024, e->samples);
+        send_list_line(s, line);
+    }
+}
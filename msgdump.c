@@ -24,20 +24,52 @@ void msgdump(FILE *f, const struct msg *m)
             fprintf(f, " NEWJOB_OK\n");
             fprintf(f, " JobID: '%i'\n", m->u.jobid);
             break;
+        case NEWJOB_ATTACHED:
+            fprintf(f, " NEWJOB_ATTACHED\n");
+            fprintf(f, " JobID: '%i'\n", m->u.jobid);
+            break;
         case RUNJOB:
             fprintf(f, " RUNJOB\n");
+            fprintf(f, " Output limit: %ld\n", m->u.runjob.output_limit);
+            fprintf(f, " Output rate: %ld\n", m->u.runjob.output_rate);
+            fprintf(f, " Pipe in: %i\n", m->u.runjob.pipe_in_size);
+            fprintf(f, " Pipe out: %i\n", m->u.runjob.pipe_out_size);
             break;
         case RUNJOB_OK:
             fprintf(f, " RUNJOB_OK\n");
             fprintf(f, " Outputsize: %i\n", m->u.output.ofilename_size);
             fprintf(f, " pid: %i\n", m->u.output.pid);
             break;
+        case STORED_OUTPUT:
+            fprintf(f, " STORED_OUTPUT\n");
+            fprintf(f, " Outputsize: %i\n", m->u.output.ofilename_size);
+            break;
         case ENDJOB:
             fprintf(f, " ENDJOB\n");
             break;
+        case ENDJOB_OK:
+            fprintf(f, " ENDJOB_OK\n");
+            break;
+        case RETRYJOB:
+            fprintf(f, " RETRYJOB\n");
+            fprintf(f, " Attempt: %i\n", m->u.retry.attempt);
+            fprintf(f, " Delay: %i\n", m->u.retry.delay);
+            break;
+        case BATCH_PROGRESS:
+            fprintf(f, " BATCH_PROGRESS\n");
+            fprintf(f, " Done: %i\n", m->u.batch.done);
+            fprintf(f, " Failed: %i\n", m->u.batch.failed);
+            break;
         case LIST:
             fprintf(f, " LIST\n");
             break;
+        case GET_STATS:
+            fprintf(f, " GET_STATS\n");
+            break;
+        case GREP:
+            fprintf(f, " GREP\n");
+            fprintf(f, " Patternsize: %i\n", m->u.grep.pattern_size);
+            break;
         case LIST_LINE:
             fprintf(f, " LIST_LINE\n");
             fprintf(f, " Linesize: %i\n", m->u.size);
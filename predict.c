@@ -0,0 +1,617 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Run time prediction.
+ * The server keeps the run times of the finished jobs by label, or by
+ * command (the program without its directory, the spaces collapsed), and
+ * also by program alone, for the commands never seen. Each history has an
+ * EWMA of the run times and a sketch of their distribution: a histogram of
+ * PREDICT_BUCKETS buckets, each sqrt(2) times wider than the one before
+ * from 10 ms, which gives the quantiles within a fifth. Past PREDICT_WINDOW
+ * runs the counts halve, so the sketch follows the recent runs. The
+ * histories are found by a hash of their signature, and only the
+ * TS_HISTORY_SIZE used last are kept (PREDICT_DEFAULT_SIZE by default).
+ * Each job keeps the history it found till one is added or dropped. With
+ * TS_HISTORY naming a file when starting the server, the histories last
+ * across servers; the file is written at most every PREDICT_SAVE_DELAY
+ * seconds, and on exit.
+ * The expected run time of a job is the EWMA of its command, else of its
+ * program, else the mean of all. It gives the ETA of the jobs in the list,
+ * the critical path of the dependency graphs, and with TS_SCHEDULER=sjf,
+ * the order of the queue: the shortest expected job first. */
+
+enum
+{
+    PREDICT_BUCKETS = 48,
+    PREDICT_WINDOW = 1000,
+    PREDICT_SAVE_DELAY = 10,
+    PREDICT_LINE_SIZE = 4096,
+    PREDICT_DEFAULT_SIZE = 10000,
+    PREDICT_HASH_SIZE = 4096 /* A power of two */
+};
+
+#define PREDICT_FIRST_BUCKET 0.01 /* seconds */
+#define PREDICT_RATIO 1.41421356
+#define PREDICT_ALPHA 0.25 /* Weight of a new run in the EWMA */
+
+struct History
+{
+    char *signature;
+    long runs;
+    double ewma; /* seconds */
+    float buckets[PREDICT_BUCKETS];
+    float total; /* Of the buckets */
+    struct History *hash_next; /* In its bucket of the hash */
+    struct History *prev; /* The one used after it */
+    struct History *next; /* The one used before it */
+};
+
+/* Globals */
+static struct History *first_history = 0; /* The last used first */
+static struct History *last_history = 0;
+static struct History *hash[PREDICT_HASH_SIZE];
+static const char *history_file = 0;
+static int histories = 0;
+static int history_size = PREDICT_DEFAULT_SIZE;
+static double ewma_total = 0; /* For the mean of all */
+static long generation = 0; /* Changes when a history comes or goes */
+static int dirty = 0;
+static time_t last_save = 0;
+static int sjf = 0;
+
+/* The label, or the command with the program without its directory and
+ * the spaces collapsed (malloc'ed) */
+static char * command_signature(const struct Job *p)
+{
+    const char *c;
+    const char *program_end;
+    const char *base;
+    char *sig;
+    int len = 0;
+
+    if (p->label != 0)
+        return job_signature(p);
+
+    sig = (char *) malloc(strlen(p->command) + 1);
+    if (sig == 0)
+        error("Cannot allocate memory for the job signature");
+
+    c = p->command + strspn(p->command, " \t");
+    program_end = c + strcspn(c, " \t");
+    for (base = c; c < program_end; ++c)
+        if (*c == '/')
+            base = c + 1;
+    for (c = base; *c != '\0'; ++c)
+    {
+        if (*c == ' ' || *c == '\t' || *c == '\n')
+        {
+            if (len > 0 && sig[len - 1] != ' ')
+                sig[len++] = ' ';
+        }
+        else
+            sig[len++] = *c;
+    }
+    if (len > 0 && sig[len - 1] == ' ')
+        --len;
+    sig[len] = '\0';
+    return sig;
+}
+
+static struct History ** hash_bucket(const char *signature)
+{
+    unsigned long h = 5381;
+
+    for (; *signature != '\0'; ++signature)
+        h = h * 33 ^ (unsigned char) *signature;
+    return &hash[h & (PREDICT_HASH_SIZE - 1)];
+}
+
+static struct History * find_history(const char *signature)
+{
+    struct History *h;
+
+    for (h = *hash_bucket(signature); h != 0; h = h->hash_next)
+        if (strcmp(h->signature, signature) == 0)
+            return h;
+    return 0;
+}
+
+static void unlink_history(struct History *h)
+{
+    if (h->prev != 0)
+        h->prev->next = h->next;
+    else
+        first_history = h->next;
+    if (h->next != 0)
+        h->next->prev = h->prev;
+    else
+        last_history = h->prev;
+}
+
+/* As the last used, or the first used if it comes from the file */
+static void link_history(struct History *h, int last_used)
+{
+    if (last_used)
+    {
+        h->prev = 0;
+        h->next = first_history;
+        if (first_history != 0)
+            first_history->prev = h;
+        else
+            last_history = h;
+        first_history = h;
+    }
+    else
+    {
+        h->next = 0;
+        h->prev = last_history;
+        if (last_history != 0)
+            last_history->next = h;
+        else
+            first_history = h;
+        last_history = h;
+    }
+}
+
+/* The one used the longest ago goes away */
+static void drop_history()
+{
+    struct History *h = last_history;
+    struct History **bucket;
+
+    unlink_history(h);
+    for (bucket = hash_bucket(h->signature); *bucket != h;
+            bucket = &(*bucket)->hash_next)
+        ;
+    *bucket = h->hash_next;
+    ewma_total -= h->ewma;
+    --histories;
+    free(h->signature);
+    free(h);
+}
+
+/* Takes the signature */
+static struct History * new_history(char *signature, int last_used)
+{
+    struct History **bucket;
+    struct History *h;
+    int i;
+
+    while (histories >= history_size)
+        drop_history();
+
+    h = (struct History *) malloc(sizeof(*h));
+    if (h == 0)
+        error("Cannot allocate memory for the run time history");
+    h->signature = signature;
+    h->runs = 0;
+    h->ewma = 0;
+    for (i = 0; i < PREDICT_BUCKETS; ++i)
+        h->buckets[i] = 0;
+    h->total = 0;
+    bucket = hash_bucket(signature);
+    h->hash_next = *bucket;
+    *bucket = h;
+    link_history(h, last_used);
+    ++histories;
+    ++generation;
+    return h;
+}
+
+static int bucket_of(double seconds)
+{
+    double limit = PREDICT_FIRST_BUCKET * PREDICT_RATIO;
+    int i;
+
+    for (i = 0; i < PREDICT_BUCKETS - 1 && seconds >= limit; ++i)
+        limit *= PREDICT_RATIO;
+    return i;
+}
+
+/* The geometric middle of the bucket */
+static double bucket_value(int bucket)
+{
+    double value = PREDICT_FIRST_BUCKET * 1.18920712; /* 2^(1/4) */
+    int i;
+
+    for (i = 0; i < bucket; ++i)
+        value *= PREDICT_RATIO;
+    return value;
+}
+
+/* Seconds under which the fraction q of the runs ended */
+static double quantile(const struct History *h, double q)
+{
+    float count = 0;
+    int i;
+
+    for (i = 0; i < PREDICT_BUCKETS - 1; ++i)
+    {
+        count += h->buckets[i];
+        if (count >= q * h->total)
+            break;
+    }
+    return bucket_value(i);
+}
+
+static void add_run(struct History *h, double seconds)
+{
+    int i;
+
+    ewma_total -= h->ewma;
+    if (h->runs == 0)
+        h->ewma = seconds;
+    else
+        h->ewma += PREDICT_ALPHA * (seconds - h->ewma);
+    ewma_total += h->ewma;
+    ++h->runs;
+
+    if (h->total >= PREDICT_WINDOW)
+    {
+        for (i = 0; i < PREDICT_BUCKETS; ++i)
+            h->buckets[i] /= 2;
+        h->total /= 2;
+    }
+    h->buckets[bucket_of(seconds)] += 1;
+    h->total += 1;
+}
+
+/* On start */
+void predict_init()
+{
+    char line[PREDICT_LINE_SIZE];
+    char buckets[PREDICT_LINE_SIZE];
+    char *str;
+    FILE *f;
+
+    str = getenv("TS_SCHEDULER");
+    if (str != NULL)
+    {
+        if (strcmp(str, "sjf") == 0)
+            sjf = 1;
+        else if (strcmp(str, "fifo") != 0)
+            warning("Wrong TS_SCHEDULER \"%s\". Use fifo or sjf.", str);
+    }
+    str = getenv("TS_HISTORY_SIZE");
+    if (str != NULL)
+        history_size = abs(atoi(str));
+    if (history_size < 1)
+        history_size = 1;
+
+    history_file = getenv("TS_HISTORY");
+    if (history_file == 0)
+        return;
+    f = fopen(history_file, "r");
+    if (f == NULL)
+        return;
+    /* runs ewma bucket:count,... signature */
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        struct History *h;
+        char *signature;
+        char *b;
+        long runs;
+        double ewma;
+        int pos;
+
+        if (sscanf(line, "%ld %lf %s %n", &runs, &ewma, buckets, &pos) != 3)
+            continue;
+        signature = line + pos;
+        signature[strcspn(signature, "\n")] = '\0';
+        if (*signature == '\0' || find_history(signature) != 0)
+            continue;
+        str = (char *) malloc(strlen(signature) + 1);
+        if (str == 0)
+            error("Cannot allocate memory for the run time history");
+        strcpy(str, signature);
+        h = new_history(str, 0);
+        h->runs = runs;
+        h->ewma = ewma;
+        ewma_total += ewma;
+        for (b = strtok(buckets, ","); b != 0; b = strtok(0, ","))
+        {
+            int i;
+            float count;
+
+            if (sscanf(b, "%i:%f", &i, &count) == 2 && i >= 0
+                    && i < PREDICT_BUCKETS && count > 0)
+            {
+                h->buckets[i] += count;
+                h->total += count;
+            }
+        }
+    }
+    fclose(f);
+}
+
+/* Server side. Into TS_HISTORY, if there is something new. */
+void predict_save()
+{
+    struct History *h;
+    char *tmpname;
+    FILE *f;
+
+    if (history_file == 0 || !dirty)
+        return;
+    tmpname = (char *) malloc(strlen(history_file) + 5);
+    if (tmpname == 0)
+        error("Cannot allocate memory for the history file name");
+    sprintf(tmpname, "%s.tmp", history_file);
+    f = fopen(tmpname, "w");
+    if (f == NULL)
+    {
+        warning("Cannot write the history %s", tmpname);
+        free(tmpname);
+        return;
+    }
+    for (h = first_history; h != 0; h = h->next)
+    {
+        int first = 1;
+        int i;
+
+        fprintf(f, "%ld %f ", h->runs, h->ewma);
+        for (i = 0; i < PREDICT_BUCKETS; ++i)
+            if (h->buckets[i] > 0)
+            {
+                fprintf(f, "%s%i:%g", first ? "" : ",", i, h->buckets[i]);
+                first = 0;
+            }
+        fprintf(f, "%s %s\n", first ? "-" : "", h->signature);
+    }
+    fclose(f);
+    if (rename(tmpname, history_file) == -1)
+        warning("Cannot rename the history %s", tmpname);
+    free(tmpname);
+    dirty = 0;
+    last_save = time(NULL);
+}
+
+static void learn(char *signature, double seconds)
+{
+    struct History *h;
+
+    h = find_history(signature);
+    if (h == 0)
+        h = new_history(signature, 1);
+    else
+    {
+        free(signature);
+        unlink_history(h);
+        link_history(h, 1);
+    }
+    add_run(h, seconds);
+}
+
+/* Server side, when a job that ran ends */
+void predict_learn(const struct Job *p)
+{
+    char *command;
+    char *program;
+
+    command = command_signature(p);
+    program = job_signature(p);
+    if (strcmp(command, program) != 0)
+        learn(program, p->result.real_ms);
+    else
+        free(program);
+    learn(command, p->result.real_ms);
+
+    dirty = 1;
+    if (time(NULL) - last_save >= PREDICT_SAVE_DELAY)
+        predict_save();
+}
+
+/* The history the prediction comes from, 0 if none */
+static struct History * history_of(const struct Job *p)
+{
+    struct History *h;
+    char *sig;
+
+    sig = command_signature(p);
+    h = find_history(sig);
+    free(sig);
+    if (h != 0)
+        return h;
+    sig = job_signature(p);
+    h = find_history(sig);
+    free(sig);
+    return h;
+}
+
+/* Server side. Seconds the job is expected to run; -1 if no job ran yet. */
+double predict_runtime(struct Job *p)
+{
+    if (p->history_generation != generation)
+    {
+        p->history = history_of(p);
+        p->history_generation = generation;
+    }
+    if (p->history != 0)
+        return p->history->ewma;
+    return histories > 0 ? ewma_total / histories : -1;
+}
+
+/* Whether TS_SCHEDULER=sjf */
+int predict_sjf()
+{
+    return sjf;
+}
+
+static int shorter_first(const void *a, const void *b)
+{
+    const struct Job *ja = *(const struct Job * const *) a;
+    const struct Job *jb = *(const struct Job * const *) b;
+
+    if (ja->estimate != jb->estimate)
+        return ja->estimate < jb->estimate ? -1 : 1;
+    /* In the order of the queue, as qsort is not stable */
+    return ja->jobid - jb->jobid;
+}
+
+/* The slots, ordered by the time they get free */
+static void sort_slots(double *slots, int n)
+{
+    int i, j;
+
+    for (i = 1; i < n; ++i)
+        for (j = i; j > 0 && slots[j] < slots[j - 1]; --j)
+        {
+            double tmp = slots[j];
+            slots[j] = slots[j - 1];
+            slots[j - 1] = tmp;
+        }
+}
+
+/* Takes the k slots free first from start on, until end */
+static double take_slots(double *slots, int n, int k, double start,
+        double runtime)
+{
+    double end;
+    int i;
+
+    sort_slots(slots, n);
+    if (k > n)
+        k = n;
+    if (k < 1)
+        k = 1;
+    if (slots[k - 1] > start)
+        start = slots[k - 1];
+    end = start + runtime;
+    for (i = 0; i < k; ++i)
+        slots[i] = end;
+    return end;
+}
+
+/* The ETA of a queued job, after those of the queued jobs it depends on */
+static void queued_eta(struct Job *first, struct Job *p, double *slots,
+        int nslots)
+{
+    struct Job *parent;
+    double start = 0;
+    int j;
+
+    /* Not -1 anymore, so a cycle of dependencies ends here */
+    p->eta = 0;
+    for (j = 0; j < p->depends_size; ++j)
+    {
+        if (p->depends[j].finished)
+            continue;
+        for (parent = first; parent != 0; parent = parent->next)
+            if (parent->jobid == p->depends[j].jobid)
+                break;
+        if (parent == 0)
+            continue;
+        if (parent->state == QUEUED && parent->eta == -1)
+            queued_eta(first, parent, slots, nslots);
+        if (parent->eta > start)
+            start = parent->eta;
+    }
+    /* Far in time, it would hold the slots of those before it */
+    if (p->delayed)
+    {
+        if (p->fire_time - time(NULL) > start)
+            start = p->fire_time - time(NULL);
+        p->eta = start + (p->estimate > 0 ? p->estimate : 0);
+        return;
+    }
+    p->eta = take_slots(slots, nslots, p->num_slots, start,
+            p->estimate > 0 ? p->estimate : 0);
+}
+
+/* Server side, for the list. In p->eta, the seconds until each running or
+ * queued job is expected to end, as if the queued ones ran in the order of
+ * the queue (or the shortest first, with sjf) on the slots, each after the
+ * jobs it depends on, which take their slots first. A delayed job starts
+ * at its time, out of the slots. -1 if nothing ran yet. */
+void predict_etas(struct Job *first, int max_slots)
+{
+    struct Job **queued;
+    struct Job *p;
+    double *slots;
+    int nslots;
+    int n = 0;
+    int i;
+
+    for (p = first; p != 0; p = p->next)
+    {
+        p->eta = -1;
+        if (p->state == QUEUED)
+            ++n;
+    }
+    if (first_history == 0)
+        return;
+
+    nslots = max_slots > 0 ? max_slots : 1;
+    slots = (double *) malloc(nslots * sizeof(double));
+    queued = (struct Job **) malloc((n + 1) * sizeof(*queued));
+    if (slots == 0 || queued == 0)
+        error("Cannot allocate memory for the ETA");
+    for (i = 0; i < nslots; ++i)
+        slots[i] = 0;
+
+    /* What is left of the running ones */
+    n = 0;
+    for (p = first; p != 0; p = p->next)
+    {
+        if (p->state == RUNNING)
+        {
+            double left;
+
+            left = p->estimate - pinfo_time_until_now(&p->info)
+                + pinfo_time_suspended(&p->info);
+            p->eta = take_slots(slots, nslots, p->num_slots, 0,
+                    left > 0 ? left : 0);
+        }
+        else if (p->state == QUEUED)
+            queued[n++] = p;
+    }
+    if (sjf)
+        qsort(queued, n, sizeof(*queued), shorter_first);
+
+    for (i = 0; i < n; ++i)
+        if (queued[i]->eta == -1)
+            queued_eta(first, queued[i], slots, nslots);
+    free(queued);
+    free(slots);
+}
+
+/* For -i */
+void predict_info(int s, const struct Job *p)
+{
+    const struct History *h;
+
+    if (p->estimate < 0)
+        return;
+    h = history_of(p);
+    if (h == 0)
+        fd_nprintf(s, 100, "Expected run time: %fs, the mean of all\n",
+                p->estimate);
+    else
+        fd_nprintf(s, 200, "Expected run time: %fs, median %fs, 90%% under "
+                "%fs, after %ld runs\n", p->estimate, quantile(h, 0.5),
+                quantile(h, 0.9), h->runs);
+}
+
+/* For --stats */
+void predict_stats(int s)
+{
+    char line[200];
+
+    snprintf(line, sizeof(line), "Run time history: %i signatures%s%s\n",
+            histories, history_file != 0 ? ", kept" : "",
+            sjf ? "; shortest expected job first" : "");
+    send_list_line(s, line);
+}
@@ -0,0 +1,236 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Start rate.
+ * With TS_START_RATE="rate[:burst]" when starting the server, jobs start at
+ * most at rate per second, with bursts of up to burst jobs (the rate, by
+ * default). TS_LABEL_START_RATE="label=rate[:burst],..." does the same for
+ * the jobs of each label, apart from the global limit. Each limit is a
+ * token bucket: a job starts only if its buckets have a token, and takes
+ * it. When a job waits for tokens, the server sleeps until the next one. */
+
+struct Bucket
+{
+    char *label; /* 0 for the global bucket */
+    double rate; /* tokens per second */
+    double burst;
+    double tokens;
+    struct timeval last; /* of the refill */
+    long started;
+    struct Bucket *next;
+};
+
+/* Globals */
+static struct Bucket *global = 0;
+static struct Bucket *first_label = 0;
+/* Seconds until the first token a job waits for; -1 if none waits */
+static double wait = -1;
+
+static double seconds_since(const struct timeval *tv)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - tv->tv_sec) + (now.tv_usec - tv->tv_usec) / 1e6;
+}
+
+/* "rate[:burst]" into a new bucket. Returns 0 if wrong. */
+static struct Bucket * new_bucket(const char *str, const char *label,
+        int label_len)
+{
+    struct Bucket *b;
+    double rate, burst;
+    char *end;
+
+    rate = strtod(str, &end);
+    if (end == str || rate <= 0)
+        return 0;
+    burst = rate < 1 ? 1 : rate;
+    if (*end == ':')
+    {
+        str = end + 1;
+        burst = strtod(str, &end);
+        if (end == str || burst < 1)
+            return 0;
+    }
+    if (*end != '\0' && *end != ',')
+        return 0;
+
+    b = (struct Bucket *) malloc(sizeof(*b));
+    if (b == 0)
+        error("Cannot allocate memory for the start rate");
+    b->label = 0;
+    if (label != 0)
+    {
+        b->label = (char *) malloc(label_len + 1);
+        if (b->label == 0)
+            error("Cannot allocate memory for the start rate");
+        strncpy(b->label, label, label_len);
+        b->label[label_len] = '\0';
+    }
+    b->rate = rate;
+    b->burst = burst;
+    b->tokens = burst;
+    gettimeofday(&b->last, NULL);
+    b->started = 0;
+    b->next = 0;
+    return b;
+}
+
+/* Server side, on start */
+void rate_init()
+{
+    char *str;
+
+    str = getenv("TS_START_RATE");
+    if (str != NULL)
+    {
+        global = new_bucket(str, 0, 0);
+        if (global == 0)
+            warning("Wrong TS_START_RATE \"%s\". Use rate[:burst].", str);
+    }
+
+    str = getenv("TS_LABEL_START_RATE");
+    while (str != NULL && *str != '\0')
+    {
+        struct Bucket *b = 0;
+        int len;
+
+        len = strcspn(str, "=,");
+        if (str[len] == '=' && len > 0)
+            b = new_bucket(str + len + 1, str, len);
+        if (b == 0)
+        {
+            warning("Wrong TS_LABEL_START_RATE at \"%s\". Use "
+                    "label=rate[:burst],...", str);
+            return;
+        }
+        b->next = first_label;
+        first_label = b;
+        str = strchr(str + len + 1, ',');
+        if (str != NULL)
+            ++str;
+    }
+}
+
+static struct Bucket * label_bucket(const char *label)
+{
+    struct Bucket *b;
+
+    if (label == 0)
+        return 0;
+    for (b = first_label; b != 0; b = b->next)
+        if (strcmp(b->label, label) == 0)
+            return b;
+    return 0;
+}
+
+static void refill(struct Bucket *b)
+{
+    b->tokens += seconds_since(&b->last) * b->rate;
+    if (b->tokens > b->burst)
+        b->tokens = b->burst;
+    gettimeofday(&b->last, NULL);
+}
+
+/* Whether the bucket has a token; if not, when it will */
+static int has_token(struct Bucket *b)
+{
+    double left;
+
+    refill(b);
+    if (b->tokens >= 1)
+        return 1;
+    left = (1 - b->tokens) / b->rate;
+    if (wait < 0 || left < wait)
+        wait = left;
+    return 0;
+}
+
+/* Server side, before looking for a job to run */
+void rate_new_pass()
+{
+    wait = -1;
+}
+
+/* Server side. Whether the job can start now. Both buckets are checked,
+ * to know when to wake up. */
+int rate_admits(const struct Job *p)
+{
+    struct Bucket *b;
+    int ok = 1;
+
+    if (global != 0 && !has_token(global))
+        ok = 0;
+    b = label_bucket(p->label);
+    if (b != 0 && !has_token(b))
+        ok = 0;
+    return ok;
+}
+
+/* Server side, when the job starts */
+void rate_take(const struct Job *p)
+{
+    struct Bucket *b;
+
+    if (global != 0)
+    {
+        global->tokens -= 1;
+        ++global->started;
+    }
+    b = label_bucket(p->label);
+    if (b != 0)
+    {
+        b->tokens -= 1;
+        ++b->started;
+    }
+}
+
+/* Milliseconds until a waiting job may get its tokens, -1 if none waits */
+int rate_timeout()
+{
+    if (wait < 0)
+        return -1;
+    /* Rounded up, not to wake up just before the token */
+    return (int) (wait * 1000) + 1;
+}
+
+static void send_bucket(int s, const struct Bucket *b)
+{
+    char line[300];
+
+    snprintf(line, sizeof(line), "Start rate%s%.200s: %g/s, burst %g, "
+            "%.1f tokens, %ld jobs started\n",
+            b->label ? " of " : "", b->label ? b->label : "", b->rate,
+            b->burst, b->tokens, b->started);
+    send_list_line(s, line);
+}
+
+/* For --stats */
+void rate_stats(int s)
+{
+    struct Bucket *b;
+
+    if (global != 0)
+    {
+        refill(global);
+        send_bucket(s, global);
+    }
+    for (b = first_label; b != 0; b = b->next)
+    {
+        refill(b);
+        send_bucket(s, b);
+    }
+}
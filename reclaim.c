@@ -0,0 +1,299 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Reclaimer.
+ * Removing output files may take long on slow filesystems, so the server
+ * doesn't do it: it writes the names, one per line, to a child process
+ * which unlinks them (or releases them from the output store). After each
+ * batch, the child answers with what it did, as "files bytes\n". */
+
+struct Pending
+{
+    char *line;
+    struct Pending *next;
+};
+
+/* Globals */
+static int reclaimer_pid = 0;
+static int to_reclaimer = -1;
+static int from_reclaimer = -1;
+static struct Pending *first_pending = 0;
+static struct Pending *last_pending = 0;
+static int pending_count = 0;
+
+static long reclaimed_files = 0;
+static long reclaimed_bytes = 0;
+
+/* Partial answer line from the reclaimer */
+static char answer[100];
+static int answer_used = 0;
+
+/* Returns the size of what was given back */
+static long reclaim_one(const char *name)
+{
+    struct stat st;
+    long bytes = 0;
+    char *errname;
+    char *idxname;
+
+    /* The line index of TS_INDEX_LINES */
+    idxname = index_path(name);
+    if (stat(idxname, &st) == 0 && unlink(idxname) == 0)
+        bytes += st.st_size;
+    free(idxname);
+
+    if (store_is_virtual(name))
+        return bytes + store_release(name);
+
+    if (stat(name, &st) == 0 && unlink(name) == 0)
+        bytes += st.st_size;
+
+    /* The stderr of -E */
+    errname = (char *) malloc(strlen(name) + 3);
+    if (errname == 0)
+        return bytes;
+    sprintf(errname, "%s.e", name);
+    if (stat(errname, &st) == 0 && unlink(errname) == 0)
+        bytes += st.st_size;
+    free(errname);
+
+    return bytes;
+}
+
+static void reclaimer_main(int in, int out)
+{
+    char buf[8192];
+    int used = 0;
+    long files = 0;
+    long bytes = 0;
+
+    while (1)
+    {
+        int res;
+        char *start;
+        char *nl;
+
+        res = read(in, buf + used, sizeof(buf) - used);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        used += res;
+
+        start = buf;
+        while ((nl = memchr(start, '\n', used - (start - buf))) != 0)
+        {
+            *nl = '\0';
+            bytes += reclaim_one(start);
+            ++files;
+            start = nl + 1;
+        }
+        used -= start - buf;
+        memmove(buf, start, used);
+        /* A name longer than the buffer cannot come from the server */
+        if (used == sizeof(buf))
+            used = 0;
+
+        fd_nprintf(out, 60, "%ld %ld\n", files, bytes);
+        files = 0;
+        bytes = 0;
+    }
+    exit(0);
+}
+
+static int start_reclaimer()
+{
+    int p_in[2], p_out[2];
+    int fd;
+
+    if (pipe(p_in) == -1)
+        return -1;
+    if (pipe(p_out) == -1)
+    {
+        close(p_in[0]);
+        close(p_in[1]);
+        return -1;
+    }
+
+    reclaimer_pid = fork();
+    switch (reclaimer_pid)
+    {
+        case 0:
+            /* Don't keep any client connection alive */
+            for (fd = 3; fd < FD_SETSIZE; ++fd)
+                if (fd != p_in[0] && fd != p_out[1])
+                    close(fd);
+            signal(SIGTERM, SIG_DFL);
+            reclaimer_main(p_in[0], p_out[1]);
+            exit(0);
+        case -1:
+            warning("Cannot fork the reclaimer");
+            reclaimer_pid = 0;
+            close(p_in[0]);
+            close(p_in[1]);
+            close(p_out[0]);
+            close(p_out[1]);
+            return -1;
+        default:
+            close(p_in[0]);
+            close(p_out[1]);
+    }
+
+    to_reclaimer = p_in[1];
+    from_reclaimer = p_out[0];
+    fcntl(to_reclaimer, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+static void stop_reclaimer()
+{
+    close(to_reclaimer);
+    close(from_reclaimer);
+    to_reclaimer = -1;
+    from_reclaimer = -1;
+    answer_used = 0;
+    waitpid(reclaimer_pid, 0, WNOHANG);
+    reclaimer_pid = 0;
+}
+
+/* Writes what fits in the pipe. Each line is shorter than PIPE_BUF,
+ * so it goes whole or not at all. */
+static void flush_pending()
+{
+    while (first_pending != 0)
+    {
+        struct Pending *p = first_pending;
+        int res;
+
+        res = write(to_reclaimer, p->line, strlen(p->line));
+        if (res == -1)
+        {
+            if (errno == EPIPE)
+            {
+                warning("The reclaimer died; starting it again later");
+                stop_reclaimer();
+            }
+            return;
+        }
+        first_pending = p->next;
+        if (first_pending == 0)
+            last_pending = 0;
+        --pending_count;
+        free(p->line);
+        free(p);
+    }
+}
+
+/* Queue the output file for removal, off the server loop */
+void reclaim_output(const char *name)
+{
+    struct Pending *p;
+
+    if (name == 0 || strchr(name, '\n') != 0)
+        return;
+
+    p = (struct Pending *) malloc(sizeof(*p));
+    if (p == 0)
+        error("Cannot allocate memory for the reclaim queue");
+    p->line = (char *) malloc(strlen(name) + 2);
+    if (p->line == 0)
+        error("Cannot allocate memory for the reclaim queue");
+    sprintf(p->line, "%s\n", name);
+    p->next = 0;
+    if (last_pending)
+        last_pending->next = p;
+    else
+        first_pending = p;
+    last_pending = p;
+    ++pending_count;
+
+    if (reclaimer_pid == 0 && start_reclaimer() == -1)
+        return;
+    flush_pending();
+}
+
+/* Add the descriptors the server loop has to wait for. Returns maxfd. */
+int reclaim_fdset(fd_set *readset, fd_set *writeset, int maxfd)
+{
+    if (reclaimer_pid == 0)
+        return maxfd;
+
+    FD_SET(from_reclaimer, readset);
+    if (from_reclaimer > maxfd)
+        maxfd = from_reclaimer;
+    if (first_pending != 0)
+    {
+        FD_SET(to_reclaimer, writeset);
+        if (to_reclaimer > maxfd)
+            maxfd = to_reclaimer;
+    }
+    return maxfd;
+}
+
+void reclaim_process(fd_set *readset, fd_set *writeset)
+{
+    if (reclaimer_pid == 0)
+        return;
+
+    if (FD_ISSET(from_reclaimer, readset))
+    {
+        int res;
+        char *start;
+        char *nl;
+
+        res = read(from_reclaimer, answer + answer_used,
+                sizeof(answer) - 1 - answer_used);
+        if (res <= 0)
+        {
+            stop_reclaimer();
+            return;
+        }
+        answer_used += res;
+        answer[answer_used] = '\0';
+
+        start = answer;
+        while ((nl = strchr(start, '\n')) != 0)
+        {
+            long files, bytes;
+            *nl = '\0';
+            if (sscanf(start, "%ld %ld", &files, &bytes) == 2)
+            {
+                reclaimed_files += files;
+                reclaimed_bytes += bytes;
+            }
+            start = nl + 1;
+        }
+        answer_used -= start - answer;
+        memmove(answer, start, answer_used);
+        if (answer_used == sizeof(answer) - 1)
+            answer_used = 0;
+    }
+
+    if (to_reclaimer != -1 && FD_ISSET(to_reclaimer, writeset))
+        flush_pending();
+}
+
+void reclaim_stats(long *files, long *bytes, int *pending)
+{
+    *files = reclaimed_files;
+    *bytes = reclaimed_bytes;
+    *pending = pending_count;
+}
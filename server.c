@@ -45,6 +45,8 @@ static void end_server(int ls);
 static void s_newjob_ok(int index);
 static void s_newjob_nok(int index);
 static void s_runjob(int jobid, int index);
+static void s_watch(int s, const struct msg *m, int uid);
+static void s_unwatch(int s, int id);
 static void clean_after_client_disappeared(int socket, int index);
 
 struct Client_conn
@@ -52,6 +54,7 @@ struct Client_conn
     int socket;
     int hasjob;
     int jobid;
+    int uid; /* Of the client */
 };
 
 /* Globals */
@@ -92,6 +95,9 @@ static void sigterm_handler(int n)
                     dumpfilename);
     }
 
+    s_continue_suspended();
+    predict_save();
+
     /* path will be initialized for sure, before installing the handler */
     unlink(path);
     exit(1);
@@ -204,6 +210,14 @@ void server_main(int notify_fd, char *_path)
     install_sigterm_handler();
 
     set_default_maxslots();
+    adapt_init();
+    affinity_init();
+    rate_init();
+    aimd_init();
+    cache_init();
+    predict_init();
+    watch_init();
+    fair_init();
 
     notify_parent(notify_fd);
 
@@ -222,14 +236,19 @@ static int get_conn_of_jobid(int jobid)
 static void server_loop(int ls)
 {
     fd_set readset;
+    fd_set writeset;
     int i;
     int maxfd;
     int keep_loop = 1;
     int newjob;
+    int timeout;
+    int rate_timeout_ms;
+    int res;
 
     while (keep_loop)
     {
         FD_ZERO(&readset);
+        FD_ZERO(&writeset);
         maxfd = 0;
         /* If we can accept more connections, go on.
          * Otherwise, the system block them (no accept will be done). */
@@ -244,7 +263,48 @@ static void server_loop(int ls)
             if (client_cs[i].socket > maxfd)
                 maxfd = client_cs[i].socket;
         }
-        select(maxfd + 1, &readset, NULL, NULL, NULL);
+        maxfd = reclaim_fdset(&readset, &writeset, maxfd);
+        maxfd = watch_fdset(&readset, maxfd);
+
+        /* Only wake up on time if some output has to be reclaimed by age,
+         * for the adaptive slots, for the job timers, or for a job waiting
+         * for the start rate */
+        timeout = s_retention_timeout();
+        if (adapt_timeout() >= 0
+                && (timeout < 0 || adapt_timeout() < timeout))
+            timeout = adapt_timeout();
+        if (timer_timeout() >= 0
+                && (timeout < 0 || timer_timeout() < timeout))
+            timeout = timer_timeout();
+        /* In milliseconds, for the start rate */
+        rate_timeout_ms = rate_timeout();
+        if (rate_timeout_ms >= 0
+                && (timeout < 0 || rate_timeout_ms < timeout * 1000L))
+        {
+            struct timeval tv;
+            tv.tv_sec = rate_timeout_ms / 1000;
+            tv.tv_usec = (rate_timeout_ms % 1000) * 1000;
+            res = select(maxfd + 1, &readset, &writeset, NULL, &tv);
+        }
+        else if (timeout >= 0)
+        {
+            struct timeval tv;
+            tv.tv_sec = timeout;
+            tv.tv_usec = 0;
+            res = select(maxfd + 1, &readset, &writeset, NULL, &tv);
+        }
+        else
+            res = select(maxfd + 1, &readset, &writeset, NULL, NULL);
+        adapt_check();
+        timer_run();
+        /* On timeout, the sets are empty; go on, as the slots may
+         * have grown */
+        if (res == 0)
+            s_apply_retention();
+        else if (res == -1)
+            continue;
+        reclaim_process(&readset, &writeset);
+        watch_process(&readset);
         if (FD_ISSET(ls,&readset))
         {
             int cs;
@@ -253,6 +313,7 @@ static void server_loop(int ls)
                 error("Accepting from %i", ls);
             client_cs[nconnections].hasjob = 0;
             client_cs[nconnections].socket = cs;
+            client_cs[nconnections].uid = fair_peer_uid(cs);
             ++nconnections;
         }
         for(i=0; i< nconnections; ++i)
@@ -279,7 +340,12 @@ static void server_loop(int ls)
             conn = get_conn_of_jobid(newjob);
             /* This next marks the firstjob state to RUNNING */
             s_mark_job_running(newjob);
-            s_runjob(newjob, conn);
+            /* A job of a watch has no client: the one forked for it
+             * will take it */
+            if (conn == -1)
+                watch_run_job(newjob);
+            else
+                s_runjob(newjob, conn);
 
             while ((awaken_job = wake_hold_client()) != -1)
             {
@@ -291,6 +357,8 @@ static void server_loop(int ls)
         }
     }
 
+    s_continue_suspended();
+    predict_save();
     end_server(ls);
 }
 
@@ -328,13 +396,10 @@ clean_after_client_disappeared(int socket, int index)
     {
         struct Result r;
 
+        clear_result(&r);
         r.errorlevel = -1;
         r.died_by_signal = 1;
         r.signal = SIGKILL;
-        r.user_ms = 0;
-        r.system_ms = 0;
-        r.real_ms = 0;
-        r.skipped = 0;
 
         warning("JobID %i quit while running.", jobid);
         job_finished(&r, jobid);
@@ -384,7 +449,19 @@ static enum Break
             return BREAK; /* break in the parent*/
             break;
         case NEWJOB:
-            client_cs[index].jobid = s_newjob(s, &m);
+            {
+                int attached;
+                int jobid;
+
+                jobid = s_newjob(s, &m, client_cs[index].uid, &attached);
+                if (attached)
+                {
+                    /* Then it is only a waiter of the job */
+                    s_newjob_attached(s, jobid);
+                    break;
+                }
+                client_cs[index].jobid = jobid;
+            }
             client_cs[index].hasjob = 1;
             if (!job_is_holding_client(client_cs[index].jobid))
                 s_newjob_ok(index);
@@ -407,11 +484,24 @@ static enum Break
                         error("Reading the ofilename");
                 }
                 s_process_runjob_ok(client_cs[index].jobid, buffer,
-                        m.u.output.pid);
+                        m.u.output.pid, &m.u.output.exec_time);
+            }
+            break;
+        case BATCH_PROGRESS:
+            s_batch_progress(client_cs[index].jobid, &m.u.batch);
+            break;
+        case STORED_OUTPUT:
+            {
+                char *buffer;
+                buffer = (char *) malloc(m.u.output.ofilename_size);
+                res = recv_bytes(s, buffer, m.u.output.ofilename_size);
+                if (res != m.u.output.ofilename_size)
+                    error("Reading the stored output name");
+                s_process_stored_output(client_cs[index].jobid, buffer);
             }
             break;
         case LIST:
-            s_list(s);
+            s_list(s, m.u.list_format);
             /* We must actively close, meaning End of Lines */
             close(s);
             remove_connection(index);
@@ -421,7 +511,38 @@ static enum Break
             close(s);
             remove_connection(index);
             break;
+        case GET_STATS:
+            s_send_stats(s);
+            close(s);
+            remove_connection(index);
+            break;
+        case GREP:
+            {
+                char *pattern;
+                char *label = 0;
+                pattern = (char *) malloc(m.u.grep.pattern_size);
+                res = recv_bytes(s, pattern, m.u.grep.pattern_size);
+                if (res != m.u.grep.pattern_size)
+                    error("Reading the grep pattern");
+                if (m.u.grep.label_size > 0)
+                {
+                    label = (char *) malloc(m.u.grep.label_size);
+                    res = recv_bytes(s, label, m.u.grep.label_size);
+                    if (res != m.u.grep.label_size)
+                        error("Reading the grep label");
+                }
+                s_grep(s, &m, pattern, label);
+                free(pattern);
+                free(label);
+            }
+            /* The grep process answers; we are done with it */
+            close(s);
+            remove_connection(index);
+            break;
         case ENDJOB:
+            /* Then the client waits for the same job to run again */
+            if (s_retry_job(s, &m.u.result, client_cs[index].jobid))
+                break;
             job_finished(&m.u.result, client_cs[index].jobid);
             /* For the dependencies */
             check_notify_list(client_cs[index].jobid);
@@ -475,6 +596,8 @@ static enum Break
             break;
         case GET_MAX_SLOTS:
             s_get_max_slots(s);
+            close(s);
+            remove_connection(index);
             break;
         case SWAP_JOBS:
             s_swap_jobs(s, m.u.swap.jobid1,
@@ -486,6 +609,29 @@ static enum Break
         case GET_VERSION:
             s_send_version(s);
             break;
+        case WATCH:
+            s_watch(s, &m, client_cs[index].uid);
+            close(s);
+            remove_connection(index);
+            break;
+        case UNWATCH:
+            s_unwatch(s, m.u.jobid);
+            close(s);
+            remove_connection(index);
+            break;
+        case TAKEJOB:
+            /* The client forked by watch_run_job(). The job may have gone
+             * meanwhile. */
+            if (!job_is_running(m.u.jobid))
+            {
+                close(s);
+                remove_connection(index);
+                break;
+            }
+            client_cs[index].jobid = m.u.jobid;
+            client_cs[index].hasjob = 1;
+            s_runjob(m.u.jobid, index);
+            break;
         default:
             /* Command not supported */
             /* On unknown message, we close the client,
@@ -497,6 +643,76 @@ static enum Break
     return NOBREAK; /* normal */
 }
 
+static void send_watch_ok(int s, int id)
+{
+    struct msg m;
+
+    m.type = WATCH_OK;
+    m.u.jobid = id;
+    send_msg(s, &m);
+}
+
+/* Reads the strings of the rule, each one of 'size' bytes, 0 if none */
+static char * recv_watch_string(int s, int size)
+{
+    char *str;
+
+    if (size <= 0)
+        return 0;
+    str = (char *) malloc(size);
+    if (str == 0)
+        error("Cannot allocate memory for the watch rule");
+    if (recv_bytes(s, str, size) != size)
+        error("Reading the watch rule");
+    str[size - 1] = '\0';
+    return str;
+}
+
+static void s_watch(int s, const struct msg *m, int uid)
+{
+    char *dir, *glob, *label, *args;
+    char line[300];
+    int id;
+
+    dir = recv_watch_string(s, m->u.watch.dir_size);
+    glob = recv_watch_string(s, m->u.watch.glob_size);
+    label = recv_watch_string(s, m->u.watch.label_size);
+    args = recv_watch_string(s, m->u.watch.args_size);
+
+    if (dir == 0 || args == 0)
+        send_list_line(s, "Wrong watch rule.\n");
+    else
+    {
+        id = watch_add(dir, glob, label, m->u.watch.num_slots, args,
+                m->u.watch.args_size, uid);
+        if (id == -1)
+        {
+            snprintf(line, sizeof(line), "Cannot watch %.200s: %s.\n", dir,
+                    strerror(errno));
+            send_list_line(s, line);
+        }
+        else
+            send_watch_ok(s, id);
+    }
+    free(dir);
+    free(glob);
+    free(label);
+    free(args);
+}
+
+static void s_unwatch(int s, int id)
+{
+    char line[100];
+
+    if (watch_remove(id))
+        send_watch_ok(s, id);
+    else
+    {
+        snprintf(line, sizeof(line), "Watch %i not found.\n", id);
+        send_list_line(s, line);
+    }
+}
+
 static void s_runjob(int jobid, int index)
 {
     int s;
@@ -546,6 +762,7 @@ static void dump_conn_struct(FILE *out, const struct Client_conn *p)
     fprintf(out, "    socket %i\n", p->socket);
     fprintf(out, "    hasjob \"%i\"\n", p->hasjob);
     fprintf(out, "    jobid %i\n", p->jobid);
+    fprintf(out, "    uid %i\n", p->uid);
 }
 
 void dump_conns_struct(FILE *out)
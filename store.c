@@ -0,0 +1,559 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+/* The hole punching flags are a linux extension */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Segment store.
+ * Instead of one ts-out.XXXXXX per job, the outputs are appended into big
+ * segment files in $TS_OUTPUT_STORE. While the job runs, it writes into a
+ * spool file there (so -t and -c work as usual). When it ends, the client
+ * appends the spool to the current segment, removes the spool, and
+ * the job output becomes a virtual name:
+ *     <dir>/ts-seg.000001@<offset>+<length>
+ * Every extent starts aligned to STORE_ALIGN, so the server can punch
+ * the blocks of cleared jobs out of the segment without touching others.
+ * The bytes released of each segment are kept in <segment>.dead, so a
+ * segment emptied across server restarts is still removed. */
+
+enum
+{
+    STORE_ALIGN = 4096,
+    STORE_DEFAULT_SEGMENT_SIZE = 64 * 1024 * 1024
+};
+
+static const char seg_prefix[] = "ts-seg.";
+
+/* Server side, segments where some extent was released */
+static int segments_scanned = 0;
+
+struct Segment
+{
+    char *path;
+    long dead;
+    struct Segment *next;
+};
+
+static struct Segment *first_segment = 0;
+
+static long align_up(long n)
+{
+    return (n + STORE_ALIGN - 1) / STORE_ALIGN * STORE_ALIGN;
+}
+
+/* Returns 0 if the store is not in use */
+const char * store_directory()
+{
+    const char *dir;
+
+    dir = getenv("TS_OUTPUT_STORE");
+    if (dir == NULL || dir[0] == '\0')
+        return 0;
+    return dir;
+}
+
+static long max_segment_size()
+{
+    char *str;
+    long size;
+
+    str = getenv("TS_SEGMENT_SIZE");
+    if (str == NULL)
+        return STORE_DEFAULT_SEGMENT_SIZE;
+    size = atol(str);
+    if (size < STORE_ALIGN)
+        size = STORE_ALIGN;
+    return size;
+}
+
+int store_is_virtual(const char *name)
+{
+    const char *base;
+
+    if (name == 0)
+        return 0;
+    base = strrchr(name, '/');
+    base = (base == 0) ? name : base + 1;
+    return strncmp(base, seg_prefix, sizeof(seg_prefix) - 1) == 0
+        && strchr(base, '@') != 0;
+}
+
+/* Fills segpath (malloc'ed), offset and length. Returns 0 if wrong. */
+static int parse_virtual(const char *name, char **segpath, long *offset,
+        long *length)
+{
+    const char *at;
+    int res;
+
+    at = strrchr(name, '@');
+    if (at == 0)
+        return 0;
+
+    res = sscanf(at + 1, "%ld+%ld", offset, length);
+    if (res != 2 || *offset < 0 || *length < 0)
+        return 0;
+
+    *segpath = (char *) malloc(at - name + 1);
+    if (*segpath == 0)
+        error("Cannot allocate memory for the segment name");
+    strncpy(*segpath, name, at - name);
+    (*segpath)[at - name] = '\0';
+    return 1;
+}
+
+static char * segment_path(const char *dir, int number)
+{
+    char *path;
+    int size;
+
+    size = strlen(dir) + 1 + sizeof(seg_prefix) + 20;
+    path = (char *) malloc(size);
+    if (path == 0)
+        error("Cannot allocate memory for the segment path");
+    snprintf(path, size, "%s/%s%06i", dir, seg_prefix, number);
+    return path;
+}
+
+static int segment_number(const char *segpath)
+{
+    const char *base;
+
+    base = strrchr(segpath, '/');
+    base = (base == 0) ? segpath : base + 1;
+    return atoi(base + sizeof(seg_prefix) - 1);
+}
+
+/* The .idx or .dead file of the segment. Malloc'ed. */
+static char * segment_file(const char *segpath, const char *suffix)
+{
+    char *path;
+
+    path = (char *) malloc(strlen(segpath) + strlen(suffix) + 1);
+    if (path == 0)
+        error("Cannot allocate memory for the segment file path");
+    sprintf(path, "%s%s", segpath, suffix);
+    return path;
+}
+
+/* The lock file holds the number of the segment being appended */
+static int open_lockfile(const char *dir)
+{
+    char *path;
+    int size;
+    int fd;
+
+    size = strlen(dir) + 1 + sizeof(seg_prefix) + 5;
+    path = (char *) malloc(size);
+    if (path == 0)
+        error("Cannot allocate memory for the store lock path");
+    snprintf(path, size, "%s/%slock", dir, seg_prefix);
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    free(path);
+    return fd;
+}
+
+static int lock_store(int fd, int wait)
+{
+    struct flock fl;
+
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 0;
+    return fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl);
+}
+
+static int read_current_segment(int lockfd)
+{
+    char buf[20];
+    int res;
+
+    res = pread(lockfd, buf, sizeof(buf) - 1, 0);
+    if (res <= 0)
+        return 1;
+    buf[res] = '\0';
+    res = atoi(buf);
+    return res > 0 ? res : 1;
+}
+
+static void write_current_segment(int lockfd, int number)
+{
+    char buf[20];
+    int len;
+
+    len = sprintf(buf, "%i\n", number);
+    if (ftruncate(lockfd, 0) == -1 || pwrite(lockfd, buf, len, 0) != len)
+        warning("Cannot update the store lock file");
+}
+
+static void append_index(const char *segpath, int jobid, long offset,
+        long length)
+{
+    char *path;
+    int fd;
+
+    path = segment_file(segpath, ".idx");
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    free(path);
+    if (fd == -1)
+        return;
+    fd_nprintf(fd, 60, "%i %ld %ld\n", jobid, offset, length);
+    close(fd);
+}
+
+/* Copies the whole spool file at offset of segfd.
+ * Returns the bytes copied, or -1 on error */
+static long copy_spool(int segfd, long offset, const char *spoolname)
+{
+    char buf[16384];
+    int spoolfd;
+    long total = 0;
+    int res;
+
+    spoolfd = open(spoolname, O_RDONLY);
+    if (spoolfd == -1)
+        return -1;
+
+    while ((res = read(spoolfd, buf, sizeof(buf))) != 0)
+    {
+        int done = 0;
+        if (res == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            close(spoolfd);
+            return -1;
+        }
+        while (done < res)
+        {
+            int w;
+            w = pwrite(segfd, buf + done, res - done, offset + total + done);
+            if (w == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                close(spoolfd);
+                return -1;
+            }
+            done += w;
+        }
+        total += res;
+    }
+    close(spoolfd);
+    return total;
+}
+
+/* Client side. Moves the spool file into the current segment.
+ * Returns the virtual name (malloc'ed), or 0 if the spool
+ * has to stay as the output file. */
+char * store_commit(const char *spoolname, int jobid)
+{
+    const char *dir;
+    char *segpath;
+    char *vname;
+    int lockfd, segfd;
+    int current;
+    struct stat st;
+    long offset, length;
+    int size;
+
+    dir = store_directory();
+    if (dir == 0)
+        return 0;
+
+    lockfd = open_lockfile(dir);
+    if (lockfd == -1)
+        return 0;
+    if (lock_store(lockfd, 1) == -1)
+    {
+        close(lockfd);
+        return 0;
+    }
+
+    current = read_current_segment(lockfd);
+    segpath = segment_path(dir, current);
+    segfd = open(segpath, O_RDWR | O_CREAT, 0600);
+    if (segfd != -1 && fstat(segfd, &st) == 0
+            && st.st_size >= max_segment_size())
+    {
+        /* Seal it, and go on with the next one */
+        close(segfd);
+        free(segpath);
+        ++current;
+        write_current_segment(lockfd, current);
+        segpath = segment_path(dir, current);
+        segfd = open(segpath, O_RDWR | O_CREAT, 0600);
+    }
+    if (segfd == -1 || fstat(segfd, &st) != 0)
+    {
+        warning("Cannot open the segment %s", segpath);
+        if (segfd != -1)
+            close(segfd);
+        free(segpath);
+        close(lockfd);
+        return 0;
+    }
+
+    offset = align_up(st.st_size);
+    length = copy_spool(segfd, offset, spoolname);
+    if (length == -1)
+    {
+        /* Leave the segment as it was; the spool remains the output */
+        warning("Cannot append the spool %s to %s", spoolname, segpath);
+        ftruncate(segfd, st.st_size);
+        close(segfd);
+        free(segpath);
+        close(lockfd);
+        return 0;
+    }
+    close(segfd);
+    append_index(segpath, jobid, offset, length);
+
+    /* Releases the lock */
+    close(lockfd);
+
+    unlink(spoolname);
+
+    size = strlen(segpath) + 45;
+    vname = (char *) malloc(size);
+    if (vname == 0)
+        error("Cannot allocate memory for the virtual output name");
+    snprintf(vname, size, "%s@%ld+%ld", segpath, offset, length);
+    free(segpath);
+
+    return vname;
+}
+
+/* Client side. Opens a plain output file or an extent of a segment.
+ * The descriptor is left at *start. *end is -1 for plain files, which
+ * may still grow. */
+int store_open(const char *name, long *start, long *end)
+{
+    char *segpath;
+    int fd;
+
+    *start = 0;
+    *end = -1;
+
+    if (!store_is_virtual(name) || !parse_virtual(name, &segpath, start, end))
+        return open(name, O_RDONLY);
+
+    fd = open(segpath, O_RDONLY);
+    free(segpath);
+    if (fd == -1)
+        return -1;
+    *end = *start + *end;
+    lseek(fd, *start, SEEK_SET);
+    return fd;
+}
+
+/* The bytes released before, from its .dead file */
+static long read_dead(const char *segpath)
+{
+    char *path;
+    FILE *f;
+    long bytes;
+    long dead = 0;
+
+    path = segment_file(segpath, ".dead");
+    f = fopen(path, "r");
+    free(path);
+    if (f == 0)
+        return 0;
+    while (fscanf(f, "%ld", &bytes) == 1)
+        dead += bytes;
+    fclose(f);
+    return dead;
+}
+
+static void append_dead(const char *segpath, long bytes)
+{
+    char *path;
+    int fd;
+
+    path = segment_file(segpath, ".dead");
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    free(path);
+    if (fd == -1)
+        return;
+    fd_nprintf(fd, 30, "%ld\n", bytes);
+    close(fd);
+}
+
+static struct Segment * get_segment(const char *segpath)
+{
+    struct Segment *s;
+
+    for (s = first_segment; s != 0; s = s->next)
+        if (strcmp(s->path, segpath) == 0)
+            return s;
+
+    s = (struct Segment *) malloc(sizeof(*s));
+    if (s == 0)
+        error("Cannot allocate memory for the segment list");
+    s->path = (char *) malloc(strlen(segpath) + 1);
+    if (s->path == 0)
+        error("Cannot allocate memory for the segment list");
+    strcpy(s->path, segpath);
+    s->dead = read_dead(segpath);
+    s->next = first_segment;
+    first_segment = s;
+    return s;
+}
+
+static void forget_segment(struct Segment *s)
+{
+    struct Segment **p;
+
+    for (p = &first_segment; *p != 0; p = &(*p)->next)
+        if (*p == s)
+        {
+            *p = s->next;
+            break;
+        }
+    free(s->path);
+    free(s);
+}
+
+/* Returns 1 if the segment was removed */
+static int try_remove_segment(struct Segment *s)
+{
+    char *dir;
+    char *path;
+    struct stat st;
+    int lockfd;
+    int removed = 0;
+
+    if (stat(s->path, &st) != 0)
+        return errno == ENOENT;
+
+    /* Still some live extent in it */
+    if (st.st_blocks != 0 && s->dead < st.st_size)
+        return 0;
+
+    dir = (char *) malloc(strlen(s->path) + 1);
+    if (dir == 0)
+        error("Cannot allocate memory for the segment dir");
+    strcpy(dir, s->path);
+    *strrchr(dir, '/') = '\0';
+    lockfd = open_lockfile(dir);
+    free(dir);
+    if (lockfd == -1)
+        return 0;
+
+    /* Never remove the segment the clients append to, and don't wait
+     * for them: a busy lock means we will try on the next release. */
+    if (lock_store(lockfd, 0) == 0
+            && segment_number(s->path) < read_current_segment(lockfd))
+    {
+        unlink(s->path);
+        path = segment_file(s->path, ".idx");
+        unlink(path);
+        free(path);
+        path = segment_file(s->path, ".dead");
+        unlink(path);
+        free(path);
+        removed = 1;
+    }
+    close(lockfd);
+    return removed;
+}
+
+/* The segments of the directory with something released, maybe by a
+ * server before this one, to try to remove them with the rest */
+static void scan_segments(const char *segpath)
+{
+    char *dir;
+    char *path;
+    struct dirent *d;
+    DIR *dp;
+    int len;
+
+    dir = (char *) malloc(strlen(segpath) + 1);
+    if (dir == 0)
+        error("Cannot allocate memory for the segment dir");
+    strcpy(dir, segpath);
+    *strrchr(dir, '/') = '\0';
+    dp = opendir(dir);
+    if (dp == 0)
+    {
+        free(dir);
+        return;
+    }
+    while ((d = readdir(dp)) != 0)
+    {
+        len = strlen(d->d_name);
+        if (strncmp(d->d_name, seg_prefix, sizeof(seg_prefix) - 1) != 0
+                || len < 5 || strcmp(d->d_name + len - 5, ".dead") != 0)
+            continue;
+        path = (char *) malloc(strlen(dir) + len + 2);
+        if (path == 0)
+            error("Cannot allocate memory for the segment path");
+        sprintf(path, "%s/%.*s", dir, len - 5, d->d_name);
+        get_segment(path);
+        free(path);
+    }
+    closedir(dp);
+    free(dir);
+}
+
+/* Server side. The job output will not be referenced anymore.
+ * Returns the bytes given back. */
+long store_release(const char *name)
+{
+    char *segpath;
+    long offset, length;
+    struct Segment *s, *next;
+    int fd;
+
+    if (!store_is_virtual(name) || !parse_virtual(name, &segpath, &offset,
+                &length))
+        return 0;
+
+    fd = open(segpath, O_WRONLY);
+    if (fd == -1)
+    {
+        free(segpath);
+        return 0;
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (length > 0)
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                offset, align_up(offset + length) - offset);
+#endif
+    close(fd);
+
+    if (!segments_scanned)
+    {
+        scan_segments(segpath);
+        segments_scanned = 1;
+    }
+    s = get_segment(segpath);
+    s->dead += align_up(offset + length) - offset;
+    append_dead(segpath, align_up(offset + length) - offset);
+    free(segpath);
+
+    for (s = first_segment; s != 0; s = next)
+    {
+        next = s->next;
+        if (try_remove_segment(s))
+            forget_segment(s);
+    }
+
+    return align_up(offset + length) - offset;
+}
@@ -20,13 +20,6 @@
 
 enum { BSIZE=1024 };
 
-static int min(int a, int b)
-{
-    if (a < b)
-        return a;
-    return b;
-}
-
 static int max(int a, int b)
 {
     if (a > b)
@@ -42,33 +35,31 @@ static void tail_error(const char *str)
     exit(-1);
 }
 
-static void seek_at_last_lines(int fd, int lines)
+/* Leaves fd at the start of the last 'lines' lines of [start, end) */
+static void seek_at_last_lines(int fd, int lines, long start, long end)
 {
     char buf[BSIZE];
     int lines_found = 0;
-    int last_lseek = BSIZE;
+    long last_lseek;
     int last_read = 0; /* Only to catch not doing any loop */
-    int move_offset;
     int i = -1; /* Only to catch not doing any loop */
 
-    last_lseek = lseek(fd, 0, SEEK_END);
+    if (end < 0)
+        end = lseek(fd, 0, SEEK_END);
+    last_lseek = end;
 
     do
     {
         int next_read;
-        next_read = min(last_lseek, BSIZE);
+        next_read = (last_lseek - start < BSIZE) ?
+            (int) (last_lseek - start) : BSIZE;
 
-        /* we should end looping if last_lseek == 0
+        /* we should end looping if last_lseek == start
          * This means we already read all the file. */
         if (next_read <= 0)
             break;
 
-        /* last_lseek will be -1 at the beginning of the file,
-         * if we wanted to go farer than it. */
-        last_lseek = lseek(fd, -next_read, SEEK_CUR);
-
-        if (last_lseek == -1)
-            last_lseek = lseek(fd, 0, SEEK_SET);
+        last_lseek = lseek(fd, last_lseek - next_read, SEEK_SET);
 
         last_read = read(fd, buf, next_read);
         if (last_read == -1)
@@ -90,14 +81,10 @@ static void seek_at_last_lines(int fd, int lines)
                     break;
             }
         }
-        
-        /* Go back the read bytes */
-        last_lseek = lseek(fd, -last_read, SEEK_CUR);
     } while(lines_found < lines);
 
     /* Calculate the position */
-    move_offset = i+1;
-    lseek(fd, move_offset, SEEK_CUR);
+    lseek(fd, last_lseek + i + 1, SEEK_SET);
 }
 
 static void set_non_blocking(int fd)
@@ -117,16 +104,21 @@ int tail_file(const char *fname, int last_lines)
     int end_res = 0;
     int endfile_reached = 0;
     int could_write = 1;
+    long pos, end;
 
     fd_set readset, errorset;
 
-    fd = open(fname, O_RDONLY);
+    /* The output may be an extent of a segment of the output store */
+    fd = store_open(fname, &pos, &end);
 
     if (fd == -1)
         tail_error("Error: cannot open the output file");
 
     if (last_lines >= 0)
-        seek_at_last_lines(fd, last_lines);
+    {
+        seek_at_last_lines(fd, last_lines, pos, end);
+        pos = lseek(fd, 0, SEEK_CUR);
+    }
 
     /* we don't want the next read calls to block. */
     set_non_blocking(fd);
@@ -171,7 +163,10 @@ int tail_file(const char *fname, int last_lines)
         }
 
         /* We always read when select awakes */
-        res = read(fd, buf, BSIZE);
+        if (end >= 0)
+            res = read(fd, buf, (end - pos < BSIZE) ? (int) (end - pos) : BSIZE);
+        else
+            res = read(fd, buf, BSIZE);
         if (res == -1)
         {
             if (errno == EINTR || errno == EAGAIN)
@@ -185,7 +180,10 @@ int tail_file(const char *fname, int last_lines)
         if (res == 0)
             endfile_reached = 1;
         else
+        {
             endfile_reached = 0;
+            pos += res;
+        }
 
         if (!FD_ISSET(1, &errorset))
         {
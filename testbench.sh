@@ -162,3 +162,273 @@ ts -w $J3 || echo Error twice jobs 1
 ts -w $J4 || echo Error twice jobs 2
 
 ./ts -K
+
+# Test the output store
+STORE=`mktemp -d`
+export TS_OUTPUT_STORE=$STORE
+./ts sh -c "echo stored output"
+./ts -w
+./ts -o | grep -q "ts-seg" || echo Error output store name
+./ts -c | grep -q "stored output" || echo Error output store cat
+./ts -C
+unset TS_OUTPUT_STORE
+rm -rf $STORE
+
+# Test the output limit
+./ts --max-output 10 sh -c "echo 12345678901234567890"
+./ts -w
+test `wc -c < \`./ts -o\`` -eq 10 || echo Error output limit size
+./ts -l | grep -q "(truncated)" || echo Error output limit list
+
+# Test grep
+./ts -L greptest sh -c "echo first; echo the needle; echo last"
+./ts -w
+./ts --grep needle -L greptest | grep -q ":the needle$" || echo Error grep
+test -z "`./ts --grep needle --state queued`" || echo Error grep state filter
+
+# Test the line index
+./ts -K
+export TS_INDEX_LINES=10
+./ts seq 1 100
+./ts -w
+test -f "`./ts -o`.idx" || echo Error line index file
+test "`./ts --lines 55-56 -c`" = "55
+56" || echo Error line range
+test "`./ts --bytes 0-1 -c`" = "1" || echo Error byte range
+unset TS_INDEX_LINES
+
+# Test the machine readable list
+./ts true
+./ts -w
+./ts -M | tail -n 1 | awk -F '\t' 'NF != 15 || $2 != "finished" { exit 1 }' \
+    || echo Error machine list
+
+# Test the timeout
+./ts --timeout 1 sleep 10
+./ts -w
+./ts -i | grep -q "Timed out after 1 s" || echo Error timeout
+./ts -l | grep -q "(timeout) sleep 10" || echo Error timeout list
+
+# Test the retries: fails once, then works
+RETRYFILE=`mktemp`
+./ts --retries 2 sh -c "echo >> $RETRYFILE; test \`wc -l < $RETRYFILE\` -ge 2"
+./ts -w
+test $? -eq 0 || echo Error retries errorlevel
+./ts -i | grep -q "^Attempt 1 of 3: exit code 1" || echo Error retries info
+./ts -f --retries 1 --retry-on 7 sh -c "exit 3"
+test $? -eq 3 || echo Error retry-on
+rm -f $RETRYFILE
+
+# Test the memory budget: a job known to go over it waits for the other
+./ts -K
+export TS_MEMORY_BUDGET=1k
+./ts -S 2
+./ts -L mem true
+./ts -w
+./ts -L mem sleep 2
+./ts -L mem sleep 2
+sleep 0.5
+test "`./ts -M | awk -F '\t' '$2 == "running"' | wc -l`" -eq 1 \
+    || echo Error memory budget admission
+./ts --stats | grep -q "^Memory budget: .* of 1 KiB" || echo Error memory stats
+./ts -w
+unset TS_MEMORY_BUDGET
+
+# Test the start rate
+./ts -K
+export TS_START_RATE=2:1
+./ts -S 3
+./ts true
+./ts true
+./ts true
+./ts -w
+./ts --stats | grep -q "^Start rate: 2/s, burst 1, .* 3 jobs started" \
+    || echo Error start rate
+unset TS_START_RATE
+
+# Test the AIMD limit: it grows on success, halves on failure
+./ts -K
+export TS_AIMD=aimd=4
+./ts -S 3
+./ts -L aimd true
+./ts -L aimd true
+./ts -w
+./ts --stats | grep -q "^AIMD aimd: 0 running, limit 2.50 of 4; 2 ok" \
+    || echo Error aimd increase
+./ts -L aimd false
+./ts -w
+./ts --stats | grep -q "limit 1.25 of 4; 2 ok, 0 slow, 1 failed" \
+    || echo Error aimd decrease
+unset TS_AIMD
+
+# Test the preemption
+./ts -S 1
+./ts sleep 2
+sleep 0.5
+./ts --priority 1 true
+./ts -w
+./ts -i | grep -q "^Suspended for the job" || echo Error preemption
+./ts -l | grep -q "(suspended)" && echo Error suspended job left
+
+# Test the pre-forked jobs
+export TS_PREFORK=1
+./ts sleep 1
+J=`./ts echo prefork`
+sleep 0.2
+OUTS=`ls ${TMPDIR:-/tmp} | grep -c "^ts-out"`
+K=`./ts echo removed`
+sleep 0.2
+./ts -r $K
+sleep 0.2
+test `ls ${TMPDIR:-/tmp} | grep -c "^ts-out"` -eq $OUTS \
+    || echo Error prefork output of a removed job
+./ts -w
+./ts -c $J | grep -q "^prefork$" || echo Error prefork output
+./ts -i $J | grep -q "^Launch latency: " || echo Error prefork latency
+unset TS_PREFORK
+
+# Test the batches
+printf 'echo one\n\n# comment\nfalse\necho two | cat\n' |
+    ./ts --batch - > /dev/null
+./ts -w
+test $? -eq 1 || echo Error batch exit code
+test "`./ts -c`" = "one
+two" || echo Error batch output
+./ts -l | grep -q "(1/3 failed) batch -" || echo Error batch list
+./ts -i | grep -q "^First failure: command 2, exit code 1" \
+    || echo Error batch info
+
+# Test the result cache
+./ts -K
+CACHEFILE=`mktemp`
+INPUT=`mktemp`
+rm -f $CACHEFILE
+export TS_CACHE=$CACHEFILE
+echo one > $INPUT
+./ts --input $INPUT cat $INPUT > /dev/null
+./ts -w
+./ts --input $INPUT cat $INPUT > /dev/null
+./ts -w
+./ts -l | grep -q "(cached) cat" || echo Error cache hit
+test "`./ts -c`" = "one" || echo Error cached output
+echo other > $INPUT
+touch -d "1 hour ago" $INPUT
+./ts --input $INPUT cat $INPUT > /dev/null
+./ts -w
+test "`./ts -c`" = "other" || echo Error cache miss on input change
+./ts --stats | grep -q "^Result cache: 2 of 1000 entries, 1 hits, 2 misses" \
+    || echo Error cache stats
+
+# A cleared output in the store is not a hit anymore
+./ts -K
+STORE=`mktemp -d`
+export TS_OUTPUT_STORE=$STORE
+./ts --cache echo stored > /dev/null
+./ts -w
+./ts -C
+./ts --cache echo stored > /dev/null
+./ts -w
+./ts -l | grep -q "(cached) echo" && echo Error cache hit of a cleared output
+test "`./ts -c`" = "stored" || echo Error output after a cleared cache hit
+unset TS_OUTPUT_STORE
+rm -rf $STORE
+unset TS_CACHE
+rm -f $CACHEFILE $INPUT
+
+# Test the idempotency keys
+J=`./ts --key same sh -c 'sleep 1; exit 3'`
+K=`./ts --key same true`
+test "$J" = "$K" || echo Error key not attached
+./ts -f --key same true > /dev/null
+test $? -eq 3 || echo Error key exit code
+K=`./ts --key same true`
+test "$J" = "$K" && echo Error key of a finished job
+./ts -w
+
+# Test the dependency graphs
+A=`./ts -L dagtest sleep 1`
+B=`./ts -L dagtest false`
+C=`./ts -D $A,$B true`
+D=`./ts -D $A,$B --depend-mode any-ok true`
+E=`./ts --depend-label dagtest --depend-mode always true`
+./ts -w $D
+./ts -w $E
+test "`./ts -s $C`" = skipped || echo Error all-ok after a failure
+test "`./ts -s $D`" = finished || echo Error any-ok after a success
+test "`./ts -s $E`" = finished || echo Error always after a failure
+
+# Test the run time prediction
+./ts sleep 1
+./ts sleep 1
+./ts -l | grep -q "eta .*sleep 1" || echo Error no eta in the list
+./ts -l | grep -q "drain" || echo Error no drain in the list
+./ts -w
+
+# Test the dataflow pipes
+A=`./ts --pipe-out seq 1 3`
+B=`./ts --pipe-from $A wc -l`
+./ts -w $B
+test "`./ts -c $B`" = 3 || echo Error pipe output
+A=`./ts --pipe-out seq 1 3`
+B=`./ts --pipe-tee $A wc -l`
+./ts -w $B
+test "`./ts -c $A | wc -l`" = 3 || echo Error pipe tee
+A=`./ts true`
+./ts -w $A
+B=`./ts --pipe-from $A cat`
+./ts -w $B
+test "`./ts -s $B`" = skipped || echo Error pipe from a finished job
+
+# Test the delayed and recurring jobs
+A=`./ts --at 2s true`
+./ts -l | grep -q "at [0-9:]* *true" || echo Error no start time in the list
+./ts -w $A
+test "`./ts -s $A`" = finished || echo Error delayed job not run
+A=`./ts --every 1s true`
+sleep 3
+./ts -i $A | grep -q "^Run 2:" || echo Error recurring job not run again
+./ts -r $A
+
+# Test the outputs of the runs before are reclaimed
+./ts -K
+export TS_RECLAIM=1
+A=`./ts --every 1s echo x`
+sleep 3
+./ts --stats | grep -q "^Reclaimed outputs: [1-9]" \
+    || echo Error recurring outputs not reclaimed
+./ts -r $A
+unset TS_RECLAIM
+
+# Test the watches
+WATCHDIR=`mktemp -d`
+W=`./ts --watch $WATCHDIR --glob '*.txt' cat {}`
+echo watched > $WATCHDIR/a.txt
+echo ignored > $WATCHDIR/b.dat
+sleep 1
+A=`./ts -M | awk -F '\t' '$15 ~ /^cat .*a\.txt$/ { print $1 }'`
+if [ -z "$A" ]; then
+    echo Error watched file not queued
+else
+    ./ts -w $A
+    test "`./ts -c $A`" = watched || echo Error watched file not run
+fi
+./ts -M | grep -q "b.dat" && echo Error watch glob not applied
+./ts --unwatch $W
+rm -r $WATCHDIR
+
+# Test the slots of each user, and the user lines of the list
+./ts -K
+export TS_USER_SLOTS='*=1'
+export TS_FAIR_SHARE='*=3'
+./ts -S 2
+./ts sleep 2 > /dev/null
+./ts sleep 2 > /dev/null
+sleep 0.5
+test "`./ts -M | awk -F '\t' '$2 == "running"' | wc -l`" -eq 1 \
+    || echo Error user slots
+./ts -l | grep -q "^User .*: 1 slots running of 1, 1 queued, share 3" \
+    || echo Error user line
+./ts -w
+unset TS_USER_SLOTS TS_FAIR_SHARE
+
+./ts -K
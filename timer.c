@@ -0,0 +1,196 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/* Timer wheel.
+ * Server side timers with a resolution of one second, in four levels of
+ * 64 slots: the first level holds the next 64 seconds, the second the next
+ * 64*64, and so on up to about 194 days (later timers wait in the last
+ * slot). Adding a timer is O(1). Every 64 seconds, the timers of the next
+ * slot of the second level are spread over the first, and the same for the
+ * upper levels. The server loop sleeps until the next non-empty slot, of
+ * the first level or to cascade, and timer_run() fires what expired.
+ * Timers are not cancelled: the jobs check their state when they fire. */
+
+enum
+{
+    WHEEL_BITS = 6,
+    WHEEL_SIZE = 1 << WHEEL_BITS,
+    WHEEL_MASK = WHEEL_SIZE - 1,
+    WHEEL_LEVELS = 4
+};
+
+struct Timer
+{
+    time_t expires;
+    enum Timer_type type;
+    int jobid;
+    struct Timer *next;
+};
+
+/* Globals */
+static struct Timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static time_t wheel_time = 0; /* all before it has fired */
+static int timers = 0;
+
+static int slot_index(time_t t, int level)
+{
+    return (t >> (level * WHEEL_BITS)) & WHEEL_MASK;
+}
+
+static void insert(struct Timer *t)
+{
+    time_t when;
+    int level;
+
+    when = t->expires;
+    if (when < wheel_time)
+        when = wheel_time;
+
+    for (level = 0; level < WHEEL_LEVELS - 1; ++level)
+        if (when - wheel_time < (time_t) 1 << ((level + 1) * WHEEL_BITS))
+            break;
+    /* Too far: it waits in the last slot, and goes round again */
+    if (when - wheel_time >= (time_t) 1 << (WHEEL_LEVELS * WHEEL_BITS))
+        when = wheel_time + ((time_t) 1 << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+
+    t->next = wheel[level][slot_index(when, level)];
+    wheel[level][slot_index(when, level)] = t;
+}
+
+/* Server side */
+void timer_add(int seconds, enum Timer_type type, int jobid)
+{
+    struct Timer *t;
+
+    if (wheel_time == 0)
+        wheel_time = time(NULL);
+
+    t = (struct Timer *) malloc(sizeof(*t));
+    if (t == 0)
+        error("Cannot allocate memory for a timer");
+    t->expires = time(NULL) + seconds;
+    t->type = type;
+    t->jobid = jobid;
+    insert(t);
+    ++timers;
+}
+
+/* Moves the timers of the current slot of the level to the lower ones.
+ * Returns the index, as the caller cascades the next level on 0. */
+static int cascade(int level)
+{
+    struct Timer *t, *next;
+    int index;
+
+    index = slot_index(wheel_time, level);
+    t = wheel[level][index];
+    wheel[level][index] = 0;
+    for (; t != 0; t = next)
+    {
+        next = t->next;
+        insert(t);
+    }
+    return index;
+}
+
+/* Fires the timers expired until now */
+void timer_run()
+{
+    time_t now;
+
+    if (timers == 0)
+    {
+        wheel_time = 0;
+        return;
+    }
+
+    now = time(NULL);
+    while (wheel_time <= now)
+    {
+        struct Timer *t, *next;
+        int index;
+        int level;
+
+        index = slot_index(wheel_time, 0);
+        if (index == 0)
+            for (level = 1; level < WHEEL_LEVELS; ++level)
+                if (cascade(level) != 0)
+                    break;
+
+        t = wheel[0][index];
+        wheel[0][index] = 0;
+        ++wheel_time;
+
+        /* The handlers may add timers */
+        for (; t != 0; t = next)
+        {
+            next = t->next;
+            if (t->expires > now)
+            {
+                insert(t);
+                continue;
+            }
+            --timers;
+            s_timer_fired(t->type, t->jobid);
+            free(t);
+        }
+    }
+}
+
+/* When the level moves the timers of its next non-empty slot down, or 0
+ * if it has none. The current slot of each level cascades at its start. */
+static time_t next_cascade(int level)
+{
+    int bits = level * WHEEL_BITS;
+    time_t period = wheel_time >> bits;
+    int i;
+
+    i = (period << bits) == wheel_time ? 0 : 1;
+    for (; i <= WHEEL_SIZE; ++i)
+        if (wheel[level][slot_index((period + i) << bits, level)] != 0)
+            return (period + i) << bits;
+    return 0;
+}
+
+/* Seconds until the next slot with timers, -1 if there are none. There is
+ * no wake up for the empty cascades: a timer days ahead costs one per level
+ * on its way down. */
+int timer_timeout()
+{
+    time_t now;
+    time_t next = 0;
+    int level;
+    int i;
+
+    if (timers == 0)
+        return -1;
+
+    now = time(NULL);
+    if (wheel_time <= now)
+        return 0;
+    for (i = 0; i < WHEEL_SIZE; ++i)
+        if (wheel[0][slot_index(wheel_time + i, 0)] != 0)
+        {
+            next = wheel_time + i;
+            break;
+        }
+    for (level = 1; level < WHEEL_LEVELS; ++level)
+    {
+        time_t t = next_cascade(level);
+        if (t != 0 && (next == 0 || t < next))
+            next = t;
+    }
+    return next > now ? next - now : 0;
+}
@@ -0,0 +1,386 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "main.h"
+
+/* Watches.
+ * A watch rule (--watch) has a directory, a glob and a command. The server
+ * follows the directory with inotify, and for each file of it closed after
+ * writing or moved into it, matching the glob, queues the command itself,
+ * {} being the path of the file (or the path last, without any {}). No
+ * client waits for those jobs: when one is to run, the server forks a
+ * client for it, which takes the job (TAKEJOB) and runs it in the directory.
+ * While the job of a file has not started, the events of the file add no
+ * other; with TS_WATCH_SETTLE, it waits till the file was left alone those
+ * seconds. Hidden files don't match, unless the glob starts with a dot. */
+
+enum
+{
+    WATCH_BUFFER = 4096
+};
+
+struct Watch
+{
+    int id;
+    int wd; /* Of inotify. Rules of the same directory share it */
+    char *dir;
+    char *glob; /* 0 means any file */
+    char *label; /* 0 if none */
+    char *args; /* The command, each argument ending in '\0' */
+    int args_size;
+    int num_slots;
+    int uid; /* Who added it, for the jobs */
+    long queued; /* Jobs queued */
+    long coalesced; /* Events that queued none */
+    struct Watch *next;
+};
+
+/* Globals */
+static struct Watch *first_watch = 0;
+static int inotify_fd = -1;
+static int next_id = 1;
+static int settle = 0; /* Seconds, from TS_WATCH_SETTLE */
+
+/* Server side */
+
+static char * copy_string(const char *str)
+{
+    char *copy;
+
+    if (str == 0)
+        return 0;
+    copy = (char *) malloc(strlen(str) + 1);
+    if (copy == 0)
+        error("Cannot allocate memory for the watch");
+    strcpy(copy, str);
+    return copy;
+}
+
+static void free_watch(struct Watch *w)
+{
+    free(w->dir);
+    free(w->glob);
+    free(w->label);
+    free(w->args);
+    free(w);
+}
+
+/* On start */
+void watch_init()
+{
+    char *str;
+
+    str = getenv("TS_WATCH_SETTLE");
+    if (str != NULL)
+        settle = abs(atoi(str));
+}
+
+/* Returns the id, or -1 with errno */
+int watch_add(const char *dir, const char *glob, const char *label,
+        int num_slots, const char *args, int args_size, int uid)
+{
+#ifdef __linux__
+    struct Watch *w;
+    struct Watch **last;
+    int wd;
+
+    if (inotify_fd == -1)
+    {
+        inotify_fd = inotify_init();
+        if (inotify_fd == -1)
+            return -1;
+        fcntl(inotify_fd, F_SETFL, O_NONBLOCK);
+        fcntl(inotify_fd, F_SETFD, FD_CLOEXEC);
+    }
+    wd = inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO
+            | IN_ONLYDIR);
+    if (wd == -1)
+        return -1;
+
+    w = (struct Watch *) malloc(sizeof(*w));
+    if (w == 0)
+        error("Cannot allocate memory for the watch");
+    w->id = next_id++;
+    w->wd = wd;
+    w->dir = copy_string(dir);
+    w->glob = copy_string(glob);
+    w->label = copy_string(label);
+    w->args = (char *) malloc(args_size);
+    if (w->args == 0)
+        error("Cannot allocate memory for the watch");
+    memcpy(w->args, args, args_size);
+    w->args_size = args_size;
+    w->num_slots = num_slots > 0 ? num_slots : 1;
+    w->uid = uid;
+    w->queued = 0;
+    w->coalesced = 0;
+    w->next = 0;
+
+    for (last = &first_watch; *last != 0; last = &(*last)->next)
+        ;
+    *last = w;
+    return w->id;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Whether it was there */
+int watch_remove(int id)
+{
+    struct Watch **last;
+    struct Watch *w;
+    struct Watch *other;
+
+    for (last = &first_watch; *last != 0; last = &(*last)->next)
+        if ((*last)->id == id)
+            break;
+    w = *last;
+    if (w == 0)
+        return 0;
+    *last = w->next;
+
+#ifdef __linux__
+    for (other = first_watch; other != 0; other = other->next)
+        if (other->wd == w->wd)
+            break;
+    if (other == 0)
+        inotify_rm_watch(inotify_fd, w->wd);
+#else
+    other = 0;
+#endif
+    free_watch(w);
+    return 1;
+}
+
+int watch_fdset(fd_set *readset, int maxfd)
+{
+    if (inotify_fd == -1)
+        return maxfd;
+    FD_SET(inotify_fd, readset);
+    return inotify_fd > maxfd ? inotify_fd : maxfd;
+}
+
+/* The directory and the command, {} as the path. Malloc'ed. */
+static char * job_args(const struct Watch *w, const char *name, int *size)
+{
+    const char *arg;
+    const char *brace;
+    char *args;
+    char *ptr;
+    int pathlen;
+    int replaced = 0;
+
+    pathlen = strlen(w->dir) + 1 + strlen(name);
+
+    /* The worst case: all of it braces, or the path last */
+    *size = strlen(w->dir) + 1 + w->args_size
+        + (w->args_size / 2 + 1) * pathlen + 1;
+    args = (char *) malloc(*size);
+    if (args == 0)
+        error("Cannot allocate memory for the job of the watch %i", w->id);
+
+    strcpy(args, w->dir);
+    ptr = args + strlen(args) + 1;
+    for (arg = w->args; arg < w->args + w->args_size; arg += strlen(arg) + 1)
+    {
+        while ((brace = strstr(arg, "{}")) != 0)
+        {
+            memcpy(ptr, arg, brace - arg);
+            ptr += brace - arg;
+            sprintf(ptr, "%s/%s", w->dir, name);
+            ptr += pathlen;
+            arg = brace + 2;
+            replaced = 1;
+        }
+        strcpy(ptr, arg);
+        ptr += strlen(arg) + 1;
+    }
+    if (!replaced)
+    {
+        sprintf(ptr, "%s/%s", w->dir, name);
+        ptr += pathlen + 1;
+    }
+    *size = ptr - args;
+    return args;
+}
+
+static void file_event(int wd, const char *name)
+{
+    struct Watch *w;
+    char *args;
+    int size;
+
+    for (w = first_watch; w != 0; w = w->next)
+    {
+        if (w->wd != wd)
+            continue;
+        if (fnmatch(w->glob != 0 ? w->glob : "*", name, FNM_PERIOD) != 0)
+            continue;
+        args = job_args(w, name, &size);
+        if (s_watch_coalesce(args, size, settle))
+        {
+            ++w->coalesced;
+            free(args);
+            continue;
+        }
+        /* The job keeps args */
+        s_add_watched_job(w->id, w->uid, w->label, w->num_slots, args, size,
+                settle);
+        ++w->queued;
+    }
+}
+
+void watch_process(fd_set *readset)
+{
+#ifdef __linux__
+    union
+    {
+        struct inotify_event event;
+        char bytes[WATCH_BUFFER];
+    } buffer;
+    const struct inotify_event *ev;
+    int res;
+    int i;
+
+    if (inotify_fd == -1 || !FD_ISSET(inotify_fd, readset))
+        return;
+
+    /* All the events pending, at once */
+    while ((res = read(inotify_fd, buffer.bytes, sizeof(buffer))) > 0)
+        for (i = 0; i < res; i += sizeof(*ev) + ev->len)
+        {
+            ev = (const struct inotify_event *) (buffer.bytes + i);
+            if (ev->mask & IN_Q_OVERFLOW)
+                warning("Events of the watches lost");
+            else if (ev->len > 0 && !(ev->mask & IN_ISDIR))
+                file_event(ev->wd, ev->name);
+        }
+#endif
+}
+
+/* In the client forked for the job. It doesn't return. */
+static void take_job(int jobid, const char *args, int size)
+{
+    static char *none[] = { 0 };
+    struct msg m;
+    const char *arg;
+    int fd;
+    int n;
+
+    /* Those of the server: the listen socket, the clients... */
+    for (fd = 0; fd < FD_SETSIZE; ++fd)
+        close(fd);
+    open("/dev/null", O_RDWR);
+    dup(0);
+    dup(0);
+    signal(SIGTERM, SIG_DFL);
+    process_type = CLIENT;
+
+    default_command_line();
+    chdir(args);
+    n = 0;
+    for (arg = args + strlen(args) + 1; arg < args + size;
+            arg += strlen(arg) + 1)
+        ++n;
+    command_line.command.array = (char **) malloc((n + 1) * sizeof(char *));
+    if (command_line.command.array == 0)
+        command_line.command.array = none;
+    n = 0;
+    for (arg = args + strlen(args) + 1; arg < args + size;
+            arg += strlen(arg) + 1)
+        command_line.command.array[n++] = (char *) arg;
+    command_line.command.array[n] = 0;
+    command_line.command.num = n;
+
+    server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_socket == -1 || try_connect(server_socket) == -1)
+        exit(-1);
+    m.type = TAKEJOB;
+    m.u.jobid = jobid;
+    send_msg(server_socket, &m);
+    c_wait_server_commands();
+    exit(0);
+}
+
+/* For the job of a watch, when it is to run. The client forked for it is
+ * left to init, as if it came from outside. */
+void watch_run_job(int jobid)
+{
+    const char *args;
+    int size;
+    int pid = -1;
+    int status = 0;
+
+    args = s_job_args(jobid, &size);
+    if (args == 0)
+        warning("The job %i to run has no client", jobid);
+    else
+    {
+        pid = fork();
+        if (pid == 0)
+        {
+            pid = fork();
+            if (pid == 0)
+                take_job(jobid, args, size);
+            _exit(pid == -1);
+        }
+        if (pid == -1 || waitpid(pid, &status, 0) == -1 || status != 0)
+        {
+            warning("Cannot fork the client of the job %i", jobid);
+            pid = -1;
+        }
+    }
+    if (pid == -1)
+    {
+        struct Result r;
+
+        clear_result(&r);
+        r.errorlevel = -1;
+        job_finished(&r, jobid);
+        check_notify_list(jobid);
+    }
+}
+
+/* For --stats */
+void watch_stats(int s)
+{
+    char line[CMD_LEN + 300];
+    struct Watch *w;
+    int len;
+    int i;
+
+    for (w = first_watch; w != 0; w = w->next)
+    {
+        snprintf(line, sizeof(line), "Watch %i: %.200s/%s, %ld jobs, "
+                "%ld events coalesced: ", w->id, w->dir,
+                w->glob != 0 ? w->glob : "*", w->queued, w->coalesced);
+        len = strlen(line);
+        for (i = 0; i < w->args_size && len < (int) sizeof(line) - 2; ++i)
+            line[len++] = w->args[i] != '\0' ? w->args[i] : ' ';
+        line[len - 1] = '\n';
+        line[len] = '\0';
+        send_list_line(s, line);
+    }
+}